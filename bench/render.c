@@ -0,0 +1,189 @@
+// This benchmark loads every map in the data directory the way the game does
+// and draws a scripted camera path through each at several screen sizes. It
+// times the column pass (walls, floors, and ceilings) and the sprite pass
+// separately and prints one tab-separated line of results per map and size,
+// after a header line naming the fields. It includes the d3d source to time the
+// two steps d3d_draw takes; the rest of the game is linked in as usual (see the
+// Makefile.) The cameras draw with one thread and no options, so the numbers
+// only measure the drawing itself.
+
+#include "../external/d3d/d3d.c"
+#include "../src/config.h"
+#include "../src/ent.h"
+#include "../src/loader.h"
+#include "../src/logger.h"
+#include "../src/map.h"
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define N_FRAMES 60
+
+// The path goes around this far from the player's start, in tiles.
+#define PATH_RADIUS 0.3
+
+static const struct { size_t width, height; } sizes[] = {
+	{ 80, 24 }, { 160, 48 }, { 240, 72 }, { 320, 96 }, { 500, 150 }
+};
+
+static double seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// List the names of the maps in the directory, sorted so that runs line up. The
+// number of names is put in n. NULL is returned if the directory can't be read.
+static char **list_maps(const char *dir_path, size_t *n)
+{
+	DIR *dir = opendir(dir_path);
+	if (!dir) return NULL;
+	char **names = NULL;
+	size_t cap = 0;
+	*n = 0;
+	struct dirent *ent;
+	while ((ent = readdir(dir))) {
+		size_t len = strlen(ent->d_name);
+		if (len <= 5 || strcmp(ent->d_name + len - 5, ".json")) continue;
+		if (*n == cap) {
+			cap = cap ? cap * 2 : 16;
+			names = realloc(names, cap * sizeof(*names));
+			if (!names) abort();
+		}
+		names[*n] = malloc(len - 4);
+		if (!names[*n]) abort();
+		memcpy(names[*n], ent->d_name, len - 5);
+		names[(*n)++][len - 5] = '\0';
+	}
+	closedir(dir);
+	qsort(names, *n, sizeof(*names), compare_names);
+	return names;
+}
+
+// The scripted path: a small loop around the player's start, turning twice
+// around in that time.
+static void frame_pose(const struct map *map, int frame, d3d_vec_s *pos,
+	d3d_scalar *facing)
+{
+	double t = (double)frame / N_FRAMES * 2 * (double)PI;
+	pos->x = map->player.pos.x + (d3d_scalar)(cos(t) * PATH_RADIUS);
+	pos->y = map->player.pos.y + (d3d_scalar)(sin(t) * PATH_RADIUS);
+	*facing = (d3d_scalar)(t * 2);
+}
+
+// Draw one frame in the same steps as d3d_draw, adding the time spent in each
+// to the totals. The number of sprites drawn is returned.
+static size_t timed_draw(d3d_camera *cam, d3d_vec_s pos, d3d_scalar facing,
+	const d3d_board *board, size_t n_sprites, const d3d_sprite_s sprites[],
+	double *column_time, double *sprite_time)
+{
+	struct draw_job job;
+	double start = seconds();
+	bool in_board = begin_draw(&job, cam, pos, facing, board, sprites);
+	double middle = seconds();
+	if (in_board) finish_draw(&job, n_sprites);
+	double end = seconds();
+	*column_time += middle - start;
+	*sprite_time += end - middle;
+	return in_board ? job.n_sprites : 0;
+}
+
+// Print the results of drawing the map at every size.
+static void bench_map(const char *name, struct map *map)
+{
+	struct ents ents;
+	ents_init(&ents, map->n_ents);
+	for (size_t i = 0; i < map->n_ents; ++i) {
+		ents_add(&ents, map->ents[i].type, map->ents[i].team,
+			&map->ents[i].pos);
+	}
+	size_t n_sprites = ents_num(&ents);
+	const d3d_sprite_s *sprites = ents_sprites(&ents);
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); ++s) {
+		size_t width = sizes[s].width, height = sizes[s].height;
+		// The sizes are all wider than they are tall, so the field of
+		// view is worked out like in camera_with_dims:
+		d3d_camera *cam = d3d_new_camera(CAM_FOV_X,
+			CAM_FOV_X / PIXEL_ASPECT * height / width, width, height,
+			0);
+		if (!cam) abort();
+		double column_time = 0, sprite_time = 0;
+		size_t drawn = 0;
+		d3d_vec_s pos;
+		d3d_scalar facing;
+		// The first frame only warms up the caches, so it's not
+		// counted:
+		frame_pose(map, 0, &pos, &facing);
+		d3d_draw(cam, pos, facing, map->board, n_sprites, sprites);
+		for (int i = 0; i < N_FRAMES; ++i) {
+			frame_pose(map, i, &pos, &facing);
+			drawn += timed_draw(cam, pos, facing, map->board,
+				n_sprites, sprites, &column_time, &sprite_time);
+		}
+		double per_frame = 1e9 / N_FRAMES;
+		double n_pixels = (double)width * height;
+		printf("%s\t%zu\t%zu\t%d\t%.1f\t%.1f\t%.1f\t%.2f\t%.3f"
+			"\t%.1f\t%.2f\t%.3f\n",
+			name, width, height, N_FRAMES, (double)drawn / N_FRAMES,
+			(column_time + sprite_time) * per_frame,
+			column_time * per_frame,
+			column_time * per_frame / width,
+			column_time * per_frame / n_pixels,
+			sprite_time * per_frame,
+			sprite_time * per_frame / width,
+			sprite_time * per_frame / n_pixels);
+		d3d_free_camera(cam);
+	}
+	ents_destroy(&ents);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s DATA-DIR\n", argv[0]);
+		return 2;
+	}
+	struct loader ldr;
+	struct logger log;
+	logger_init(&log);
+	loader_init(&ldr, argv[1]);
+	logger_free(loader_set_logger(&ldr, &log));
+	// The path of the map with an empty name is the directory followed by
+	// ".json":
+	char *maps_dir = loader_map_path(&ldr, "");
+	maps_dir[strlen(maps_dir) - 5] = '\0';
+	size_t n_maps;
+	char **names = list_maps(maps_dir, &n_maps);
+	if (!names) {
+		perror(maps_dir);
+		return 1;
+	}
+	free(maps_dir);
+	int ret = 0;
+	printf("map\twidth\theight\tframes\tsprites_per_frame\tns_per_frame"
+		"\tcolumns_ns_per_frame\tcolumns_ns_per_column"
+		"\tcolumns_ns_per_pixel\tsprites_ns_per_frame"
+		"\tsprites_ns_per_column\tsprites_ns_per_pixel\n");
+	for (size_t i = 0; i < n_maps; ++i) {
+		struct map *map = load_map(&ldr, names[i]);
+		if (map) {
+			bench_map(names[i], map);
+		} else {
+			fprintf(stderr, "Failed to load map \"%s\"\n",
+				names[i]);
+			ret = 1;
+		}
+		free(names[i]);
+	}
+	free(names);
+	loader_free(&ldr);
+	logger_free(&log);
+	return ret;
+}
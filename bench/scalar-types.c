@@ -0,0 +1,147 @@
+// This benchmark renders the same frames of a generated board and reports the
+// time per frame. It is built once for each scalar type (see the Makefile.) The
+// first build writes its frames to a file, and later builds compare their
+// frames to those, reporting the largest fraction of pixels that differ in any
+// frame. It includes the d3d source so that everything is built with the same
+// D3D_SCALAR_TYPE.
+
+#include "../external/d3d/d3d.c"
+#include <stdio.h>
+#include <time.h>
+
+#define BOARD_SIZE 48
+#define CAM_WIDTH 200
+#define CAM_HEIGHT 60
+#define N_FRAMES 400
+#define N_SPRITES 40
+
+#define NAME_OF(type) NAME_OF_(type)
+#define NAME_OF_(type) #type
+#ifdef D3D_SCALAR_TYPE
+#	define SCALAR_NAME NAME_OF(D3D_SCALAR_TYPE)
+#else
+#	define SCALAR_NAME "double"
+#endif
+
+static unsigned long bench_rand(unsigned long *state)
+{
+	*state = *state * 1103515245 + 12345;
+	return *state / 65536 % 32768;
+}
+
+static double seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The scripted path: a loop around the middle of the board, turning as it goes.
+// This is worked out in double for every build so that all builds draw from the
+// same poses, give or take rounding.
+static void frame_pose(int frame, d3d_vec_s *pos, d3d_scalar *facing)
+{
+	double t = (double)frame / N_FRAMES * 2 * 3.14159265358979323846;
+	pos->x = (d3d_scalar)(BOARD_SIZE / 2 + cos(t) * BOARD_SIZE / 3);
+	pos->y = (d3d_scalar)(BOARD_SIZE / 2 + sin(t) * BOARD_SIZE / 3);
+	*facing = (d3d_scalar)(t * 3);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 3
+	 || (strcmp(argv[1], "write") && strcmp(argv[1], "compare"))) {
+		fprintf(stderr, "Usage: %s write|compare FRAMES-FILE\n", argv[0]);
+		return 2;
+	}
+	bool writing = !strcmp(argv[1], "write");
+	FILE *frames = fopen(argv[2], writing ? "wb" : "rb");
+	if (!frames) {
+		perror(argv[2]);
+		return 1;
+	}
+	d3d_texture *txtrs[3];
+	for (size_t i = 0; i < 3; ++i) {
+		txtrs[i] = d3d_new_texture(8 + i, 8, 0);
+		if (!txtrs[i]) goto error_memory;
+		for (size_t x = 0; x < 8 + i; ++x) {
+			for (size_t y = 0; y < 8; ++y) {
+				*d3d_texture_get(txtrs[i], x, y) =
+					(d3d_pixel)((x * 3 + y * (i + 1)) % 16);
+			}
+		}
+		d3d_texture_prepare_sprite(txtrs[i], 0);
+	}
+	d3d_block_s wall = {{
+		txtrs[0], txtrs[1], txtrs[0], txtrs[1], NULL, NULL
+	}};
+	d3d_block_s open = {{ NULL, NULL, NULL, NULL, txtrs[2], txtrs[1] }};
+	d3d_board *board = d3d_new_board(BOARD_SIZE, BOARD_SIZE, &open);
+	d3d_camera *cam = d3d_new_camera(1.2, 0.6, CAM_WIDTH, CAM_HEIGHT, 0);
+	if (!board || !cam) goto error_memory;
+	unsigned long seed = 3;
+	for (size_t x = 0; x < BOARD_SIZE; ++x) {
+		for (size_t y = 0; y < BOARD_SIZE; ++y) {
+			bool edge = x == 0 || y == 0
+				|| x == BOARD_SIZE - 1 || y == BOARD_SIZE - 1;
+			if (edge || bench_rand(&seed) % 12 == 0)
+				*d3d_board_get(board, x, y) = &wall;
+		}
+	}
+	d3d_sprite_s sprites[N_SPRITES];
+	for (size_t i = 0; i < N_SPRITES; ++i) {
+		sprites[i].txtr = txtrs[i % 3];
+		sprites[i].transparent = 0;
+		sprites[i].pos.x = 1 + bench_rand(&seed) % (BOARD_SIZE - 2)
+			+ (d3d_scalar)0.5;
+		sprites[i].pos.y = 1 + bench_rand(&seed) % (BOARD_SIZE - 2)
+			+ (d3d_scalar)0.5;
+		sprites[i].scale.x = sprites[i].scale.y = (d3d_scalar)0.4;
+	}
+	static d3d_pixel pixels[N_FRAMES][CAM_WIDTH * CAM_HEIGHT];
+	double start = seconds();
+	for (int i = 0; i < N_FRAMES; ++i) {
+		d3d_vec_s pos;
+		d3d_scalar facing;
+		frame_pose(i, &pos, &facing);
+		d3d_draw(cam, pos, facing, board, N_SPRITES, sprites);
+		memcpy(pixels[i], cam->pixels, sizeof(pixels[i]));
+	}
+	double elapsed = seconds() - start;
+	printf("%-12s %6zu-byte scalar %10.1f ns/frame",
+		SCALAR_NAME, sizeof(d3d_scalar), elapsed / N_FRAMES * 1e9);
+	if (writing) {
+		if (fwrite(pixels, sizeof(pixels), 1, frames) != 1) {
+			perror(argv[2]);
+			return 1;
+		}
+		printf(" (reference)\n");
+	} else {
+		static d3d_pixel ref[CAM_WIDTH * CAM_HEIGHT];
+		size_t max_diff = 0;
+		for (int i = 0; i < N_FRAMES; ++i) {
+			if (fread(ref, sizeof(ref), 1, frames) != 1) {
+				fprintf(stderr, "%s: too few frames\n", argv[2]);
+				return 1;
+			}
+			size_t diff = 0;
+			for (size_t p = 0; p < CAM_WIDTH * CAM_HEIGHT; ++p) {
+				diff += pixels[i][p] != ref[p];
+			}
+			if (diff > max_diff) max_diff = diff;
+		}
+		printf(" %6.2f%% of pixels differ at most\n",
+			100.0 * max_diff / (CAM_WIDTH * CAM_HEIGHT));
+	}
+	fclose(frames);
+	d3d_free_camera(cam);
+	d3d_free_board(board);
+	for (size_t i = 0; i < 3; ++i) {
+		d3d_free_texture(txtrs[i]);
+	}
+	return 0;
+
+error_memory:
+	fprintf(stderr, "Out of memory\n");
+	return 1;
+}
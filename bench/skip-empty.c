@@ -0,0 +1,86 @@
+// This benchmark measures how many steps rays take through the grid of a large
+// open board with and without skipping empty space using the board's distance
+// field. It includes the d3d source to get at the ray walking internals.
+
+#include "../external/d3d/d3d.c"
+#include <stdio.h>
+#include <time.h>
+
+#define BOARD_SIZE 256
+#define N_PILLARS 64
+#define N_RAYS 200000
+
+static unsigned long bench_rand(unsigned long *state)
+{
+	*state = *state * 1103515245 + 12345;
+	return *state / 65536 % 32768;
+}
+
+static double seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Cast the same rays from around the middle of the board and report the steps
+// and time taken per ray.
+static void run(const d3d_board *board, const char *name)
+{
+	unsigned long seed = 1;
+	size_t steps = 0;
+	d3d_scalar total_dist = 0;
+	double start = seconds();
+	for (long i = 0; i < N_RAYS; ++i) {
+		d3d_vec_s pos = {
+			BOARD_SIZE / 4 + bench_rand(&seed) % 32768 / 32768.0
+				* BOARD_SIZE / 2,
+			BOARD_SIZE / 4 + bench_rand(&seed) % 32768 / 32768.0
+				* BOARD_SIZE / 2
+		};
+		d3d_scalar angle = bench_rand(&seed) / 32768.0 * 2 * PI;
+		d3d_vec_s dir = { cos(angle), sin(angle) };
+		struct ray ray;
+		struct d3d_hit hit;
+		init_ray(&ray, pos, dir);
+		trace_ray(board, &ray, &hit);
+		steps += ray.steps;
+		total_dist += hit.dist;
+	}
+	double elapsed = seconds() - start;
+	printf("%-10s %8.2f steps/ray %8.1f ns/ray (mean distance %.1f)\n",
+		name, (double)steps / N_RAYS, elapsed / N_RAYS * 1e9,
+		(double)total_dist / N_RAYS);
+}
+
+int main(void)
+{
+	d3d_texture *txtr = d3d_new_texture(8, 8, 1);
+	d3d_block_s wall = {{ txtr, txtr, txtr, txtr, NULL, NULL }};
+	d3d_board *board = d3d_new_board(BOARD_SIZE, BOARD_SIZE, NULL);
+	if (!txtr || !board) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	// Wall in the edges and put a few pillars around:
+	for (size_t i = 0; i < BOARD_SIZE; ++i) {
+		*d3d_board_get(board, i, 0) = &wall;
+		*d3d_board_get(board, i, BOARD_SIZE - 1) = &wall;
+		*d3d_board_get(board, 0, i) = &wall;
+		*d3d_board_get(board, BOARD_SIZE - 1, i) = &wall;
+	}
+	unsigned long seed = 2;
+	for (size_t i = 0; i < N_PILLARS; ++i) {
+		*d3d_board_get(board, bench_rand(&seed) % BOARD_SIZE,
+			bench_rand(&seed) % BOARD_SIZE) = &wall;
+	}
+	update_skip(board);
+	printf("%dx%d open board with %d pillars, %d rays\n",
+		BOARD_SIZE, BOARD_SIZE, N_PILLARS, N_RAYS);
+	run(board, "skipping");
+	memset(board->skip, 0, BOARD_SIZE * BOARD_SIZE);
+	run(board, "walking");
+	d3d_free_board(board);
+	d3d_free_texture(txtr);
+	return 0;
+}
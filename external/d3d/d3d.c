@@ -8,6 +8,9 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef D3D_USE_PTHREADS
+#	include <pthread.h>
+#endif
 
 // Adds the amount to the size variable, returning NULL from the current
 // function on overflow.
@@ -17,6 +20,19 @@
 	(size) = new_size; \
 } while (0)
 
+// These are like CHECKED_ADD and ALIGN_SIZE, but they return -1 instead.
+#define CHECKED_ADD_INT(size, amount) do { \
+	size_t new_size = (size) + (amount); \
+	if (new_size < (size)) return -1; \
+	(size) = new_size; \
+} while (0)
+#define ALIGN_SIZE_INT(size, type) do { \
+	size_t new_size = \
+		((size) + ALIGNOF(type) - 1) / ALIGNOF(type) * ALIGNOF(type); \
+	if (new_size < (size)) return -1; \
+	(size) = new_size; \
+} while (0)
+
 // Gets the memory alignment of the given type.
 #define ALIGNOF(type) offsetof(struct { char c; type t; }, t)
 
@@ -40,6 +56,13 @@
 
 #define PI ((d3d_scalar)3.14159265358979323846)
 
+// The number of fractional bits in fixed-point numbers used to step across
+// textures.
+#define FIXED_SHIFT 16
+
+// The largest distance stored in a board's empty-space distance field.
+#define SKIP_MAX 255
+
 #ifndef D3D_CUSTOM_ALLOCATOR
 void *d3d_malloc(size_t size)
 {
@@ -104,32 +127,6 @@ static d3d_scalar angle_diff(d3d_scalar a1, d3d_scalar a2)
 	return diff;
 }
 
-// This is pretty much floor(c). However, when c is a nonzero whole number and
-// positive is true (that is, the relevant component of the delta position is
-// over 0,) c is decremented and returned. This is for calculating the tile
-// coordinates of a moving point hitting a wall. If it hits a wall going in the
-// positive direction, it would be put in the tile one over except for the
-// decrement.
-static size_t tocoord(d3d_scalar c, bool positive)
-{
-	d3d_scalar f = floor(c);
-	if (positive && f == c && c != (d3d_scalar)0.0) return (size_t)c - 1;
-	return f;
-}
-
-// Move the given coordinates in the direction given. If the direction is not
-// horizontal, nothing happens. No bounds are checked.
-static void move_dir(d3d_direction dir, size_t *x, size_t *y)
-{
-	switch(dir) {
-	case D3D_DPOSX: ++*x; break;
-	case D3D_DPOSY: ++*y; break;
-	case D3D_DNEGX: --*x; break;
-	case D3D_DNEGY: --*y; break;
-	default: break;
-	}
-}
-
 // Rotate a horizontal direction 180°. If the direction is not horizontal, it is
 // returned unmodified.
 static d3d_direction invert_dir(d3d_direction dir)
@@ -143,6 +140,139 @@ static d3d_direction invert_dir(d3d_direction dir)
 	}
 }
 
+#ifdef D3D_USE_PTHREADS
+// A set of worker threads that stick around between draws. A job is split into
+// bands numbered from 0 to n_workers. The thread submitting the job does band
+// 0 itself, and worker i does band i + 1.
+struct d3d_pool {
+	pthread_mutex_t lock;
+	// Signalled when a new job is posted or the pool is shutting down.
+	pthread_cond_t posted;
+	// Signalled when the last band of a job is finished.
+	pthread_cond_t finished;
+	// The current job. run(arg, band, n_bands) does one band.
+	void (*run)(void *arg, size_t band, size_t n_bands);
+	void *arg;
+	// Incremented each time a job is posted, so workers can tell.
+	unsigned long generation;
+	// The number of bands of the current job not yet finished.
+	size_t n_running;
+	// Whether the workers should exit.
+	bool quit;
+	// The number of workers, not counting the submitting thread.
+	size_t n_workers;
+	pthread_t workers[];
+};
+
+// What a worker thread is told when it's started.
+struct pool_worker_arg {
+	struct d3d_pool *pool;
+	size_t band;
+};
+
+static void *pool_worker(void *varg)
+{
+	struct pool_worker_arg arg = *(struct pool_worker_arg *)varg;
+	struct d3d_pool *pool = arg.pool;
+	d3d_free(varg);
+	// No job can have been posted before all the workers were started:
+	unsigned long seen = 0;
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->quit && pool->generation == seen) {
+			pthread_cond_wait(&pool->posted, &pool->lock);
+		}
+		if (pool->quit) break;
+		seen = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+		pool->run(pool->arg, arg.band, pool->n_workers + 1);
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->n_running == 0)
+			pthread_cond_signal(&pool->finished);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static void free_pool(struct d3d_pool *pool)
+{
+	if (!pool) return;
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->posted);
+	pthread_mutex_unlock(&pool->lock);
+	for (size_t i = 0; i < pool->n_workers; ++i) {
+		pthread_join(pool->workers[i], NULL);
+	}
+	pthread_cond_destroy(&pool->finished);
+	pthread_cond_destroy(&pool->posted);
+	pthread_mutex_destroy(&pool->lock);
+	d3d_free(pool);
+}
+
+// Start a pool with the given number of workers. NULL is returned on failure.
+static struct d3d_pool *new_pool(size_t n_workers)
+{
+	size_t size = offsetof(struct d3d_pool, workers);
+	if (n_workers > ((size_t)-1 - size) / sizeof(pthread_t)) return NULL;
+	struct d3d_pool *pool = d3d_malloc(size + n_workers * sizeof(pthread_t));
+	if (!pool) return NULL;
+	if (pthread_mutex_init(&pool->lock, NULL)) goto error_lock;
+	if (pthread_cond_init(&pool->posted, NULL)) goto error_posted;
+	if (pthread_cond_init(&pool->finished, NULL)) goto error_finished;
+	pool->generation = 0;
+	pool->n_running = 0;
+	pool->quit = false;
+	for (pool->n_workers = 0; pool->n_workers < n_workers;
+	     ++pool->n_workers) {
+		struct pool_worker_arg *arg = d3d_malloc(sizeof(*arg));
+		if (!arg) goto error_workers;
+		arg->pool = pool;
+		arg->band = pool->n_workers + 1;
+		if (pthread_create(&pool->workers[pool->n_workers], NULL,
+			pool_worker, arg)) {
+			d3d_free(arg);
+			goto error_workers;
+		}
+	}
+	return pool;
+
+error_workers:
+	// free_pool only joins the workers that were started.
+	free_pool(pool);
+	return NULL;
+
+error_finished:
+	pthread_cond_destroy(&pool->posted);
+error_posted:
+	pthread_mutex_destroy(&pool->lock);
+error_lock:
+	d3d_free(pool);
+	return NULL;
+}
+
+// Run every band of a job, returning once they're all done.
+static void pool_run(
+	struct d3d_pool *pool,
+	void (*run)(void *arg, size_t band, size_t n_bands),
+	void *arg)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->run = run;
+	pool->arg = arg;
+	pool->n_running = pool->n_workers;
+	++pool->generation;
+	pthread_cond_broadcast(&pool->posted);
+	pthread_mutex_unlock(&pool->lock);
+	run(arg, 0, pool->n_workers + 1);
+	pthread_mutex_lock(&pool->lock);
+	while (pool->n_running > 0) {
+		pthread_cond_wait(&pool->finished, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+#endif /* defined(D3D_USE_PTHREADS) */
+
 d3d_camera *d3d_new_camera(
 	d3d_scalar fovx,
 	d3d_scalar fovy,
@@ -151,7 +281,8 @@ d3d_camera *d3d_new_camera(
 	d3d_pixel empty_pixel)
 {
 	size_t size;
-	size_t pixels_size, txtr_offset, tans_offset, dists_offset;
+	size_t pixels_size, txtr_offset, tans_offset, rowdists_offset;
+	size_t dists_offset;
 	d3d_texture *empty_txtr;
 	d3d_camera *cam;
 	size = offsetof(d3d_camera, pixels);
@@ -169,27 +300,31 @@ d3d_camera *d3d_new_camera(
 	if (height * sizeof(d3d_scalar) / sizeof(d3d_scalar) != height)
 		return NULL;
 	CHECKED_ADD(size, height * sizeof(d3d_scalar));
+	rowdists_offset = size;
+	CHECKED_ADD(size, height * sizeof(d3d_scalar));
 	dists_offset = size;
 	if (width * sizeof(d3d_scalar) / sizeof(d3d_scalar) != width)
 		return NULL;
 	CHECKED_ADD(size, width * sizeof(d3d_scalar));
 	cam = d3d_malloc(size);
 	if (!cam) return NULL;
-	// The members 'tans' and 'dists' are actually pointers to parts of the
-	// same allocation. 'empty_txtr' is glued on before them, but is not a
-	// member.
+	// The members 'tans', 'rowdists', and 'dists' are actually pointers to
+	// parts of the same allocation. 'empty_txtr' is glued on before them,
+	// but is not a member.
 	empty_txtr = (void *)((char *)cam + txtr_offset);
 	cam->tans = (void *)((char *)cam + tans_offset);
+	cam->rowdists = (void *)((char *)cam + rowdists_offset);
 	cam->dists = (void *)((char *)cam + dists_offset);
 	// Just do basic protection against non-positive FOVs as they might
 	// cause issues. I could do something better than silently clamping, but
 	// what do you expect a non-positive FOV to do anyway?
-	cam->fov.x = fovx > (d3d_scalar)0.0 ? fovx : 0.001;
-	cam->fov.y = fovy > (d3d_scalar)0.0 ? fovy : 0.001;
+	cam->fov.x = fovx > (d3d_scalar)0.0 ? fovx : (d3d_scalar)0.001;
+	cam->fov.y = fovy > (d3d_scalar)0.0 ? fovy : (d3d_scalar)0.001;
 	cam->width = width;
 	cam->height = height;
 	empty_txtr->width = 1;
 	empty_txtr->height = 1;
+	empty_txtr->spans = NULL;
 	empty_txtr->pixels[0] = empty_pixel;
 	cam->blank_block.faces[D3D_DPOSX] =
 	cam->blank_block.faces[D3D_DPOSY] =
@@ -201,11 +336,20 @@ d3d_camera *d3d_new_camera(
 	cam->order_buf_cap = 0;
 	cam->last_sprites = NULL;
 	cam->last_n_sprites = 0;
+	cam->pool = NULL;
+	cam->options = 0;
+	cam->hits = cam->last_hits = NULL;
+	cam->hits_view.board = NULL;
+	cam->world = NULL;
+	cam->world_view.board = NULL;
 	empty_camera_pixels(cam);
 	for (size_t y = 0; y < height; ++y) {
 		d3d_scalar angle =
 			cam->fov.y * ((d3d_scalar)0.5 - (d3d_scalar)y / height);
 		cam->tans[y] = tan(angle);
+		// This is infinite for a row right in the middle, but such a
+		// row never shows the floor or ceiling anyway:
+		cam->rowdists[y] = (d3d_scalar)0.5 / fabs(cam->tans[y]);
 	}
 	return cam;
 }
@@ -214,46 +358,425 @@ void d3d_free_camera(d3d_camera *cam)
 {
 	if (!cam) return;
 	d3d_free(cam->order);
-	// 'tans' and 'dists' are freed here too:
+	d3d_free(cam->hits < cam->last_hits ? cam->hits : cam->last_hits);
+	d3d_free(cam->world);
+#ifdef D3D_USE_PTHREADS
+	free_pool(cam->pool);
+#endif
+	// 'tans', 'rowdists', and 'dists' are freed here too:
 	d3d_free(cam);
 }
 
-d3d_texture *d3d_new_texture(size_t width, size_t height, d3d_pixel fill)
+int d3d_camera_set_threads(d3d_camera *cam, size_t n_threads)
+{
+	if (n_threads < 1) n_threads = 1;
+#ifdef D3D_USE_PTHREADS
+	size_t n_workers = n_threads - 1;
+	if (cam->pool && cam->pool->n_workers == n_workers) return 0;
+	free_pool(cam->pool);
+	cam->pool = NULL;
+	if (n_workers == 0) return 0;
+	cam->pool = new_pool(n_workers);
+	return cam->pool ? 0 : -1;
+#else
+	(void)cam;
+	return n_threads == 1 ? 0 : -1;
+#endif
+}
+
+int d3d_camera_set_options(d3d_camera *cam, unsigned options)
+{
+	bool need_hits = options & (D3D_REUSE_RAYS | D3D_COHERENT_RAYS);
+	bool need_world = options & D3D_CACHE_WORLD;
+	struct d3d_hit *hits = NULL;
+	d3d_pixel *world = NULL;
+	if (need_hits && !cam->hits) {
+		size_t size = cam->width * 2 * sizeof(*hits);
+		if (size / 2 / sizeof(*hits) != cam->width) goto error_hits;
+		hits = d3d_malloc(size);
+		if (!hits) goto error_hits;
+	}
+	if (need_world && !cam->world) {
+		// The camera was allocated with this many pixels, so this
+		// can't overflow:
+		world = d3d_malloc(cam->width * cam->height * sizeof(*world));
+		if (!world) goto error_world;
+	}
+	if (hits) {
+		cam->hits = hits;
+		cam->last_hits = hits + cam->width;
+	} else if (!need_hits && cam->hits) {
+		d3d_free(cam->hits < cam->last_hits ?
+			cam->hits : cam->last_hits);
+		cam->hits = cam->last_hits = NULL;
+	}
+	if (world) {
+		cam->world = world;
+	} else if (!need_world && cam->world) {
+		d3d_free(cam->world);
+		cam->world = NULL;
+	}
+	// Nothing has been recorded in the new buffers yet:
+	cam->hits_view.board = NULL;
+	cam->world_view.board = NULL;
+	cam->options = options;
+	return 0;
+
+error_world:
+	d3d_free(hits);
+error_hits:
+	return -1;
+}
+
+unsigned d3d_camera_options(const d3d_camera *cam)
+{
+	return cam->options;
+}
+
+size_t d3d_camera_threads(const d3d_camera *cam)
+{
+#ifdef D3D_USE_PTHREADS
+	if (cam->pool) return cam->pool->n_workers + 1;
+#else
+	(void)cam;
+#endif
+	return 1;
+}
+
+// Something with the strictest alignment of anything in a texture.
+union texture_align {
+	size_t size;
+	struct d3d_sprite_spans *spans;
+	d3d_pixel pixel;
+};
+
+// The alignment of textures.
+#define TEXTURE_ALIGN offsetof(struct { char c; union texture_align a; }, a)
+
+size_t d3d_texture_footprint(size_t width, size_t height)
 {
 	if (width < 1) width = 1;
 	if (height < 1) height = 1;
 	size_t size = texture_size(width, height);
-	if (size == 0) return NULL;
-	d3d_texture *txtr = d3d_malloc(size);
-	if (!txtr) return NULL;
+	if (size == 0) return 0;
+	size_t padding = (TEXTURE_ALIGN - size % TEXTURE_ALIGN) % TEXTURE_ALIGN;
+	if (size + padding < size) return 0;
+	return size + padding;
+}
+
+d3d_texture *d3d_init_texture(
+	void *mem,
+	size_t width,
+	size_t height,
+	d3d_pixel fill)
+{
+	if (width < 1) width = 1;
+	if (height < 1) height = 1;
+	d3d_texture *txtr = mem;
 	txtr->width = width;
 	txtr->height = height;
+	txtr->spans = NULL;
 	for (size_t i = 0; i < width * height; ++i) {
 		txtr->pixels[i] = fill;
 	}
 	return txtr;
 }
 
-d3d_board *d3d_new_board(size_t width, size_t height, const d3d_block_s *fill)
+d3d_texture *d3d_new_texture(size_t width, size_t height, d3d_pixel fill)
+{
+	size_t size = d3d_texture_footprint(width, height);
+	if (size == 0) return NULL;
+	void *mem = d3d_malloc(size);
+	if (!mem) return NULL;
+	return d3d_init_texture(mem, width, height, fill);
+}
+
+// Get the block of the tile at index i of the board, in column-major order. The
+// index must be in range.
+static const d3d_block_s *block_at(const d3d_board *board, size_t i)
+{
+	if (board->cells) {
+		return &board->palette[board->cells[i] & D3D_CELL_BLOCK_MASK];
+	}
+	return board->blocks[i];
+}
+
+// Get the block at a tile of the board, or NULL if the tile is off the board.
+static const d3d_block_s *get_block(const d3d_board *board, size_t x, size_t y)
+{
+	if (x >= board->width || y >= board->height) return NULL;
+	return block_at(board, y + board->height * x);
+}
+
+// Whether a block has any faces that a ray moving across the board could hit.
+static bool has_side_faces(const d3d_block_s *block)
+{
+	return block->faces[D3D_DPOSX] || block->faces[D3D_DPOSY]
+		|| block->faces[D3D_DNEGX] || block->faces[D3D_DNEGY];
+}
+
+// Work out the distance field of a board (see the skip member) for the window
+// of tiles with the corner (wx, wy) and the dimensions ww by wh. The result is
+// put in out, which is column-major like the board. Blocks outside the window
+// are treated as empty, so the values are only right for tiles at least
+// SKIP_MAX tiles inside the window or the board edge.
+static void compute_skip(
+	const d3d_board *board,
+	size_t wx,
+	size_t wy,
+	size_t ww,
+	size_t wh,
+	unsigned char *out)
+{
+	for (size_t x = 0; x < ww; ++x) {
+		for (size_t y = 0; y < wh; ++y) {
+			size_t bx = wx + x, by = wy + y;
+			size_t d = SKIP_MAX;
+			if (has_side_faces(block_at(board, by + board->height * bx))) {
+				d = 0;
+			} else {
+				// Beyond the board edges is treated as solid.
+				if (bx + 1 < d) d = bx + 1;
+				if (by + 1 < d) d = by + 1;
+				if (board->width - bx < d) d = board->width - bx;
+				if (board->height - by < d) d = board->height - by;
+			}
+			out[y + wh * x] = d;
+		}
+	}
+	// The two passes of a chamfer transform with all eight neighbors give
+	// exact Chebyshev distances.
+	for (size_t x = 0; x < ww; ++x) {
+		for (size_t y = 0; y < wh; ++y) {
+			unsigned char *here = &out[y + wh * x];
+			unsigned d = SKIP_MAX;
+			if (y > 0 && out[y - 1 + wh * x] < d)
+				d = out[y - 1 + wh * x];
+			if (x > 0) {
+				const unsigned char *left = &out[y + wh * (x - 1)];
+				if (left[0] < d) d = left[0];
+				if (y > 0 && left[-1] < d) d = left[-1];
+				if (y + 1 < wh && left[1] < d) d = left[1];
+			}
+			if (d + 1 < *here) *here = d + 1;
+		}
+	}
+	for (size_t x = ww; x--; ) {
+		for (size_t y = wh; y--; ) {
+			unsigned char *here = &out[y + wh * x];
+			unsigned d = SKIP_MAX;
+			if (y + 1 < wh && out[y + 1 + wh * x] < d)
+				d = out[y + 1 + wh * x];
+			if (x + 1 < ww) {
+				const unsigned char *right = &out[y + wh * (x + 1)];
+				if (right[0] < d) d = right[0];
+				if (y > 0 && right[-1] < d) d = right[-1];
+				if (y + 1 < wh && right[1] < d) d = right[1];
+			}
+			if (d + 1 < *here) *here = d + 1;
+		}
+	}
+}
+
+// The summary flags of a board about its ceilings or floors. The flags member
+// has these for the ceilings, then these shifted left by BOARD_FLOOR_SHIFT for
+// the floors.
+// Some tile has a texture on the face.
+#define BOARD_ANY 0x1
+// Every tile has a texture on the face.
+#define BOARD_ALL 0x2
+// All textures on the face are the size of the sample for the face.
+#define BOARD_UNIFORM 0x4
+#define BOARD_FLOOR_SHIFT 3
+
+// Get the summary flags of a board for a face, D3D_DUP or D3D_DDOWN.
+static unsigned board_face_flags(const d3d_board *board, d3d_direction face)
+{
+	return face == D3D_DUP ? board->flags & 7
+		: board->flags >> BOARD_FLOOR_SHIFT & 7;
+}
+
+// Update the summary flags of a board for a face with what is in a window of
+// the tiles. The flags only ever become less specific, so that they are right
+// without looking at the rest of the board again. They start out as specific
+// as possible, with no sample.
+static void update_face_flags(
+	d3d_board *board,
+	d3d_direction face,
+	size_t x0,
+	size_t y0,
+	size_t x1,
+	size_t y1)
+{
+	size_t idx = face == D3D_DUP ? 0 : 1;
+	unsigned flags = board_face_flags(board, face);
+	const d3d_texture *sample = board->samples[idx];
+	for (size_t x = x0; x < x1; ++x) {
+		for (size_t y = y0; y < y1; ++y) {
+			const d3d_texture *txtr =
+				block_at(board, y + board->height * x)->faces[face];
+			if (!txtr) {
+				flags &= ~(unsigned)BOARD_ALL;
+				continue;
+			}
+			flags |= BOARD_ANY;
+			if (!sample) sample = txtr;
+			if (txtr->width != sample->width
+			 || txtr->height != sample->height)
+				flags &= ~(unsigned)BOARD_UNIFORM;
+		}
+	}
+	board->samples[idx] = sample;
+	unsigned shift = idx ? BOARD_FLOOR_SHIFT : 0;
+	board->flags = (board->flags & ~(7u << shift)) | flags << shift;
+}
+
+// Bring the distance field of the board up to date with the tiles that may
+// have been changed through d3d_board_get. Only tiles within SKIP_MAX of those
+// can have changed distances, and only blocks within SKIP_MAX of those tiles
+// need to be looked at to find out.
+static void update_skip(d3d_board *board)
+{
+	if (board->dirty_x0 >= board->dirty_x1) return;
+	if (board->cells) {
+		// Make sure cells changed by the user refer to real blocks.
+		for (size_t x = board->dirty_x0; x < board->dirty_x1; ++x) {
+			for (size_t y = board->dirty_y0; y < board->dirty_y1;
+				++y) {
+				d3d_cell *cell = &board->cells[y + board->height * x];
+				if ((*cell & D3D_CELL_BLOCK_MASK) >= board->n_palette)
+					*cell &= ~(d3d_cell)D3D_CELL_BLOCK_MASK;
+			}
+		}
+	}
+	update_face_flags(board, D3D_DUP, board->dirty_x0, board->dirty_y0,
+		board->dirty_x1, board->dirty_y1);
+	update_face_flags(board, D3D_DDOWN, board->dirty_x0, board->dirty_y0,
+		board->dirty_x1, board->dirty_y1);
+	size_t x0 = board->dirty_x0 > SKIP_MAX ? board->dirty_x0 - SKIP_MAX : 0;
+	size_t y0 = board->dirty_y0 > SKIP_MAX ? board->dirty_y0 - SKIP_MAX : 0;
+	size_t x1 = board->width - board->dirty_x1 > SKIP_MAX ?
+		board->dirty_x1 + SKIP_MAX : board->width;
+	size_t y1 = board->height - board->dirty_y1 > SKIP_MAX ?
+		board->dirty_y1 + SKIP_MAX : board->height;
+	size_t wx = x0 > SKIP_MAX ? x0 - SKIP_MAX : 0;
+	size_t wy = y0 > SKIP_MAX ? y0 - SKIP_MAX : 0;
+	size_t ww = (board->width - x1 > SKIP_MAX ?
+		x1 + SKIP_MAX : board->width) - wx;
+	size_t wh = (board->height - y1 > SKIP_MAX ?
+		y1 + SKIP_MAX : board->height) - wy;
+	board->dirty_x0 = board->dirty_y0 = (size_t)-1;
+	board->dirty_x1 = board->dirty_y1 = 0;
+	if (ww == board->width && wh == board->height) {
+		compute_skip(board, 0, 0, ww, wh, board->skip);
+		return;
+	}
+	unsigned char *window = d3d_malloc(ww * wh);
+	if (window) {
+		compute_skip(board, wx, wy, ww, wh, window);
+	}
+	for (size_t x = x0; x < x1; ++x) {
+		for (size_t y = y0; y < y1; ++y) {
+			// A distance of 0 never skips, so it is always safe.
+			board->skip[y + board->height * x] = window ?
+				window[y - wy + wh * (x - wx)] : 0;
+		}
+	}
+	d3d_free(window);
+}
+
+// Allocate a board with tiles of tile_size bytes each. The tiles are stored
+// where the blocks member is. Everything but the tiles and the palette is
+// initialized, with all the tiles marked as changed.
+static d3d_board *alloc_board(size_t width, size_t height, size_t tile_size)
 {
 	size_t size = offsetof(d3d_board, blocks);
-	size_t blocks_size = width * height * sizeof(d3d_block_s *);
-	if (width != 0 && blocks_size / sizeof(d3d_block_s *) / width != height)
+	size_t tiles_size = width * height * tile_size;
+	if (width != 0 && tiles_size / tile_size / width != height)
 		return NULL;
-	CHECKED_ADD(size, blocks_size);
+	CHECKED_ADD(size, tiles_size);
+	size_t skip_offset = size;
+	CHECKED_ADD(size, width * height);
 	d3d_board *board = d3d_malloc(size);
 	if (!board) return NULL;
 	board->width = width;
 	board->height = height;
+	board->skip = (unsigned char *)board + skip_offset;
+	board->cells = NULL;
+	board->palette = NULL;
+	board->n_palette = 0;
+	board->revision = 0;
+	board->flags = (BOARD_ALL | BOARD_UNIFORM)
+		| (BOARD_ALL | BOARD_UNIFORM) << BOARD_FLOOR_SHIFT;
+	board->samples[0] = board->samples[1] = NULL;
+	board->dirty_x0 = board->dirty_y0 = 0;
+	board->dirty_x1 = width;
+	board->dirty_y1 = height;
+	return board;
+}
+
+d3d_board *d3d_new_board(size_t width, size_t height, const d3d_block_s *fill)
+{
+	d3d_board *board =
+		alloc_board(width, height, sizeof(const d3d_block_s *));
+	if (!board) return NULL;
 	static const d3d_block_s empty_block = {{ NULL, NULL, NULL, NULL,
 		NULL, NULL }};
 	if (!fill) fill = &empty_block;
 	for (size_t i = 0; i < width * height; ++i) {
 		board->blocks[i] = fill;
 	}
+	update_skip(board);
+	return board;
+}
+
+d3d_board *d3d_new_compact_board(
+	size_t width,
+	size_t height,
+	size_t n_blocks,
+	const d3d_block_s palette[])
+{
+	if (n_blocks < 1 || n_blocks > (size_t)D3D_CELL_BLOCK_MASK + 1)
+		return NULL;
+	d3d_board *board = alloc_board(width, height, sizeof(d3d_cell));
+	if (!board) return NULL;
+	board->cells = (d3d_cell *)((char *)board + offsetof(d3d_board, blocks));
+	board->palette = palette;
+	board->n_palette = n_blocks;
+	for (size_t i = 0; i < width * height; ++i) {
+		board->cells[i] = 0;
+	}
+	update_skip(board);
 	return board;
 }
 
+#if defined(D3D_LEGACY_HIT_WALL) || CTF_TESTS_ENABLED
+// This is pretty much floor(c). However, when c is a nonzero whole number and
+// positive is true (that is, the relevant component of the delta position is
+// over 0,) c is decremented and returned. This is for calculating the tile
+// coordinates of a moving point hitting a wall. If it hits a wall going in the
+// positive direction, it would be put in the tile one over except for the
+// decrement.
+static size_t tocoord(d3d_scalar c, bool positive)
+{
+	d3d_scalar f = floor(c);
+	if (positive && f == c && c != (d3d_scalar)0.0) return (size_t)c - 1;
+	return f;
+}
+
+// Move the given coordinates in the direction given. If the direction is not
+// horizontal, nothing happens. No bounds are checked.
+static void move_dir(d3d_direction dir, size_t *x, size_t *y)
+{
+	switch(dir) {
+	case D3D_DPOSX: ++*x; break;
+	case D3D_DPOSY: ++*y; break;
+	case D3D_DNEGX: --*x; break;
+	case D3D_DNEGY: --*y; break;
+	default: break;
+	}
+}
+
 // Move the position pos by dpos (delta position) until a wall is hit. dir is
 // set to the face of the block which was hit. If no block is hit, NULL is
 // returned.
@@ -268,7 +791,7 @@ static const d3d_block_s *hit_wall(
 	for (;;) {
 		size_t x, y;
 		d3d_direction inverted;
-		const d3d_block_s * const *blk = NULL;
+		const d3d_block_s *blk = NULL;
 		d3d_vec_s tonext = {0, 0};
 		d3d_direction y_dir = D3D_DNEGY, x_dir = D3D_DNEGX;
 		if (dpos->x < (d3d_scalar)0.0) {
@@ -308,20 +831,20 @@ static const d3d_block_s *hit_wall(
 		x = tocoord(pos->x, dpos->x > (d3d_scalar)0.0);
 		y = tocoord(pos->y, dpos->y > (d3d_scalar)0.0);
 		inverted = invert_dir(*dir);
-		blk = GET(board, blocks, x, y);
+		blk = get_block(board, x, y);
 		if (!blk) return NULL; // The ray left the board
-		if ((*blk)->faces[*dir]) {
-			block = *blk;
+		if (blk->faces[*dir]) {
+			block = blk;
 			*txtr = block->faces[*dir];
 			*dir = inverted;
 			return block;
 		} else {
 			// The face the ray hit is empty
 			move_dir(*dir, &x, &y);
-			blk = GET(board, blocks, x, y);
+			blk = get_block(board, x, y);
 			if (!blk) return NULL; // The ray left the board
-			if ((*blk)->faces[inverted]) {
-				block = *blk;
+			if (blk->faces[inverted]) {
+				block = blk;
 				*txtr = block->faces[inverted];
 				return block;
 			} else {
@@ -336,126 +859,762 @@ static const d3d_block_s *hit_wall(
 				}
 			}
 		}
-		block = *blk;
+		block = blk;
 	}
 }
 
-static void draw_column(
-	d3d_camera *cam,
-	d3d_vec_s cam_pos,
-	d3d_scalar cam_facing,
+// Cast a ray from pos in the direction dir (a unit vector) using hit_wall.
+static void cast_ray_legacy(
 	const d3d_board *board,
-	size_t x)
+	d3d_vec_s pos,
+	d3d_vec_s dir,
+	struct d3d_hit *hit)
 {
-	d3d_direction face;
-	const d3d_block_s *block;
-	const d3d_texture *drawing;
-	d3d_vec_s pos = cam_pos, disp;
-	d3d_scalar dist;
-	d3d_scalar angle = cam_facing
-		+ cam->fov.x * ((d3d_scalar)0.5 - (d3d_scalar)x / cam->width);
 	d3d_vec_s dpos = {
-		cos(angle) * (d3d_scalar)0.001, sin(angle) * (d3d_scalar)0.001
+		dir.x * (d3d_scalar)0.001, dir.y * (d3d_scalar)0.001
 	};
-	block = hit_wall(board, &pos, &dpos, &face, &drawing);
-	if (!block) {
-		block = &cam->blank_block;
-		drawing = block->faces[0];
-	}
-	disp.x = pos.x - cam_pos.x;
-	disp.y = pos.y - cam_pos.y;
-	dist = hypot(disp.x, disp.y);
-	cam->dists[x] = dist;
-	// Choose how far across the wall to get pixels from based on the wall
-	// orientation, and put the distance in dimension:
-	d3d_scalar dimension;
-	switch (face) {
-	case D3D_DPOSX:
-		dimension = revmod1(pos.y);
-		break;
-	case D3D_DPOSY:
-		dimension = mod1(pos.x);
-		break;
-	case D3D_DNEGX:
-		dimension = mod1(pos.y);
-		break;
-	case D3D_DNEGY:
-	default: // The default case shouldn't be reached.
-		dimension = revmod1(pos.x);
-		break;
+	hit->pos = pos;
+	hit->block = hit_wall(board, &hit->pos, &dpos, &hit->face, &hit->txtr);
+	hit->dist = hypot(hit->pos.x - pos.x, hit->pos.y - pos.y);
+}
+#endif /* defined(D3D_LEGACY_HIT_WALL) || CTF_TESTS_ENABLED */
+
+#if !defined(D3D_LEGACY_HIT_WALL) || CTF_TESTS_ENABLED
+// The state of a ray walking the board grid with a DDA. Everything but the
+// current tile and the side distances stays the same for the whole walk.
+struct ray {
+	// Where the ray started and its unit direction.
+	d3d_vec_s origin, dir;
+	// The tile the ray is in. This is always within the board.
+	size_t x, y;
+	// What to add to x or y (with wraparound) to cross a grid line.
+	size_t step_x, step_y;
+	// The direction of travel when crossing an x or y grid line.
+	d3d_direction x_dir, y_dir;
+	// The distance along the ray to the next x or y grid line.
+	d3d_scalar side_x, side_y;
+	// The distance along the ray between consecutive x or y grid lines.
+	d3d_scalar delta_x, delta_y;
+	// How many times the ray has moved through the grid, for benchmarks.
+	size_t steps;
+};
+
+// Set up the ray along one axis. c is the origin coordinate and d is the
+// direction component. A ray sitting exactly on a grid line is put in the tile
+// behind it, so the line is crossed at distance zero like in hit_wall.
+static void init_ray_axis(
+	d3d_scalar c,
+	d3d_scalar d,
+	d3d_direction pos_dir,
+	d3d_direction neg_dir,
+	size_t *tile,
+	size_t *step,
+	d3d_direction *dir,
+	d3d_scalar *side,
+	d3d_scalar *delta)
+{
+	if (d > (d3d_scalar)0.0) {
+		*tile = (size_t)ceil(c) - 1;
+		*step = 1;
+		*dir = pos_dir;
+		*delta = 1 / d;
+		*side = ((d3d_scalar)*tile + 1 - c) * *delta;
+	} else if (d < (d3d_scalar)0.0) {
+		*tile = (size_t)floor(c);
+		*step = (size_t)-1;
+		*dir = neg_dir;
+		*delta = -1 / d;
+		*side = (c - (d3d_scalar)*tile) * *delta;
+	} else {
+		// This grid line will never be crossed:
+		*tile = (size_t)floor(c);
+		*step = 0;
+		*dir = neg_dir;
+		*delta = *side = INFINITY;
 	}
-	for (size_t t = 0; t < cam->height; ++t) {
-		const d3d_texture *txtr;
-		size_t tx, ty;
-		// The distance the ray travelled, assuming it hit a vertical
-		// wall:
-		d3d_scalar dist_y = cam->tans[t] * dist + (d3d_scalar)0.5;
-		if (dist_y > (d3d_scalar)0.0 && dist_y < (d3d_scalar)1.0) {
-			// A vertical wall was indeed hit
-			txtr = drawing;
-			tx = dimension * txtr->width;
-			ty = txtr->height * ((d3d_scalar)1.0 - dist_y);
-		} else {
-			// A floor or ceiling was hit instead. The horizontal
-			// displacement is adjusted accordingly:
-			d3d_scalar newdist =
-				(d3d_scalar)0.5 / fabs(cam->tans[t]);
-			d3d_vec_s newpos = {
-				cam_pos.x + disp.x / dist * newdist,
-				cam_pos.y + disp.y / dist * newdist
-			};
-			size_t bx = newpos.x, by = newpos.y;
-			const d3d_block_s *const *top_bot =
-				GET(board, blocks, bx, by);
-			if (!top_bot) goto no_texture;
-			// Ceiling hit if dist_y >= 1, floor hit if
-			// dist_y <= 0, and nothing else is possible:
-			d3d_direction face =
-				dist_y >= (d3d_scalar)1.0 ? D3D_DUP : D3D_DDOWN;
-			txtr = (*top_bot)->faces[face];
-			if (!txtr) goto no_texture;
-			tx = mod1(newpos.x) * txtr->width;
-			ty = mod1(newpos.y) * txtr->height;
-		}
-		const d3d_pixel *tpp = GET(txtr, pixels, tx, ty);
-		d3d_pixel tp;
-		if (tpp) {
-			tp = *tpp;
+}
+
+// Prepare a ray starting at origin going in the direction of the unit vector
+// dir. The origin must be within the board.
+static void init_ray(struct ray *ray, d3d_vec_s origin, d3d_vec_s dir)
+{
+	ray->origin = origin;
+	ray->dir = dir;
+	ray->steps = 0;
+	init_ray_axis(origin.x, dir.x, D3D_DPOSX, D3D_DNEGX, &ray->x,
+		&ray->step_x, &ray->x_dir, &ray->side_x, &ray->delta_x);
+	init_ray_axis(origin.y, dir.y, D3D_DPOSY, D3D_DNEGY, &ray->y,
+		&ray->step_y, &ray->y_dir, &ray->side_y, &ray->delta_y);
+}
+
+// Count how many of the grid lines along one axis at side, side + delta, and
+// so on are before the distance end along the ray, up to n lines. If inclusive
+// is true, lines right at end are counted too.
+static size_t lines_before(
+	d3d_scalar side,
+	d3d_scalar delta,
+	d3d_scalar end,
+	bool inclusive,
+	size_t n)
+{
+	if (inclusive ? !(side <= end) : !(side < end)) return 0;
+	d3d_scalar more = (end - side) / delta;
+	if (more >= (d3d_scalar)n) return n;
+	return (size_t)more + 1 < n ? (size_t)more + 1 : n;
+}
+
+// Move the ray across empty tiles without checking them. The ray's tile and
+// every tile up to n tiles away from it in x and y must be empty and on the
+// board. The ray stops in the last tile in that square it gets to, so the next
+// line it crosses is the way out of the square.
+static void skip_empty(struct ray *ray, size_t n)
+{
+	d3d_scalar out_x = ray->side_x + n * ray->delta_x;
+	d3d_scalar out_y = ray->side_y + n * ray->delta_y;
+	size_t nx = n, ny = n;
+	// Ties between x and y lines go to y, as in trace_ray.
+	if (out_x < out_y) {
+		ny = lines_before(ray->side_y, ray->delta_y, out_x, true, n);
+	} else {
+		nx = lines_before(ray->side_x, ray->delta_x, out_y, false, n);
+	}
+	if (nx > 0) {
+		ray->x += nx * ray->step_x;
+		ray->side_x += nx * ray->delta_x;
+	}
+	if (ny > 0) {
+		ray->y += ny * ray->step_y;
+		ray->side_y += ny * ray->delta_y;
+	}
+}
+
+// Walk the ray through the grid until it hits a face or leaves the board. This
+// gives the same results as hit_wall. Every grid line crossed is checked for a
+// face on the inside of the tile being left, then on the outside of the tile
+// being entered. Ties between x and y lines go to y, also like hit_wall. Where
+// the board's distance field says the area around the ray is empty, the ray
+// jumps to the edge of that area.
+static void trace_ray(const d3d_board *board, struct ray *ray, struct d3d_hit *hit)
+{
+	for (;;) {
+		size_t skip = board->skip[ray->y + board->height * ray->x];
+		if (skip > 1) {
+			skip_empty(ray, skip - 1);
+			++ray->steps;
+		}
+		const d3d_block_s *here =
+			block_at(board, ray->y + board->height * ray->x);
+		const d3d_block_s *there;
+		d3d_direction dir, inverted;
+		++ray->steps;
+		if (ray->side_x < ray->side_y) {
+			dir = ray->x_dir;
+			hit->dist = ray->side_x;
+			hit->pos.x = (d3d_scalar)ray->x + (dir == D3D_DPOSX);
+			hit->pos.y = ray->origin.y + hit->dist * ray->dir.y;
+			ray->side_x += ray->delta_x;
+			ray->x += ray->step_x;
 		} else {
-	no_texture:
-			tp = camera_empty_pixel(cam);
+			dir = ray->y_dir;
+			hit->dist = ray->side_y;
+			hit->pos.x = ray->origin.x + hit->dist * ray->dir.x;
+			hit->pos.y = (d3d_scalar)ray->y + (dir == D3D_DPOSY);
+			ray->side_y += ray->delta_y;
+			ray->y += ray->step_y;
+		}
+		inverted = invert_dir(dir);
+		if (here->faces[dir]) {
+			// The inside of the tile just left was hit.
+			hit->block = here;
+			hit->txtr = here->faces[dir];
+			hit->face = inverted;
+			return;
+		}
+		if (ray->x >= board->width || ray->y >= board->height) {
+			// The ray left the board.
+			hit->block = NULL;
+			hit->face = dir;
+			return;
+		}
+		there = block_at(board, ray->y + board->height * ray->x);
+		if (there->faces[inverted]) {
+			// The outside of the tile just entered was hit.
+			hit->block = there;
+			hit->txtr = there->faces[inverted];
+			hit->face = dir;
+			return;
 		}
-		*GET(cam, pixels, x, t) = tp;
 	}
 }
 
-// Compare the sprite orders (see below). This is meant for qsort.
-static int compar_sprite_order(const void *a, const void *b)
+// Cast a ray from pos in the direction dir (a unit vector) using the DDA.
+static void cast_ray(
+	const d3d_board *board,
+	d3d_vec_s pos,
+	d3d_vec_s dir,
+	struct d3d_hit *hit)
 {
-	d3d_scalar dist_a = *(d3d_scalar *)a, dist_b = *(d3d_scalar *)b;
-	if (dist_a > dist_b) return 1;
-	if (dist_a < dist_b) return -1;
-	return 0;
+	struct ray ray;
+	init_ray(&ray, pos, dir);
+	trace_ray(board, &ray, hit);
 }
+#endif /* !defined(D3D_LEGACY_HIT_WALL) || CTF_TESTS_ENABLED */
 
-static void draw_sprite_dist(
+#ifdef D3D_LEGACY_HIT_WALL
+#	define CAST_RAY cast_ray_legacy
+#else
+#	define CAST_RAY cast_ray
+#endif
+
+#if CTF_TESTS_ENABLED
+// Get the pixel of the ceiling (if face is D3D_DUP) or the floor (if face is
+// D3D_DDOWN) seen at row t of a column looking in the direction dir, a unit
+// vector. Every pixel in a row sees the floor or ceiling at the same distance,
+// so the position is just the row's distance along the column's direction.
+// The rows_kernel functions do this for whole runs of rows.
+static d3d_pixel top_bottom_pixel(
 	d3d_camera *cam,
 	d3d_vec_s cam_pos,
-	d3d_scalar cam_facing,
-	const d3d_sprite_s *sp,
-	d3d_scalar dist)
+	d3d_vec_s dir,
+	const d3d_board *board,
+	size_t t,
+	d3d_direction face)
 {
-	if (sp->scale.x <= (d3d_scalar)0.0 || sp->scale.y <= (d3d_scalar)0.0)
-		return;
-	d3d_vec_s disp = { sp->pos.x - cam_pos.x, sp->pos.y - cam_pos.y };
-	d3d_scalar angle, width, height, diff, maxdiff;
-	long start_x, start_y;
-	if (dist == (d3d_scalar)0.0) return;
-	// The angle of the sprite relative to the +x axis:
-	angle = atan2(disp.y, disp.x);
-	// The view width of the sprite in radians:
-	width = atan(sp->scale.x / dist) * 2;
-	// The max camera-sprite angle difference so the sprite's visible:
+	d3d_scalar rowdist = cam->rowdists[t];
+	d3d_vec_s pos = {
+		cam_pos.x + dir.x * rowdist,
+		cam_pos.y + dir.y * rowdist
+	};
+	size_t bx = pos.x, by = pos.y;
+	const d3d_block_s *top_bot = get_block(board, bx, by);
+	if (!top_bot) return camera_empty_pixel(cam);
+	const d3d_texture *txtr = top_bot->faces[face];
+	if (!txtr) return camera_empty_pixel(cam);
+	size_t tx = mod1(pos.x) * txtr->width;
+	size_t ty = mod1(pos.y) * txtr->height;
+	const d3d_pixel *tpp = GET(txtr, pixels, tx, ty);
+	return tpp ? *tpp : camera_empty_pixel(cam);
+}
+#endif /* CTF_TESTS_ENABLED */
+
+#if defined(D3D_LEGACY_FLOOR) || CTF_TESTS_ENABLED
+// This is like top_bottom_pixel, but it finds the position by working out the
+// distance for the row and scaling the displacement of the wall the column hit,
+// disp, which is dist away.
+static d3d_pixel top_bottom_pixel_legacy(
+	d3d_camera *cam,
+	d3d_vec_s cam_pos,
+	d3d_vec_s disp,
+	d3d_scalar dist,
+	const d3d_board *board,
+	size_t t,
+	d3d_direction face)
+{
+	d3d_scalar newdist = (d3d_scalar)0.5 / fabs(cam->tans[t]);
+	d3d_vec_s newpos = {
+		cam_pos.x + disp.x / dist * newdist,
+		cam_pos.y + disp.y / dist * newdist
+	};
+	size_t bx = newpos.x, by = newpos.y;
+	const d3d_block_s *top_bot = get_block(board, bx, by);
+	if (!top_bot) return camera_empty_pixel(cam);
+	const d3d_texture *txtr = top_bot->faces[face];
+	if (!txtr) return camera_empty_pixel(cam);
+	size_t tx = mod1(newpos.x) * txtr->width;
+	size_t ty = mod1(newpos.y) * txtr->height;
+	const d3d_pixel *tpp = GET(txtr, pixels, tx, ty);
+	return tpp ? *tpp : camera_empty_pixel(cam);
+}
+#endif /* defined(D3D_LEGACY_FLOOR) || CTF_TESTS_ENABLED */
+
+
+// A function drawing the ceiling (if face is D3D_DUP) or the floor (if face is
+// D3D_DDOWN) in the rows from t_start up to but not including t_end of a column.
+// The column looks in the direction dir and its ray hit the wall described by
+// hit. draw_top_bottom works on any board. The other versions leave out work
+// that isn't needed on some boards, as told by the board's summary flags.
+typedef void (*rows_kernel)(
+	d3d_camera *cam,
+	d3d_vec_s cam_pos,
+	d3d_vec_s dir,
+	const struct d3d_hit *hit,
+	const d3d_board *board,
+	d3d_pixel *column,
+	size_t t_start,
+	size_t t_end,
+	d3d_direction face);
+
+#ifdef D3D_LEGACY_FLOOR
+static void draw_top_bottom(
+	d3d_camera *cam,
+	d3d_vec_s cam_pos,
+	d3d_vec_s dir,
+	const struct d3d_hit *hit,
+	const d3d_board *board,
+	d3d_pixel *column,
+	size_t t_start,
+	size_t t_end,
+	d3d_direction face)
+{
+	(void)dir;
+	d3d_vec_s disp = { hit->pos.x - cam_pos.x, hit->pos.y - cam_pos.y };
+	for (size_t t = t_start; t < t_end; ++t) {
+		column[t] = top_bottom_pixel_legacy(cam, cam_pos, disp,
+			hit->dist, board, t, face);
+	}
+}
+#else
+// Define a rows_kernel that works like top_bottom_pixel for each row. If
+// textured is true, every tile of the board must have a texture on the face
+// drawn. If uniform is also true, all those textures must be the size of the
+// board's sample texture for the face.
+#define DEFINE_ROWS_KERNEL(name, textured, uniform) \
+static void name( \
+	d3d_camera *cam, \
+	d3d_vec_s cam_pos, \
+	d3d_vec_s dir, \
+	const struct d3d_hit *hit, \
+	const d3d_board *board, \
+	d3d_pixel *column, \
+	size_t t_start, \
+	size_t t_end, \
+	d3d_direction face) \
+{ \
+	(void)hit; \
+	d3d_pixel empty = camera_empty_pixel(cam); \
+	const d3d_texture *sample = board->samples[face == D3D_DUP ? 0 : 1]; \
+	size_t width = uniform ? sample->width : 0; \
+	size_t height = uniform ? sample->height : 0; \
+	for (size_t t = t_start; t < t_end; ++t) { \
+		d3d_scalar rowdist = cam->rowdists[t]; \
+		d3d_vec_s pos = { \
+			cam_pos.x + dir.x * rowdist, \
+			cam_pos.y + dir.y * rowdist \
+		}; \
+		size_t bx = pos.x, by = pos.y; \
+		const d3d_block_s *top_bot = get_block(board, bx, by); \
+		const d3d_texture *txtr = top_bot ? top_bot->faces[face] : NULL; \
+		if (!top_bot || (!textured && !txtr)) { \
+			column[t] = empty; \
+			continue; \
+		} \
+		size_t tx = mod1(pos.x) * (uniform ? width : txtr->width); \
+		size_t ty = mod1(pos.y) * (uniform ? height : txtr->height); \
+		const d3d_pixel *tpp = GET(txtr, pixels, tx, ty); \
+		column[t] = tpp ? *tpp : empty; \
+	} \
+}
+
+DEFINE_ROWS_KERNEL(draw_top_bottom, false, false)
+DEFINE_ROWS_KERNEL(draw_rows_textured, true, false)
+DEFINE_ROWS_KERNEL(draw_rows_uniform, true, true)
+#endif /* !defined(D3D_LEGACY_FLOOR) */
+
+// A rows_kernel for boards with no tiles having the face drawn, so that only
+// empty pixels are seen.
+static void draw_rows_empty(
+	d3d_camera *cam,
+	d3d_vec_s cam_pos,
+	d3d_vec_s dir,
+	const struct d3d_hit *hit,
+	const d3d_board *board,
+	d3d_pixel *column,
+	size_t t_start,
+	size_t t_end,
+	d3d_direction face)
+{
+	(void)cam_pos, (void)dir, (void)hit, (void)board, (void)face;
+	d3d_pixel empty = camera_empty_pixel(cam);
+	for (size_t t = t_start; t < t_end; ++t) {
+		column[t] = empty;
+	}
+}
+
+// Choose the fastest rows_kernel that can draw the given face of the board.
+static rows_kernel choose_rows_kernel(
+	const d3d_board *board,
+	d3d_direction face)
+{
+	unsigned flags = board_face_flags(board, face);
+	if (!(flags & BOARD_ANY)) return draw_rows_empty;
+#ifdef D3D_LEGACY_FLOOR
+	return draw_top_bottom;
+#else
+	if (!(flags & BOARD_ALL)) return draw_top_bottom;
+	if (!(flags & BOARD_UNIFORM)) return draw_rows_textured;
+	return draw_rows_uniform;
+#endif
+}
+
+// Whether row t of the camera sees below the top of a wall dist away.
+#define BELOW_WALL_TOP(cam, dist, t) \
+	((cam)->tans[t] * (dist) + (d3d_scalar)0.5 < (d3d_scalar)1.0)
+// Whether row t of the camera sees above the bottom of a wall dist away.
+#define ABOVE_WALL_BOTTOM(cam, dist, t) \
+	((cam)->tans[t] * (dist) + (d3d_scalar)0.5 > (d3d_scalar)0.0)
+
+// Convert a row estimate to a row index from 0 to the camera height.
+static size_t clamp_row(const d3d_camera *cam, d3d_scalar row)
+{
+	if (!(row > (d3d_scalar)0.0)) return 0;
+	if (row >= (d3d_scalar)cam->height) return cam->height;
+	return (size_t)ceil(row);
+}
+
+// Find the rows from *top up to but not including *bottom in which a wall dist
+// away is seen. The ceiling is seen above them and the floor below them. The
+// edges are worked out from the inverse of the row angles, then nudged to
+// agree exactly with testing tans[t] * dist + 0.5 against 0 and 1 per row.
+static void wall_rows(
+	const d3d_camera *cam,
+	d3d_scalar dist,
+	size_t *top,
+	size_t *bottom)
+{
+	d3d_scalar middle = (d3d_scalar)cam->height / 2;
+	d3d_scalar half =
+		atan((d3d_scalar)0.5 / dist) / cam->fov.y * cam->height;
+	size_t t = clamp_row(cam, middle - half);
+	while (t > 0 && BELOW_WALL_TOP(cam, dist, t - 1)) --t;
+	while (t < cam->height && !BELOW_WALL_TOP(cam, dist, t)) ++t;
+	*top = t;
+	t = clamp_row(cam, middle + half);
+	if (t < *top) t = *top;
+	while (t > *top && !ABOVE_WALL_BOTTOM(cam, dist, t - 1)) --t;
+	while (t < cam->height && ABOVE_WALL_BOTTOM(cam, dist, t)) ++t;
+	*bottom = t;
+}
+
+// Convert a texture row to fixed point, keeping it from 0 up to max.
+static size_t to_fixed_row(d3d_scalar row, size_t max)
+{
+	row *= (d3d_scalar)((size_t)1 << FIXED_SHIFT);
+	if (!(row > (d3d_scalar)0.0)) return 0;
+	if (row >= (d3d_scalar)max) return max;
+	return (size_t)row;
+}
+
+// Draw the wall that was hit in the rows from top up to but not including
+// bottom of a column. across is how far across the wall face the column is,
+// from 0 to 1. The texture row is only worked out exactly at the ends; it is
+// stepped in fixed point between them, so the loop is a plain copy.
+static void draw_wall(
+	const d3d_camera *cam,
+	const struct d3d_hit *hit,
+	d3d_scalar across,
+	d3d_pixel *column,
+	size_t top,
+	size_t bottom)
+{
+	if (top >= bottom) return;
+	const d3d_texture *txtr = hit->txtr;
+	size_t tx = across * txtr->width;
+	if (tx >= txtr->width) tx = txtr->width - 1;
+	const d3d_pixel *texels = &txtr->pixels[txtr->height * tx];
+	size_t max = (txtr->height << FIXED_SHIFT) - 1;
+	size_t first = to_fixed_row(txtr->height * ((d3d_scalar)1.0
+		- (cam->tans[top] * hit->dist + (d3d_scalar)0.5)), max);
+	size_t last = to_fixed_row(txtr->height * ((d3d_scalar)1.0
+		- (cam->tans[bottom - 1] * hit->dist + (d3d_scalar)0.5)), max);
+	if (last < first) last = first;
+	size_t step = bottom - top > 1 ? (last - first) / (bottom - top - 1) : 0;
+	size_t ty = first;
+	for (size_t t = top; t < bottom; ++t) {
+		column[t] = texels[ty >> FIXED_SHIFT];
+		ty += step;
+	}
+}
+
+// Everything needed to draw a frame, shared by the threads drawing it.
+struct draw_job {
+	d3d_camera *cam;
+	d3d_vec_s cam_pos;
+	d3d_scalar cam_facing;
+	const d3d_board *board;
+	// Whether cam->last_hits can be reused, and if so, how many columns to
+	// add to a column to get the old column with the same angle.
+	bool reuse;
+	d3d_scalar shift;
+	// Whether to cast rays with D3D_COHERENT_RAYS.
+	bool coherent;
+	// The kernels drawing the ceiling and the floor of each column.
+	rows_kernel draw_top, draw_bottom;
+	// The sprites, which have been sorted into cam->order.
+	size_t n_sprites;
+	const d3d_sprite_s *sprites;
+	// Whether to draw on the calling thread only, leaving the camera's
+	// threads alone.
+	bool alone;
+};
+
+// Draw column x of the job's camera, which looks in the direction dir and whose
+// ray hit what is described by hit.
+static void draw_column(
+	const struct draw_job *job,
+	d3d_vec_s dir,
+	size_t x,
+	const struct d3d_hit *hit)
+{
+	d3d_camera *cam = job->cam;
+	size_t top, bottom;
+	d3d_pixel *column = &cam->pixels[cam->height * x];
+	cam->dists[x] = hit->dist;
+	// Choose how far across the wall to get pixels from based on the wall
+	// orientation, and put the distance in dimension:
+	d3d_scalar dimension;
+	switch (hit->face) {
+	case D3D_DPOSX:
+		dimension = revmod1(hit->pos.y);
+		break;
+	case D3D_DPOSY:
+		dimension = mod1(hit->pos.x);
+		break;
+	case D3D_DNEGX:
+		dimension = mod1(hit->pos.y);
+		break;
+	case D3D_DNEGY:
+	default: // The default case shouldn't be reached.
+		dimension = revmod1(hit->pos.x);
+		break;
+	}
+	wall_rows(cam, hit->dist, &top, &bottom);
+	job->draw_top(cam, job->cam_pos, dir, hit, job->board, column, 0, top,
+		D3D_DUP);
+	draw_wall(cam, hit, dimension, column, top, bottom);
+	job->draw_bottom(cam, job->cam_pos, dir, hit, job->board, column,
+		bottom, cam->height, D3D_DDOWN);
+}
+
+// Check whether the tiles on both sides of a grid line are the same from where
+// the line meets along coordinate from up to where it meets to. The line is
+// x = line if x_line is true and y = line otherwise.
+static bool same_tiles_along(
+	const d3d_board *board,
+	bool x_line,
+	d3d_scalar line,
+	d3d_scalar from,
+	d3d_scalar to)
+{
+	if (from > to) {
+		d3d_scalar swap = from;
+		from = to;
+		to = swap;
+	}
+	// Off-board coordinates wrap around to huge ones, where get_block
+	// returns NULL:
+	size_t l = line, k = floor(from), k_end = floor(to);
+	const d3d_block_s *before = x_line ?
+		get_block(board, l - 1, k) : get_block(board, k, l - 1);
+	const d3d_block_s *after = x_line ?
+		get_block(board, l, k) : get_block(board, k, l);
+	while (k++ < k_end) {
+		if ((x_line ? get_block(board, l - 1, k)
+		            : get_block(board, k, l - 1)) != before
+		 || (x_line ? get_block(board, l, k)
+		            : get_block(board, k, l)) != after)
+			return false;
+	}
+	return true;
+}
+
+// How far triangle_is_clear looks outside the triangle for grid points, so that
+// points on its edges aren't lost to rounding.
+#define GRID_SLACK ((d3d_scalar)0.0001)
+
+// Check whether there is a face on either side of the grid line from where it
+// meets along coordinate k up to k + 1. The line is x = line if x_line is true
+// and y = line otherwise.
+static bool face_on_edge(
+	const d3d_board *board,
+	bool x_line,
+	size_t line,
+	size_t k)
+{
+	// Off-board coordinates wrap around to huge ones, where get_block
+	// returns NULL:
+	const d3d_block_s *before = x_line ?
+		get_block(board, line - 1, k) : get_block(board, k, line - 1);
+	const d3d_block_s *after = x_line ?
+		get_block(board, line, k) : get_block(board, k, line);
+	return (before && before->faces[x_line ? D3D_DPOSX : D3D_DPOSY])
+	    || (after && after->faces[x_line ? D3D_DNEGX : D3D_DNEGY]);
+}
+
+// Check whether no face could stop a ray from origin between the rays to a and
+// b before it gets to the grid line between them. The line is x = line if
+// x_line is true and y = line otherwise, and it meets the rays at the along
+// coordinates along_a and along_b. The rays to a and b must not cross any face
+// on the way. A face that a ray between them hits must then lie entirely in the
+// triangle between the rays, so both its ends are grid points in the triangle.
+// Those are looked for one grid line parallel to the given one at a time.
+static bool triangle_is_clear(
+	const d3d_board *board,
+	d3d_vec_s origin,
+	bool x_line,
+	d3d_scalar line,
+	d3d_scalar along_a,
+	d3d_scalar along_b)
+{
+	d3d_scalar across0 = x_line ? origin.x : origin.y;
+	d3d_scalar along0 = x_line ? origin.y : origin.x;
+	// A face through the origin is not crossed by the rays, so the origin
+	// must not be on a grid line:
+	if (across0 == floor(across0) || along0 == floor(along0)) return false;
+	if (!(across0 > 0 && along0 > 0
+	 && across0 < (x_line ? board->width : board->height)
+	 && along0 < (x_line ? board->height : board->width))) return false;
+	d3d_scalar span = line - across0;
+	d3d_scalar slope_lo = (fmin(along_a, along_b) - along0) / span;
+	d3d_scalar slope_hi = (fmax(along_a, along_b) - along0) / span;
+	long step = span > 0 ? 1 : -1;
+	long end = line;
+	long c = span > 0 ? ceil(across0) : floor(across0);
+	// The range of grid points in the triangle on the line c, from lo to
+	// hi, inclusive:
+	d3d_scalar t = c - across0;
+	long lo = ceil(along0 + t * slope_lo - GRID_SLACK);
+	long hi = floor(along0 + t * slope_hi + GRID_SLACK);
+	for (; c != end; c += step) {
+		// Faces along the line c between points in the triangle:
+		for (long k = lo; k < hi; ++k) {
+			if (face_on_edge(board, x_line, c, k)) return false;
+		}
+		// Faces from points on the line c to those on the next one:
+		t = c + step - across0;
+		long next_lo = ceil(along0 + t * slope_lo - GRID_SLACK);
+		long next_hi = floor(along0 + t * slope_hi + GRID_SLACK);
+		long near = step > 0 ? c : c - 1;
+		for (long k = lo > next_lo ? lo : next_lo;
+		     k <= hi && k <= next_hi; ++k) {
+			if (face_on_edge(board, !x_line, k, near)) return false;
+		}
+		lo = next_lo;
+		hi = next_hi;
+	}
+	return true;
+}
+
+// Check whether the hits a and b are on the same face of the same block, on a
+// stretch of a grid line where the tiles on both sides are the same. If so, the
+// line is x = *line if *x_line is true and y = *line otherwise, and a and b hit
+// it at the along coordinates *along_a and *along_b.
+static bool same_stretch(
+	const d3d_board *board,
+	const struct d3d_hit *a,
+	const struct d3d_hit *b,
+	bool *x_line,
+	d3d_scalar *line,
+	d3d_scalar *along_a,
+	d3d_scalar *along_b)
+{
+	if (!a->block || a->block != b->block || a->face != b->face)
+		return false;
+	*x_line = a->face == D3D_DPOSX || a->face == D3D_DNEGX;
+	*line = *x_line ? a->pos.x : a->pos.y;
+	*along_a = *x_line ? a->pos.y : a->pos.x;
+	*along_b = *x_line ? b->pos.y : b->pos.x;
+	if (*line != (*x_line ? b->pos.x : b->pos.y)) return false;
+	d3d_scalar lo = floor(fmin(*along_a, *along_b));
+	d3d_scalar hi = floor(fmax(*along_a, *along_b));
+	return lo == hi || same_tiles_along(board, *x_line, *line, lo, hi);
+}
+
+// Check whether the hits a and b of rays from origin are on the same stretch of
+// a face (see same_stretch) and nothing between their rays hides part of it.
+// If so, hit_between gives exactly what casting the rays between would give.
+static bool clear_between(
+	const d3d_board *board,
+	d3d_vec_s origin,
+	const struct d3d_hit *a,
+	const struct d3d_hit *b)
+{
+	bool x_line;
+	d3d_scalar line, along_a, along_b;
+	return same_stretch(board, a, b, &x_line, &line, &along_a, &along_b)
+	    && triangle_is_clear(board, origin, x_line, line, along_a,
+		along_b);
+}
+
+// If the hits a and b are on the same stretch of a face (see same_stretch),
+// find where the ray from origin in the direction dir hits that stretch, put it
+// in hit, and return true. If the ray from origin is between the rays that made
+// a and b, and nothing between those rays hides part of the stretch, this is
+// exactly what casting the ray would give. Otherwise, false is returned.
+static bool hit_between(
+	const d3d_board *board,
+	d3d_vec_s origin,
+	d3d_vec_s dir,
+	const struct d3d_hit *a,
+	const struct d3d_hit *b,
+	struct d3d_hit *hit)
+{
+	bool x_line;
+	d3d_scalar line, along_a, along_b;
+	if (!same_stretch(board, a, b, &x_line, &line, &along_a, &along_b))
+		return false;
+	d3d_scalar dist = x_line ?
+		(line - origin.x) / dir.x : (line - origin.y) / dir.y;
+	if (!(dist >= (d3d_scalar)0.0)) return false;
+	d3d_scalar along = x_line ?
+		origin.y + dist * dir.y : origin.x + dist * dir.x;
+	if (!(floor(along) >= floor(fmin(along_a, along_b))
+	   && floor(along) <= floor(fmax(along_a, along_b)))) return false;
+	*hit = *a;
+	hit->dist = dist;
+	hit->pos.x = x_line ? line : along;
+	hit->pos.y = x_line ? along : line;
+	return true;
+}
+
+// Copy the opaque runs from run up to but not including end of a sprite texture
+// column, texels, into a screen column where the sprite starts at row start_y.
+// Row y of the sprite gets texture row y * step_y in fixed point, and only rows
+// from row_lo up to but not including row_hi of the sprite are drawn.
+static void draw_runs(
+	d3d_pixel *column,
+	long start_y,
+	const d3d_pixel *texels,
+	const struct d3d_span *run,
+	const struct d3d_span *end,
+	size_t step_y,
+	long row_lo,
+	long row_hi)
+{
+	for (; run < end; ++run) {
+		// The rows whose texture rows are inside the run:
+		long y = ((run->top << FIXED_SHIFT) + step_y - 1) / step_y;
+		long y_end = ((run->bottom << FIXED_SHIFT) + step_y - 1) / step_y;
+		if (y < row_lo) y = row_lo;
+		if (y_end > row_hi) y_end = row_hi;
+		size_t sy = (size_t)y * step_y;
+		for (; y < y_end; ++y, sy += step_y) {
+			column[start_y + y] = texels[sy >> FIXED_SHIFT];
+		}
+	}
+}
+
+// Draw a sprite a given distance away, only touching columns from x_start up to
+// but not including x_end.
+static void draw_sprite_dist(
+	d3d_camera *cam,
+	d3d_vec_s cam_pos,
+	d3d_scalar cam_facing,
+	const d3d_sprite_s *sp,
+	d3d_scalar dist,
+	size_t x_start,
+	size_t x_end)
+{
+	if (sp->scale.x <= (d3d_scalar)0.0 || sp->scale.y <= (d3d_scalar)0.0)
+		return;
+	d3d_vec_s disp = { sp->pos.x - cam_pos.x, sp->pos.y - cam_pos.y };
+	d3d_scalar angle, width, height, diff, maxdiff;
+	long start_x, start_y;
+	if (dist == (d3d_scalar)0.0) return;
+	// The angle of the sprite relative to the +x axis:
+	angle = atan2(disp.y, disp.x);
+	// The view width of the sprite in radians:
+	width = atan(sp->scale.x / dist) * 2;
+	// The max camera-sprite angle difference so the sprite's visible:
 	maxdiff = (cam->fov.x + width) / 2;
 	diff = angle_diff(cam_facing, angle);
 	if (fabs(diff) > maxdiff) return;
@@ -467,86 +1626,588 @@ static void draw_sprite_dist(
 	start_x = (cam->width - width) / 2 + diff / cam->fov.x * cam->width;
 	// The first y where the sprite appears on the screen:
 	start_y = (cam->height - height) / 2;
-	for (size_t x = 0; x < width; ++x) {
-		// cx is the x on the camera screen; sx is the x on the sprite's
-		// texture:
-		size_t cx, sx;
-		cx = x + start_x;
-		if (cx >= cam->width || dist >= cam->dists[cx]) continue;
-		sx = (d3d_scalar)x / width * sp->txtr->width;
-		if (sx >= sp->txtr->width) continue;
-		for (size_t y = 0; y < height; ++y) {
-			// cy and sy correspond to cx and sx above:
-			size_t cy, sy;
-			cy = y + start_y;
-			if (cy >= cam->height) continue;
-			sy = (d3d_scalar)y / height * sp->txtr->height;
-			if (sy >= sp->txtr->height) continue;
-			d3d_pixel p = *GET(sp->txtr, pixels, sx, sy);
-			if (p != sp->transparent) *GET(cam, pixels, cx, cy) = p;
+	// Clip the columns and rows of the sprite to the band and the screen:
+	const d3d_texture *txtr = sp->txtr;
+	long col_lo = (long)x_start - start_x, col_hi = (long)x_end - start_x;
+	long row_lo = -start_y, row_hi = (long)cam->height - start_y;
+	if (col_lo < 0) col_lo = 0;
+	if (col_hi > (long)ceil(width)) col_hi = ceil(width);
+	if (row_lo < 0) row_lo = 0;
+	if (row_hi > (long)ceil(height)) row_hi = ceil(height);
+	// The texture coordinates are stepped in fixed point. The steps are
+	// rounded down, so they stay inside the texture.
+	size_t step_x = (d3d_scalar)(txtr->width << FIXED_SHIFT) / width;
+	size_t step_y = (d3d_scalar)(txtr->height << FIXED_SHIFT) / height;
+	while (row_hi > row_lo
+	 && ((size_t)(row_hi - 1) * step_y >> FIXED_SHIFT) >= txtr->height)
+		--row_hi;
+	if (col_lo >= col_hi || row_lo >= row_hi) return;
+	// The opaque runs of the texture are used if they were found for the
+	// right transparent pixel. They need the rows to move through texture.
+	const struct d3d_sprite_spans *spans = txtr->spans;
+	if (spans && (spans->transparent != sp->transparent || step_y == 0))
+		spans = NULL;
+	size_t sx = (size_t)col_lo * step_x;
+	size_t sy_start = (size_t)row_lo * step_y;
+	for (long x = col_lo; x < col_hi; ++x, sx += step_x) {
+		size_t cx = start_x + x;
+		// Skip columns where a wall is in front of the sprite:
+		if (dist >= cam->dists[cx]) continue;
+		size_t tx = sx >> FIXED_SHIFT;
+		if (tx >= txtr->width) break;
+		const d3d_pixel *texels = &txtr->pixels[txtr->height * tx];
+		d3d_pixel *column = &cam->pixels[cam->height * cx];
+		if (spans) {
+			draw_runs(column, start_y, texels,
+				&spans->runs[spans->starts[tx]],
+				&spans->runs[spans->starts[tx + 1]], step_y,
+				row_lo, row_hi);
+			continue;
+		}
+		size_t sy = sy_start;
+		for (long y = row_lo; y < row_hi; ++y, sy += step_y) {
+			d3d_pixel p = texels[sy >> FIXED_SHIFT];
+			if (p != sp->transparent) column[start_y + y] = p;
+		}
+	}
+}
+
+// What is needed to tell whether the camera might see a sprite.
+struct sprite_cull {
+	// The outward normals of the left and right edges of the view.
+	d3d_vec_s left, right;
+	// Whether the view is narrow enough for the edges to be used.
+	bool use_edges;
+	// The squared distance of the farthest wall seen.
+	d3d_scalar max_dist2;
+};
+
+// Prepare to cull sprites for a camera that has drawn its columns.
+static void init_sprite_cull(
+	struct sprite_cull *cull,
+	const d3d_camera *cam,
+	d3d_scalar cam_facing)
+{
+	d3d_scalar half = cam->fov.x / 2;
+	d3d_scalar max_dist = 0;
+	cull->left.x = -sin(cam_facing + half);
+	cull->left.y = cos(cam_facing + half);
+	cull->right.x = sin(cam_facing - half);
+	cull->right.y = -cos(cam_facing - half);
+	// With a view of pi or wider, the area seen is not convex:
+	cull->use_edges = half < PI / 2;
+	for (size_t x = 0; x < cam->width; ++x) {
+		if (cam->dists[x] > max_dist) max_dist = cam->dists[x];
+	}
+	cull->max_dist2 = max_dist * max_dist;
+}
+
+// Get the squared distance of a sprite from the camera, or INFINITY if the
+// sprite can't be seen. The sprite is treated as a disc as wide as the sprite.
+// This covers every direction draw_sprite_dist could draw the sprite in, so no
+// visible sprite is culled.
+static d3d_scalar sprite_dist2(
+	const struct sprite_cull *cull,
+	d3d_vec_s cam_pos,
+	const d3d_sprite_s *sp)
+{
+	d3d_vec_s disp = { sp->pos.x - cam_pos.x, sp->pos.y - cam_pos.y };
+	d3d_scalar dist2 = disp.x * disp.x + disp.y * disp.y;
+	if (dist2 >= cull->max_dist2) return INFINITY;
+	if (cull->use_edges) {
+		d3d_scalar radius = fabs(sp->scale.x);
+		if (disp.x * cull->left.x + disp.y * cull->left.y > radius
+		 || disp.x * cull->right.x + disp.y * cull->right.y > radius)
+			return INFINITY;
+	}
+	return dist2;
+}
+
+// Sort the orders by their dist fields, nearest first. This is fast when the
+// orders are already mostly sorted.
+static void insertion_sort_orders(struct d3d_sprite_order *orders, size_t n)
+{
+	for (size_t i = 1; i < n; ++i) {
+		struct d3d_sprite_order ord = orders[i];
+		size_t move_to = i;
+		while (move_to > 0 && orders[move_to - 1].dist > ord.dist) {
+			--move_to;
 		}
+		memmove(orders + move_to + 1, orders + move_to,
+			(i - move_to) * sizeof(*orders));
+		orders[move_to] = ord;
 	}
 }
 
-static void draw_sprites(
+// Sort the orders by the low 32 bits of their key fields, using scratch as
+// temporary space for n orders. The sort is stable.
+static void radix_sort_orders(
+	struct d3d_sprite_order *orders,
+	struct d3d_sprite_order *scratch,
+	size_t n)
+{
+	struct d3d_sprite_order *from = orders, *to = scratch;
+	for (unsigned shift = 0; shift < 32; shift += 8) {
+		size_t counts[256] = {0};
+		for (size_t i = 0; i < n; ++i) {
+			++counts[from[i].key >> shift & 0xFF];
+		}
+		// Skip the digit if all the keys share it:
+		if (counts[from[0].key >> shift & 0xFF] == n) continue;
+		size_t start = 0;
+		for (size_t d = 0; d < 256; ++d) {
+			size_t count = counts[d];
+			counts[d] = start;
+			start += count;
+		}
+		for (size_t i = 0; i < n; ++i) {
+			to[counts[from[i].key >> shift & 0xFF]++] = from[i];
+		}
+		struct d3d_sprite_order *swap = from;
+		from = to;
+		to = swap;
+	}
+	if (from != orders) memcpy(orders, from, n * sizeof(*orders));
+}
+
+// New sprite lists shorter than this are sorted with insertion sort instead of
+// radix sort.
+#define RADIX_SORT_MIN 64
+
+// Make room for n sprites in cam->order. The number of sprites there is room for
+// is returned.
+static size_t reserve_orders(d3d_camera *cam, size_t n)
+{
+	if (n > cam->order_buf_cap) {
+		struct d3d_sprite_order *new_order;
+		// The second half is scratch space for radix sort.
+		size_t size = n * 2 * sizeof(*cam->order);
+		if (size / 2 / sizeof(*cam->order) == n
+		 && (new_order = d3d_realloc(cam->order, size))) {
+			cam->order = new_order;
+			cam->order_buf_cap = n;
+		} else {
+			// XXX Silently truncate the list of sprites drawn. This
+			// may be a bad decision, but failure is unlikely and
+			// this shouldn't break any client code.
+			n = cam->order_buf_cap;
+		}
+	}
+	return n;
+}
+
+// Sort the sprites the camera might see into cam->order by distance from the
+// camera, nearest first, and set their dist fields. The camera's columns must
+// have been drawn already. The number of sprites to draw is returned. The rest
+// of the order holds the culled sprites.
+static size_t sort_sprites(
 	d3d_camera *cam,
 	d3d_vec_s cam_pos,
 	d3d_scalar cam_facing,
 	size_t n_sprites,
 	const d3d_sprite_s sprites[])
 {
-	size_t i;
+	size_t i, n_seen = 0;
+	struct sprite_cull cull;
+	init_sprite_cull(&cull, cam, cam_facing);
 	if (n_sprites == cam->last_n_sprites && sprites == cam->last_sprites) {
 		// This assumes the sprites didn't move much, and are mostly
-		// sorted. Therefore, insertion sort is used.
+		// sorted. Therefore, insertion sort is used. Culled sprites
+		// have infinite distances, so they stay at the end.
 		for (i = 0; i < n_sprites; ++i) {
-			size_t move_to;
-			struct d3d_sprite_order ord = cam->order[i];
-			size_t s = ord.index;
-			ord.dist = hypot(sprites[s].pos.x - cam_pos.x,
-				sprites[s].pos.y - cam_pos.y);
-			move_to = i;
-			for (long j = (long)i - 1; j >= 0; --j) {
-				if (cam->order[j].dist <= ord.dist) break;
-				move_to = j;
-			}
-			memmove(cam->order + move_to + 1, cam->order + move_to,
-				(i - move_to) * sizeof(*cam->order));
-			cam->order[move_to] = ord;
-	       }
+			struct d3d_sprite_order *ord = &cam->order[i];
+			ord->dist = sprite_dist2(&cull, cam_pos,
+				&sprites[ord->index]);
+			if (ord->dist != INFINITY) ++n_seen;
+		}
+		insertion_sort_orders(cam->order, n_sprites);
 	} else {
-		if (n_sprites > cam->order_buf_cap) {
-			struct d3d_sprite_order *new_order;
-			size_t size = n_sprites * sizeof(*cam->order);
-			if (size / sizeof(*cam->order) == n_sprites
-			 && (new_order = d3d_realloc(cam->order, size))) {
-				cam->order = new_order;
-				cam->order_buf_cap = n_sprites;
+		n_sprites = reserve_orders(cam, n_sprites);
+		// Put the sprites seen at the start and the rest at the end,
+		// then sort the ones seen by their quantized distances.
+		d3d_scalar to_key = cull.max_dist2 > (d3d_scalar)0.0 ?
+			(d3d_scalar)0xFFFFFFFF / cull.max_dist2 : 0;
+		size_t n_culled = 0;
+		for (i = 0; i < n_sprites; ++i) {
+			d3d_scalar dist2 = sprite_dist2(&cull, cam_pos,
+				&sprites[i]);
+			struct d3d_sprite_order *ord;
+			if (dist2 == INFINITY) {
+				ord = &cam->order[n_sprites - ++n_culled];
 			} else {
-				// XXX Silently truncate the list of sprites
-				// drawn. This may be a bad decision, but
-				// failure is unlikely and this shouldn't break
-				// any client code.
-				n_sprites = cam->order_buf_cap;
+				ord = &cam->order[n_seen++];
+				d3d_scalar key = dist2 * to_key;
+				ord->key = key < (d3d_scalar)0xFFFFFFFF ?
+					(unsigned long)key : 0xFFFFFFFF;
 			}
-		}
-		for (i = 0; i < n_sprites; ++i) {
-			struct d3d_sprite_order *ord = &cam->order[i];
-			ord->dist = hypot(sprites[i].pos.x - cam_pos.x,
-				sprites[i].pos.y - cam_pos.y);
+			ord->dist = dist2;
 			ord->index = i;
 		}
-		qsort(cam->order, n_sprites, sizeof(*cam->order),
-			compar_sprite_order);
+		if (n_seen < RADIX_SORT_MIN) {
+			insertion_sort_orders(cam->order, n_seen);
+		} else {
+			radix_sort_orders(cam->order,
+				cam->order + cam->order_buf_cap, n_seen);
+		}
 		cam->last_sprites = sprites;
 		cam->last_n_sprites = n_sprites;
 	}
-	i = n_sprites;
+	for (i = 0; i < n_seen; ++i) {
+		cam->order[i].dist = sqrt(cam->order[i].dist);
+	}
+	return n_seen;
+}
+
+// Sort all the sprites by squared distance from pos into orders, using scratch as
+// temporary space for n_sprites orders. Nothing is culled. This is shared by the
+// cameras near pos in d3d_draw_many.
+static void sort_sprites_from(
+	d3d_vec_s pos,
+	size_t n_sprites,
+	const d3d_sprite_s sprites[],
+	struct d3d_sprite_order *orders,
+	struct d3d_sprite_order *scratch)
+{
+	d3d_scalar max_dist2 = 0;
+	for (size_t i = 0; i < n_sprites; ++i) {
+		d3d_vec_s disp = {
+			sprites[i].pos.x - pos.x,
+			sprites[i].pos.y - pos.y
+		};
+		orders[i].dist = disp.x * disp.x + disp.y * disp.y;
+		orders[i].index = i;
+		if (orders[i].dist > max_dist2) max_dist2 = orders[i].dist;
+	}
+	if (n_sprites < RADIX_SORT_MIN) {
+		insertion_sort_orders(orders, n_sprites);
+		return;
+	}
+	d3d_scalar to_key = max_dist2 > (d3d_scalar)0.0 ?
+		(d3d_scalar)0xFFFFFFFF / max_dist2 : 0;
+	for (size_t i = 0; i < n_sprites; ++i) {
+		d3d_scalar key = orders[i].dist * to_key;
+		orders[i].key = key < (d3d_scalar)0xFFFFFFFF ?
+			(unsigned long)key : 0xFFFFFFFF;
+	}
+	radix_sort_orders(orders, scratch, n_sprites);
+}
+
+// Do what sort_sprites does, starting from the sprites sorted by distance from a
+// point near the camera by sort_sprites_from. The order only needs touching up,
+// so no sprites are sorted from scratch.
+static size_t resort_sprites(
+	d3d_camera *cam,
+	d3d_vec_s cam_pos,
+	d3d_scalar cam_facing,
+	size_t n_sprites,
+	const d3d_sprite_s sprites[],
+	const struct d3d_sprite_order *sorted)
+{
+	size_t n_seen = 0, n_culled = 0;
+	struct sprite_cull cull;
+	init_sprite_cull(&cull, cam, cam_facing);
+	size_t n_room = reserve_orders(cam, n_sprites);
+	for (size_t i = 0; i < n_sprites; ++i) {
+		size_t index = sorted[i].index;
+		if (index >= n_room) continue;
+		d3d_scalar dist2 = sprite_dist2(&cull, cam_pos,
+			&sprites[index]);
+		struct d3d_sprite_order *ord = dist2 == INFINITY ?
+			&cam->order[n_room - ++n_culled] : &cam->order[n_seen++];
+		ord->dist = dist2;
+		ord->index = index;
+	}
+	insertion_sort_orders(cam->order, n_seen);
+	cam->last_sprites = sprites;
+	cam->last_n_sprites = n_room;
+	for (size_t i = 0; i < n_seen; ++i) {
+		cam->order[i].dist = sqrt(cam->order[i].dist);
+	}
+	return n_seen;
+}
+
+// With D3D_COHERENT_RAYS, how many columns apart rays are cast at first.
+#define COHERENT_STRIDE 8
+
+// Old columns this close to a new column's angle, in columns, are reused as is.
+#define SAME_COLUMN ((d3d_scalar)0.0001)
+
+// Try to work out the hit of column x, which looks in the direction dir, from
+// the hits of the last frame. Whether that was possible is returned.
+static bool reuse_hit(
+	const struct draw_job *job,
+	size_t x,
+	d3d_vec_s dir,
+	struct d3d_hit *hit)
+{
+	const d3d_camera *cam = job->cam;
+	d3d_scalar from = x + job->shift;
+	if (!(from > -SAME_COLUMN && from < cam->width - 1 + SAME_COLUMN))
+		return false;
+	if (from < (d3d_scalar)0.0) from = 0;
+	size_t old = from;
+	d3d_scalar frac = from - old;
+	if (frac < SAME_COLUMN) {
+		*hit = cam->last_hits[old];
+		return true;
+	} else if (frac > 1 - SAME_COLUMN) {
+		*hit = cam->last_hits[old + 1];
+		return true;
+	}
+	return hit_between(job->board, job->cam_pos, dir,
+		&cam->last_hits[old], &cam->last_hits[old + 1], hit);
+}
+
+// Get the direction of the ray of column x.
+static d3d_vec_s column_dir(const struct draw_job *job, size_t x)
+{
+	const d3d_camera *cam = job->cam;
+	d3d_scalar angle = job->cam_facing + cam->fov.x
+		* ((d3d_scalar)0.5 - (d3d_scalar)x / cam->width);
+	return (d3d_vec_s){ cos(angle), sin(angle) };
+}
+
+// Find the hit of column x, reusing the last frame if possible.
+static void find_hit(const struct draw_job *job, size_t x, struct d3d_hit *hit)
+{
+	d3d_vec_s dir = column_dir(job, x);
+	if (!job->reuse || !reuse_hit(job, x, dir, hit)) {
+		CAST_RAY(job->board, job->cam_pos, dir, hit);
+		if (!hit->block) hit->txtr = job->cam->blank_block.faces[0];
+	}
+}
+
+// Fill in cam->hits strictly between the columns lo and hi, whose hits are
+// already there. Where the hits at both ends are on the same face and nothing
+// stands between their rays, the hits in between are found on that face's
+// plane. This is exactly what casting their rays would give. Otherwise, the
+// range is split.
+static void fill_hits_between(const struct draw_job *job, size_t lo, size_t hi)
+{
+	struct d3d_hit *hits = job->cam->hits;
+	while (hi - lo > 1) {
+		if (clear_between(job->board, job->cam_pos, &hits[lo],
+			&hits[hi])) {
+			size_t x = lo + 1;
+			while (x < hi && hit_between(job->board, job->cam_pos,
+				column_dir(job, x), &hits[lo], &hits[hi],
+				&hits[x]))
+				++x;
+			if (x == hi) return;
+		}
+		// Something changes between the ends, so cast a ray in the
+		// middle and look at both halves:
+		size_t mid = lo + (hi - lo) / 2;
+		find_hit(job, mid, &hits[mid]);
+		fill_hits_between(job, lo, mid);
+		lo = mid;
+	}
+}
+
+// Draw the columns in one of n_bands equal bands of the screen.
+static void draw_columns_band(void *arg, size_t band, size_t n_bands)
+{
+	const struct draw_job *job = arg;
+	d3d_camera *cam = job->cam;
+	size_t x_start = cam->width * band / n_bands;
+	size_t x_end = cam->width * (band + 1) / n_bands;
+	if (job->coherent && x_start < x_end) {
+		// Cast only every COHERENT_STRIDE columns, then fill in the
+		// rest and draw them:
+		find_hit(job, x_start, &cam->hits[x_start]);
+		for (size_t x = x_start; x < x_end - 1; ) {
+			size_t next = x + COHERENT_STRIDE;
+			if (next > x_end - 1) next = x_end - 1;
+			find_hit(job, next, &cam->hits[next]);
+			fill_hits_between(job, x, next);
+			x = next;
+		}
+		for (size_t x = x_start; x < x_end; ++x) {
+			draw_column(job, column_dir(job, x), x, &cam->hits[x]);
+		}
+		return;
+	}
+	for (size_t x = x_start; x < x_end; ++x) {
+		struct d3d_hit local_hit;
+		struct d3d_hit *hit = cam->hits ? &cam->hits[x] : &local_hit;
+		find_hit(job, x, hit);
+		draw_column(job, column_dir(job, x), x, hit);
+	}
+}
+
+// Get what the job is drawing.
+static struct d3d_view job_view(const struct draw_job *job)
+{
+	struct d3d_view view;
+	view.board = job->board;
+	view.revision = job->board->revision;
+	view.pos = job->cam_pos;
+	view.facing = job->cam_facing;
+	return view;
+}
+
+// Check whether the job draws from the same position on the same board as was
+// recorded in the view.
+static bool same_place(const struct d3d_view *view,
+	const struct draw_job *job)
+{
+	return view->board == job->board
+	    && view->revision == job->board->revision
+	    && view->pos.x == job->cam_pos.x
+	    && view->pos.y == job->cam_pos.y;
+}
+
+// Choose how the job casts rays, reusing the camera's last hits if they were
+// cast in the same place.
+static void plan_reuse(struct draw_job *job)
+{
+	d3d_camera *cam = job->cam;
+	job->coherent = cam->options & D3D_COHERENT_RAYS;
+	job->reuse = (cam->options & D3D_REUSE_RAYS)
+		&& same_place(&cam->hits_view, job);
+	if (!job->reuse) return;
+	d3d_scalar turn = cam->hits_view.facing - job->cam_facing;
+	if (turn > PI) turn -= 2 * PI;
+	if (turn < -PI) turn += 2 * PI;
+	job->shift = turn / cam->fov.x * cam->width;
+}
+
+// Keep the hits of the frame just drawn for the next frame.
+static void keep_hits(const struct draw_job *job)
+{
+	d3d_camera *cam = job->cam;
+	if (!cam->hits) return;
+	struct d3d_hit *swap = cam->hits;
+	cam->hits = cam->last_hits;
+	cam->last_hits = swap;
+	cam->hits_view = job_view(job);
+}
+
+// Draw the parts of the sprites within one of n_bands equal bands of the
+// screen. The sprites only need the depths of the band's own columns, so bands
+// are independent of each other.
+static void draw_sprites_band(void *arg, size_t band, size_t n_bands)
+{
+	const struct draw_job *job = arg;
+	d3d_camera *cam = job->cam;
+	size_t x_start = cam->width * band / n_bands;
+	size_t x_end = cam->width * (band + 1) / n_bands;
+	size_t i = job->n_sprites;
 	while (i--) {
 		struct d3d_sprite_order *ord = &cam->order[i];
-		draw_sprite_dist(cam, cam_pos, cam_facing, &sprites[ord->index],
-			ord->dist);
+		draw_sprite_dist(cam, job->cam_pos, job->cam_facing,
+			&job->sprites[ord->index], ord->dist, x_start, x_end);
+	}
+}
+
+// Run a job on every band of the camera, using its threads if it has them.
+static void run_bands(
+	d3d_camera *cam,
+	void (*run)(void *arg, size_t band, size_t n_bands),
+	void *arg)
+{
+#ifdef D3D_USE_PTHREADS
+	if (cam->pool) {
+		pool_run(cam->pool, run, arg);
+		return;
+	}
+#else
+	(void)cam;
+#endif
+	run(arg, 0, 1);
+}
+
+// Run a job on every band of its camera, or on the calling thread alone if the
+// job says so.
+static void run_job(
+	struct draw_job *job,
+	void (*run)(void *arg, size_t band, size_t n_bands))
+{
+	if (job->alone) {
+		run(job, 0, 1);
+	} else {
+		run_bands(job->cam, run, job);
+	}
+}
+
+// Draw the walls, floor, and ceiling of the job's frame, or copy them from the
+// camera's world cache if they are already there.
+static void draw_world(struct draw_job *job)
+{
+	d3d_camera *cam = job->cam;
+	size_t n_pixels = cam->width * cam->height;
+	if (cam->world && same_place(&cam->world_view, job)
+	 && cam->world_view.facing == job->cam_facing) {
+		memcpy(cam->pixels, cam->world, n_pixels * sizeof(*cam->world));
+		return;
+	}
+	plan_reuse(job);
+	run_job(job, draw_columns_band);
+	keep_hits(job);
+	if (cam->world) {
+		memcpy(cam->world, cam->pixels, n_pixels * sizeof(*cam->world));
+		cam->world_view = job_view(job);
+	}
+}
+
+// Set up a job to draw the board from a camera at a position and facing, once
+// the board is up to date. If the camera is outside the board, false is
+// returned and nothing is drawn.
+static bool begin_job(
+	struct draw_job *job,
+	d3d_camera *cam,
+	d3d_vec_s cam_pos,
+	d3d_scalar cam_facing,
+	const d3d_board *board,
+	const d3d_sprite_s sprites[])
+{
+	if (!(cam_pos.x > (d3d_scalar)0.0 && cam_pos.y > (d3d_scalar)0.0
+	 && cam_pos.x < board->width && cam_pos.y < board->height))
+		return false;
+	// Canonicalize camera direction:
+	cam_facing = fmod(cam_facing, 2 * PI);
+	if (cam_facing < (d3d_scalar)0.0) cam_facing += 2 * PI;
+	job->cam = cam;
+	job->cam_pos = cam_pos;
+	job->cam_facing = cam_facing;
+	job->board = board;
+	job->n_sprites = 0;
+	job->sprites = sprites;
+	job->draw_top = choose_rows_kernel(board, D3D_DUP);
+	job->draw_bottom = choose_rows_kernel(board, D3D_DDOWN);
+	job->alone = false;
+	return true;
+}
+
+// The first step of d3d_draw: start the job and draw the walls, floors, and
+// ceilings. If the camera is outside the board, its pixels are emptied and
+// false is returned, with nothing left to draw.
+static bool begin_draw(
+	struct draw_job *job,
+	d3d_camera *cam,
+	d3d_vec_s cam_pos,
+	d3d_scalar cam_facing,
+	const d3d_board *board,
+	const d3d_sprite_s sprites[])
+{
+	// The board is only const to the caller while it is drawn:
+	update_skip((d3d_board *)board);
+	if (!begin_job(job, cam, cam_pos, cam_facing, board, sprites)) {
+		empty_camera_pixels(cam);
+		return false;
 	}
+	draw_world(job);
+	return true;
+}
+
+// The second step of d3d_draw, after begin_draw returned true: draw the first
+// n_sprites of the job's sprites over the world.
+static void finish_draw(struct draw_job *job, size_t n_sprites)
+{
+	// The sprites are culled using the depths of the columns:
+	job->n_sprites = sort_sprites(job->cam, job->cam_pos, job->cam_facing,
+		n_sprites, job->sprites);
+	if (job->n_sprites > 0) run_bands(job->cam, draw_sprites_band, job);
 }
 
 void d3d_draw(
@@ -557,17 +2218,198 @@ void d3d_draw(
 	size_t n_sprites,
 	const d3d_sprite_s sprites[])
 {
-	if (cam_pos.x > (d3d_scalar)0.0 && cam_pos.y > (d3d_scalar)0.0
-	 && cam_pos.x < board->width && cam_pos.y < board->height) {
-		// Canonicalize camera direction:
-		cam_facing = fmod(cam_facing, 2 * PI);
-		if (cam_facing < (d3d_scalar)0.0) cam_facing += 2 * PI;
-		for (size_t x = 0; x < cam->width; ++x) {
-			draw_column(cam, cam_pos, cam_facing, board, x);
-		}
-		draw_sprites(cam, cam_pos, cam_facing, n_sprites, sprites);
+	struct draw_job job;
+	if (begin_draw(&job, cam, cam_pos, cam_facing, board, sprites))
+		finish_draw(&job, n_sprites);
+}
+
+// Cameras in d3d_draw_many at most this far from the first of a group, squared,
+// share its sorting of the sprites.
+#define NEARBY_POSE2 ((d3d_scalar)1.0)
+
+// Everything needed to draw the poses of d3d_draw_many.
+struct many_job {
+	// The jobs of the cameras inside the board, and how many there are.
+	struct draw_job *jobs;
+	size_t n_jobs;
+	// For each job, the sprites sorted from a nearby point, or NULL to sort
+	// them just for the camera.
+	const struct d3d_sprite_order **sorted;
+	size_t n_sprites;
+};
+
+// Draw one job of d3d_draw_many.
+static void draw_pose(struct many_job *many, size_t i)
+{
+	struct draw_job *job = &many->jobs[i];
+	draw_world(job);
+	if (many->sorted && many->sorted[i]) {
+		job->n_sprites = resort_sprites(job->cam, job->cam_pos,
+			job->cam_facing, many->n_sprites, job->sprites,
+			many->sorted[i]);
 	} else {
-		empty_camera_pixels(cam);
+		job->n_sprites = sort_sprites(job->cam, job->cam_pos,
+			job->cam_facing, many->n_sprites, job->sprites);
+	}
+	if (job->n_sprites > 0) run_job(job, draw_sprites_band);
+}
+
+#ifdef D3D_USE_PTHREADS
+// Draw every n_bands-th job of d3d_draw_many, each on this thread alone.
+static void draw_poses_band(void *arg, size_t band, size_t n_bands)
+{
+	struct many_job *many = arg;
+	for (size_t i = band; i < many->n_jobs; i += n_bands) {
+		many->jobs[i].alone = true;
+		draw_pose(many, i);
+	}
+}
+#endif /* defined(D3D_USE_PTHREADS) */
+
+// Sort the sprites once for each group of nearby jobs, filling in many->sorted.
+// The buffer holding the sorted orders is returned, or NULL if there are no
+// groups with more than one job, or if memory ran out. many->sorted is left
+// NULL then.
+static struct d3d_sprite_order *share_sprite_orders(
+	struct many_job *many,
+	const d3d_sprite_s sprites[])
+{
+	size_t n = many->n_sprites, n_groups = 0;
+	bool any_shared = false;
+	many->sorted = NULL;
+	if (n == 0 || many->n_jobs < 2) return NULL;
+	// First, the index of each job's group's first job is put in leaders:
+	size_t *leaders = d3d_malloc(many->n_jobs * sizeof(*leaders));
+	if (!leaders) return NULL;
+	for (size_t i = 0; i < many->n_jobs; ++i) {
+		d3d_vec_s pos = many->jobs[i].cam_pos;
+		leaders[i] = i;
+		for (size_t j = 0; j < i; ++j) {
+			d3d_vec_s lead = many->jobs[leaders[j]].cam_pos;
+			d3d_vec_s disp = { pos.x - lead.x, pos.y - lead.y };
+			if (disp.x * disp.x + disp.y * disp.y <= NEARBY_POSE2) {
+				leaders[i] = leaders[j];
+				any_shared = true;
+				break;
+			}
+		}
+		if (leaders[i] == i) ++n_groups;
+	}
+	struct d3d_sprite_order *buf = NULL;
+	const struct d3d_sprite_order **sorted = NULL;
+	if (!any_shared) goto end;
+	// One list of orders per group, plus scratch space for sorting:
+	size_t n_lists = n_groups + 1;
+	if (n > (size_t)-1 / sizeof(*buf) / n_lists) goto end;
+	buf = d3d_malloc(n_lists * n * sizeof(*buf));
+	sorted = d3d_malloc(many->n_jobs * sizeof(*sorted));
+	if (!buf || !sorted) goto error;
+	struct d3d_sprite_order *next = buf + n;
+	for (size_t i = 0; i < many->n_jobs; ++i) {
+		if (leaders[i] == i) {
+			sort_sprites_from(many->jobs[i].cam_pos, n, sprites,
+				next, buf);
+			sorted[i] = next;
+			next += n;
+		} else {
+			sorted[i] = sorted[leaders[i]];
+		}
+	}
+	many->sorted = sorted;
+	goto end;
+
+error:
+	d3d_free(sorted);
+	d3d_free(buf);
+	buf = NULL;
+end:
+	d3d_free(leaders);
+	return buf;
+}
+
+void d3d_draw_many(
+	size_t n_poses,
+	const d3d_pose_s poses[],
+	const d3d_board *board,
+	size_t n_sprites,
+	const d3d_sprite_s sprites[])
+{
+	struct many_job many;
+	many.jobs = n_poses > (size_t)-1 / sizeof(*many.jobs) ? NULL
+		: d3d_malloc(n_poses * sizeof(*many.jobs));
+	if (!many.jobs) {
+		// Nothing can be shared, but everything can still be drawn:
+		for (size_t i = 0; i < n_poses; ++i) {
+			d3d_draw(poses[i].cam, poses[i].pos, poses[i].facing,
+				board, n_sprites, sprites);
+		}
+		return;
+	}
+	many.n_jobs = 0;
+	many.n_sprites = n_sprites;
+	// The board is only const to the caller while it is drawn:
+	update_skip((d3d_board *)board);
+	for (size_t i = 0; i < n_poses; ++i) {
+		if (begin_job(&many.jobs[many.n_jobs], poses[i].cam,
+			poses[i].pos, poses[i].facing, board, sprites)) {
+			++many.n_jobs;
+		} else {
+			empty_camera_pixels(poses[i].cam);
+		}
+	}
+	struct d3d_sprite_order *sorted_buf =
+		share_sprite_orders(&many, sprites);
+#ifdef D3D_USE_PTHREADS
+	struct d3d_pool *pool = NULL;
+	for (size_t i = 0; i < many.n_jobs && !pool; ++i) {
+		pool = many.jobs[i].cam->pool;
+	}
+	if (pool && many.n_jobs >= pool->n_workers + 1) {
+		pool_run(pool, draw_poses_band, &many);
+		goto end;
+	}
+#endif
+	for (size_t i = 0; i < many.n_jobs; ++i) {
+		draw_pose(&many, i);
+	}
+#ifdef D3D_USE_PTHREADS
+end:
+#endif
+	d3d_free(many.sorted);
+	d3d_free(sorted_buf);
+	d3d_free(many.jobs);
+}
+
+void d3d_cast_rays(
+	const d3d_board *board,
+	size_t n_rays,
+	const d3d_vec_s origins[],
+	const d3d_vec_s dirs[],
+	d3d_ray_hit_s hits[])
+{
+	// The board is only const to the caller while rays are cast:
+	update_skip((d3d_board *)board);
+	for (size_t i = 0; i < n_rays; ++i) {
+		d3d_vec_s origin = origins[i], dir = dirs[i];
+		d3d_scalar len = hypot(dir.x, dir.y);
+		if (!(origin.x > (d3d_scalar)0.0 && origin.y > (d3d_scalar)0.0
+		 && origin.x < board->width && origin.y < board->height)
+		 || !(len > (d3d_scalar)0.0)) {
+			hits[i].block = NULL;
+			hits[i].face = D3D_DPOSX;
+			hits[i].pos = origin;
+			hits[i].dist = 0;
+			continue;
+		}
+		struct d3d_hit hit;
+		dir.x /= len;
+		dir.y /= len;
+		CAST_RAY(board, origin, dir, &hit);
+		hits[i].block = hit.block;
+		// A hit face's direction is the way out of the block:
+		hits[i].face = hit.block ? invert_dir(hit.face) : hit.face;
+		hits[i].pos = hit.pos;
+		hits[i].dist = hit.dist;
 	}
 }
 
@@ -586,6 +2428,11 @@ d3d_pixel *d3d_camera_get(d3d_camera *cam, size_t x, size_t y)
 	return GET(cam, pixels, x, y);
 }
 
+const d3d_pixel *d3d_camera_pixels(const d3d_camera *cam)
+{
+	return cam->pixels;
+}
+
 size_t d3d_texture_width(const d3d_texture *txtr)
 {
 	return txtr->width;
@@ -597,12 +2444,71 @@ size_t d3d_texture_height(const d3d_texture *txtr)
 }
 
 d3d_pixel *d3d_texture_get(d3d_texture *txtr, size_t x, size_t y)
+{
+	// The pixel might be changed, so the spans might become wrong:
+	d3d_free(txtr->spans);
+	txtr->spans = NULL;
+	return GET(txtr, pixels, x, y);
+}
+
+const d3d_pixel *d3d_texture_read(const d3d_texture *txtr, size_t x, size_t y)
 {
 	return GET(txtr, pixels, x, y);
 }
 
+int d3d_texture_prepare_sprite(d3d_texture *txtr, d3d_pixel transparent)
+{
+	if (txtr->spans && txtr->spans->transparent == transparent) return 0;
+	d3d_free(txtr->spans);
+	txtr->spans = NULL;
+	size_t n_runs = 0;
+	for (size_t i = 0; i < txtr->width * txtr->height; ++i) {
+		// Count the pixels starting runs:
+		if (txtr->pixels[i] != transparent
+		 && (i % txtr->height == 0
+		  || txtr->pixels[i - 1] == transparent))
+			++n_runs;
+	}
+	size_t size = offsetof(struct d3d_sprite_spans, runs);
+	if (n_runs * sizeof(struct d3d_span) / sizeof(struct d3d_span)
+		!= n_runs) return -1;
+	CHECKED_ADD_INT(size, n_runs * sizeof(struct d3d_span));
+	ALIGN_SIZE_INT(size, size_t);
+	size_t starts_offset = size;
+	CHECKED_ADD_INT(size, (txtr->width + 1) * sizeof(size_t));
+	struct d3d_sprite_spans *spans = d3d_malloc(size);
+	if (!spans) return -1;
+	spans->transparent = transparent;
+	spans->starts = (void *)((char *)spans + starts_offset);
+	n_runs = 0;
+	for (size_t x = 0; x < txtr->width; ++x) {
+		const d3d_pixel *column = &txtr->pixels[txtr->height * x];
+		spans->starts[x] = n_runs;
+		for (size_t y = 0; y < txtr->height; ++y) {
+			if (column[y] == transparent) continue;
+			struct d3d_span *run = &spans->runs[n_runs++];
+			run->top = y;
+			while (y < txtr->height && column[y] != transparent) {
+				++y;
+			}
+			run->bottom = y;
+		}
+	}
+	spans->starts[txtr->width] = n_runs;
+	txtr->spans = spans;
+	return 0;
+}
+
+void d3d_destroy_texture(d3d_texture *txtr)
+{
+	if (!txtr) return;
+	d3d_free(txtr->spans);
+	txtr->spans = NULL;
+}
+
 void d3d_free_texture(d3d_texture *txtr)
 {
+	d3d_destroy_texture(txtr);
 	d3d_free(txtr);
 }
 
@@ -616,12 +2522,784 @@ size_t d3d_board_height(const d3d_board *board)
 	return board->height;
 }
 
+// Remember that the tile at (x, y) might be changed by the user.
+static void mark_dirty(d3d_board *board, size_t x, size_t y)
+{
+	++board->revision;
+	if (x < board->dirty_x0) board->dirty_x0 = x;
+	if (y < board->dirty_y0) board->dirty_y0 = y;
+	if (x >= board->dirty_x1) board->dirty_x1 = x + 1;
+	if (y >= board->dirty_y1) board->dirty_y1 = y + 1;
+}
+
 const d3d_block_s **d3d_board_get(d3d_board *board, size_t x, size_t y)
 {
-	return GET(board, blocks, x, y);
+	if (board->cells) return NULL;
+	const d3d_block_s **got = GET(board, blocks, x, y);
+	if (got) mark_dirty(board, x, y);
+	return got;
+}
+
+d3d_cell *d3d_board_cell(d3d_board *board, size_t x, size_t y)
+{
+	if (!board->cells) return NULL;
+	d3d_cell *got = GET(board, cells, x, y);
+	if (got) mark_dirty(board, x, y);
+	return got;
+}
+
+d3d_cell d3d_board_read_cell(const d3d_board *board, size_t x, size_t y)
+{
+	if (!board->cells) return 0;
+	const d3d_cell *got = GET(board, cells, x, y);
+	return got ? *got : 0;
 }
 
 void d3d_free_board(d3d_board *board)
 {
 	d3d_free(board);
 }
+
+#if CTF_TESTS_ENABLED
+
+#	include "libctf.h"
+#	include <assert.h>
+
+// A pseudorandom number generator so the tests are repeatable.
+static unsigned long test_rand(unsigned long *state)
+{
+	*state = *state * 1103515245 + 12345;
+	return *state / 65536 % 32768;
+}
+
+// A random scalar in [0, 1).
+static d3d_scalar test_frand(unsigned long *state)
+{
+	return (d3d_scalar)test_rand(state) / 32768;
+}
+
+// A board full of a mix of solid blocks, blocks with only some faces, and empty
+// tiles, along with the things it refers to.
+struct test_world {
+	d3d_texture *txtrs[4];
+	d3d_block_s blocks[5];
+	d3d_board *board;
+};
+
+static void set_up_world(struct test_world *world, size_t width, size_t height)
+{
+	unsigned long seed = 1;
+	for (size_t i = 0; i < 4; ++i) {
+		world->txtrs[i] = d3d_new_texture(7 + i, 5 + i, (d3d_pixel)i);
+		assert(world->txtrs[i]);
+		for (size_t x = 0; x < 7 + i; ++x) {
+			*d3d_texture_get(world->txtrs[i], x, x % (5 + i)) =
+				(d3d_pixel)(x + 10);
+		}
+	}
+	d3d_texture **t = world->txtrs;
+	world->blocks[0] = (d3d_block_s){{ t[0], t[1], t[2], t[3], t[0], t[1] }};
+	world->blocks[1] = (d3d_block_s){{ t[0], NULL, NULL, NULL, NULL, t[1] }};
+	world->blocks[2] = (d3d_block_s){{ NULL, t[2], NULL, t[3], t[3], NULL }};
+	world->blocks[3] = (d3d_block_s){{ NULL, NULL, NULL, NULL, t[3], t[2] }};
+	world->blocks[4] = (d3d_block_s){{ NULL, NULL, NULL, NULL, NULL, NULL }};
+	world->board = d3d_new_board(width, height, &world->blocks[3]);
+	assert(world->board);
+	for (size_t x = 0; x < width; ++x) {
+		for (size_t y = 0; y < height; ++y) {
+			unsigned long r = test_rand(&seed) % 20;
+			*d3d_board_get(world->board, x, y) =
+				&world->blocks[r < 3 ? r : r < 5 ? 4 : 3];
+		}
+	}
+	update_skip(world->board);
+}
+
+static void tear_down_world(struct test_world *world)
+{
+	d3d_free_board(world->board);
+	for (size_t i = 0; i < 4; ++i) {
+		d3d_free_texture(world->txtrs[i]);
+	}
+}
+
+CTF_TEST(d3d_dda_matches_hit_wall,
+	struct test_world world;
+	set_up_world(&world, 40, 30);
+	unsigned long seed = 2;
+	int n_rays = 20000, n_differ = 0;
+	for (int i = 0; i < n_rays; ++i) {
+		d3d_vec_s pos = {
+			(d3d_scalar)0.01 + test_frand(&seed) * 39.98,
+			(d3d_scalar)0.01 + test_frand(&seed) * 29.98
+		};
+		// Start some rays right on grid lines:
+		if (i % 10 == 0 && pos.x >= 1) pos.x = floor(pos.x);
+		d3d_scalar angle = test_frand(&seed) * 2 * PI;
+		// Send some rays along the axes or diagonals:
+		if (i % 7 == 0) angle = test_rand(&seed) % 8 * PI / 4;
+		d3d_vec_s dir = { cos(angle), sin(angle) };
+		struct d3d_hit dda, legacy;
+		cast_ray(world.board, pos, dir, &dda);
+		cast_ray_legacy(world.board, pos, dir, &legacy);
+		// hit_wall nudges rays 0.0001 past each line, so it can go
+		// either way from the DDA right at corners:
+		if (dda.block != legacy.block || (dda.block
+		 && (dda.face != legacy.face || dda.txtr != legacy.txtr))) {
+			++n_differ;
+			continue;
+		}
+		assert(fabs(dda.dist - legacy.dist) < 0.01);
+		assert(fabs(dda.pos.x - legacy.pos.x) < 0.01);
+		assert(fabs(dda.pos.y - legacy.pos.y) < 0.01);
+	}
+	assert(n_differ < n_rays / 1000);
+	tear_down_world(&world);
+)
+
+// Set a few scattered tiles of a mostly empty board to the block.
+static void scatter_blocks(
+	d3d_board *board,
+	const d3d_block_s *block,
+	size_t n,
+	unsigned long *seed)
+{
+	while (n--) {
+		size_t x = test_rand(seed) % board->width;
+		size_t y = test_rand(seed) % board->height;
+		*d3d_board_get(board, x, y) = block;
+	}
+}
+
+CTF_TEST(d3d_skipping_empty_space_hits_same_walls,
+	struct test_world world;
+	set_up_world(&world, 4, 4);
+	d3d_board *board = d3d_new_board(120, 90, NULL);
+	assert(board);
+	unsigned long seed = 6;
+	scatter_blocks(board, &world.blocks[0], 40, &seed);
+	scatter_blocks(board, &world.blocks[1], 40, &seed);
+	update_skip(board);
+	size_t n_tiles = board->width * board->height;
+	unsigned char *skip = malloc(n_tiles);
+	assert(skip);
+	memcpy(skip, board->skip, n_tiles);
+	size_t steps_skipping = 0, steps_walking = 0;
+	for (int i = 0; i < 5000; ++i) {
+		d3d_vec_s pos = {
+			(d3d_scalar)0.01 + test_frand(&seed) * 119.98,
+			(d3d_scalar)0.01 + test_frand(&seed) * 89.98
+		};
+		d3d_scalar angle = test_frand(&seed) * 2 * PI;
+		if (i % 7 == 0) angle = test_rand(&seed) % 8 * PI / 4;
+		d3d_vec_s dir = { cos(angle), sin(angle) };
+		struct ray ray;
+		struct d3d_hit skipping, walking;
+		memcpy(board->skip, skip, n_tiles);
+		init_ray(&ray, pos, dir);
+		trace_ray(board, &ray, &skipping);
+		steps_skipping += ray.steps;
+		memset(board->skip, 0, n_tiles);
+		init_ray(&ray, pos, dir);
+		trace_ray(board, &ray, &walking);
+		steps_walking += ray.steps;
+		assert(skipping.block == walking.block);
+		assert(skipping.face == walking.face);
+		assert(fabs(skipping.dist - walking.dist) < 0.0001);
+	}
+	assert(steps_skipping * 2 < steps_walking);
+	free(skip);
+	d3d_free_board(board);
+	tear_down_world(&world);
+)
+
+CTF_TEST(d3d_skip_updates_match_rebuilding,
+	struct test_world world;
+	set_up_world(&world, 4, 4);
+	// Wide enough that updates only look at part of the board:
+	d3d_board *board = d3d_new_board(700, 20, NULL);
+	assert(board);
+	unsigned long seed = 7;
+	scatter_blocks(board, &world.blocks[0], 30, &seed);
+	update_skip(board);
+	unsigned char *rebuilt = malloc(700 * 20);
+	assert(rebuilt);
+	for (int i = 0; i < 40; ++i) {
+		// Put a wall somewhere, then take it away again:
+		size_t x = test_rand(&seed) % 700, y = test_rand(&seed) % 20;
+		*d3d_board_get(board, x, y) = &world.blocks[i % 3];
+		update_skip(board);
+		compute_skip(board, 0, 0, 700, 20, rebuilt);
+		assert(!memcmp(board->skip, rebuilt, 700 * 20));
+		*d3d_board_get(board, x, y) = &world.blocks[4];
+		update_skip(board);
+		compute_skip(board, 0, 0, 700, 20, rebuilt);
+		assert(!memcmp(board->skip, rebuilt, 700 * 20));
+	}
+	free(rebuilt);
+	d3d_free_board(board);
+	tear_down_world(&world);
+)
+
+// Fill the array with n sprites scattered around a board with the dimensions.
+static void set_up_sprites(
+	d3d_sprite_s *sprites,
+	size_t n,
+	const d3d_texture *txtr,
+	size_t width,
+	size_t height)
+{
+	unsigned long seed = 3;
+	for (size_t i = 0; i < n; ++i) {
+		sprites[i].pos.x = test_frand(&seed) * width;
+		sprites[i].pos.y = test_frand(&seed) * height;
+		sprites[i].scale.x = (d3d_scalar)0.1 + test_frand(&seed);
+		sprites[i].scale.y = (d3d_scalar)0.1 + test_frand(&seed);
+		sprites[i].txtr = txtr;
+		sprites[i].transparent = (d3d_pixel)(i % 4);
+	}
+}
+
+// Check that two cameras of the same dimensions captured the same thing.
+static bool cameras_match(d3d_camera *a, d3d_camera *b)
+{
+	return !memcmp(a->pixels, b->pixels, a->width * a->height)
+	    && !memcmp(a->dists, b->dists, a->width * sizeof(*a->dists));
+}
+
+CTF_TEST(d3d_threads_draw_same_frame,
+	struct test_world world;
+	set_up_world(&world, 40, 30);
+	d3d_sprite_s sprites[50];
+	set_up_sprites(sprites, 50, world.txtrs[2], 40, 30);
+	d3d_camera *single = d3d_new_camera(1.2, 0.6, 101, 37, 0);
+	d3d_camera *multi = d3d_new_camera(1.2, 0.6, 101, 37, 0);
+	assert(single && multi);
+	// This only draws with more threads if threads are enabled:
+	d3d_camera_set_threads(multi, 4);
+	for (int i = 0; i < 20; ++i) {
+		d3d_vec_s pos = { 3.5 + i * 1.7, 2.5 + i * 1.3 };
+		d3d_draw(single, pos, i * 0.4, world.board, 50, sprites);
+		d3d_draw(multi, pos, i * 0.4, world.board, 50, sprites);
+		assert(cameras_match(single, multi));
+	}
+	d3d_free_camera(single);
+	d3d_free_camera(multi);
+	tear_down_world(&world);
+)
+
+CTF_TEST(d3d_row_distances_match_per_pixel_floor,
+	struct test_world world;
+	set_up_world(&world, 40, 30);
+	d3d_camera *cam = d3d_new_camera(1.2, 0.6, 101, 38, 0);
+	assert(cam);
+	unsigned long seed = 4;
+	long n_pixels = 0, n_differ = 0;
+	for (int i = 0; i < 300; ++i) {
+		d3d_vec_s pos = {
+			(d3d_scalar)0.01 + test_frand(&seed) * 39.98,
+			(d3d_scalar)0.01 + test_frand(&seed) * 29.98
+		};
+		d3d_scalar angle = test_frand(&seed) * 2 * PI;
+		d3d_vec_s dir = { cos(angle), sin(angle) };
+		struct d3d_hit hit;
+		cast_ray(world.board, pos, dir, &hit);
+		d3d_vec_s disp = { hit.pos.x - pos.x, hit.pos.y - pos.y };
+		if (hit.dist == (d3d_scalar)0.0) continue;
+		for (size_t t = 0; t < cam->height; ++t) {
+			if (cam->tans[t] == (d3d_scalar)0.0) continue;
+			d3d_direction face =
+				cam->tans[t] > 0 ? D3D_DUP : D3D_DDOWN;
+			++n_pixels;
+			n_differ += top_bottom_pixel(cam, pos, dir,
+				world.board, t, face)
+				!= top_bottom_pixel_legacy(cam, pos, disp,
+				hit.dist, world.board, t, face);
+		}
+	}
+	// Rounding can only make a difference right at texel edges:
+	assert(n_differ <= n_pixels / 1000);
+	d3d_free_camera(cam);
+	tear_down_world(&world);
+)
+
+CTF_TEST(d3d_wall_rows_match_per_pixel_test,
+	unsigned long seed = 5;
+	for (size_t height = 1; height < 60; height += 7) {
+		d3d_camera *cam = d3d_new_camera(1.2, 0.1 + height * 0.03,
+			10, height, 0);
+		assert(cam);
+		for (int i = 0; i < 500; ++i) {
+			d3d_scalar dist = i == 0 ? 0 : test_frand(&seed) * 20;
+			size_t top, bottom;
+			wall_rows(cam, dist, &top, &bottom);
+			assert(top <= bottom && bottom <= height);
+			for (size_t t = 0; t < height; ++t) {
+				d3d_scalar dist_y =
+					cam->tans[t] * dist + (d3d_scalar)0.5;
+				bool wall = dist_y > (d3d_scalar)0.0
+					&& dist_y < (d3d_scalar)1.0;
+				assert(wall == (t >= top && t < bottom));
+			}
+		}
+		d3d_free_camera(cam);
+	}
+)
+
+CTF_TEST(d3d_compact_board_draws_same_frame,
+	struct test_world world;
+	set_up_world(&world, 40, 30);
+	d3d_board *compact = d3d_new_compact_board(40, 30, 5, world.blocks);
+	assert(compact);
+	for (size_t x = 0; x < 40; ++x) {
+		for (size_t y = 0; y < 30; ++y) {
+			size_t idx = *d3d_board_get(world.board, x, y)
+				- world.blocks;
+			// Data in the high bits is left alone:
+			*d3d_board_cell(compact, x, y) = (d3d_cell)(idx
+				| (x + y) % 16 << D3D_CELL_BLOCK_BITS);
+		}
+	}
+	assert(!d3d_board_get(compact, 0, 0));
+	assert(!d3d_board_cell(world.board, 0, 0));
+	d3d_camera *a = d3d_new_camera(1.2, 0.6, 64, 30, 0);
+	d3d_camera *b = d3d_new_camera(1.2, 0.6, 64, 30, 0);
+	assert(a && b);
+	unsigned long seed = 8;
+	for (int i = 0; i < 30; ++i) {
+		d3d_vec_s pos = {
+			1 + test_frand(&seed) * 38, 1 + test_frand(&seed) * 28
+		};
+		d3d_draw(a, pos, i * 0.4, world.board, 0, NULL);
+		d3d_draw(b, pos, i * 0.4, compact, 0, NULL);
+		assert(cameras_match(a, b));
+	}
+	assert(d3d_board_read_cell(compact, 3, 4) >> D3D_CELL_BLOCK_BITS == 7);
+	assert(d3d_board_read_cell(compact, 40, 4) == 0);
+	d3d_free_camera(a);
+	d3d_free_camera(b);
+	d3d_free_board(compact);
+	tear_down_world(&world);
+)
+
+// Draw a sprite the way it was done before sprites were clipped up front and
+// had their textures stepped in fixed point, as a reference.
+static void reference_draw_sprite(
+	d3d_camera *cam,
+	d3d_vec_s cam_pos,
+	d3d_scalar cam_facing,
+	const d3d_sprite_s *sp,
+	d3d_scalar dist)
+{
+	d3d_vec_s disp = { sp->pos.x - cam_pos.x, sp->pos.y - cam_pos.y };
+	if (dist == (d3d_scalar)0.0) return;
+	d3d_scalar angle = atan2(disp.y, disp.x);
+	d3d_scalar width = atan(sp->scale.x / dist) * 2;
+	d3d_scalar diff = angle_diff(cam_facing, angle);
+	if (fabs(diff) > (cam->fov.x + width) / 2) return;
+	d3d_scalar height =
+		atan(sp->scale.y / dist) * 2 / cam->fov.y * cam->height;
+	width = width / cam->fov.x * cam->width;
+	long start_x =
+		(cam->width - width) / 2 + diff / cam->fov.x * cam->width;
+	long start_y = (cam->height - height) / 2;
+	for (size_t x = 0; x < width; ++x) {
+		size_t cx = x + start_x;
+		if (cx >= cam->width || dist >= cam->dists[cx]) continue;
+		size_t sx = (d3d_scalar)x / width * sp->txtr->width;
+		if (sx >= sp->txtr->width) continue;
+		for (size_t y = 0; y < height; ++y) {
+			size_t cy = y + start_y;
+			if (cy >= cam->height) continue;
+			size_t sy = (d3d_scalar)y / height * sp->txtr->height;
+			if (sy >= sp->txtr->height) continue;
+			d3d_pixel p = *GET(sp->txtr, pixels, sx, sy);
+			if (p != sp->transparent) *GET(cam, pixels, cx, cy) = p;
+		}
+	}
+}
+
+CTF_TEST(d3d_clipped_sprites_match_reference,
+	struct test_world world;
+	set_up_world(&world, 40, 30);
+	d3d_texture *txtr = d3d_new_texture(9, 13, 1);
+	assert(txtr);
+	for (size_t x = 0; x < 9; ++x) {
+		for (size_t y = 0; y < 13; ++y) {
+			*d3d_texture_get(txtr, x, y) = (x * 3 + y) % 5;
+		}
+	}
+	d3d_sprite_s sprites[60];
+	set_up_sprites(sprites, 60, txtr, 40, 30);
+	d3d_camera *cam = d3d_new_camera(1.2, 0.6, 97, 41, 0);
+	d3d_camera *ref = d3d_new_camera(1.2, 0.6, 97, 41, 0);
+	assert(cam && ref);
+	long n_pixels = 0, n_differ = 0;
+	// The facings are kept under 2 pi, since d3d_draw canonicalizes them:
+	for (int i = 0; i < 20; ++i) {
+		d3d_vec_s pos = { 20 + i % 7 * 0.3, 15 - i % 5 * 0.4 };
+		d3d_draw(cam, pos, i * 0.3, world.board, 60, sprites);
+		d3d_draw(ref, pos, i * 0.3, world.board, 0, NULL);
+		size_t n = sort_sprites(ref, pos, i * 0.3, 60, sprites);
+		for (size_t j = n; j--; ) {
+			struct d3d_sprite_order *ord = &ref->order[j];
+			reference_draw_sprite(ref, pos, i * 0.3,
+				&sprites[ord->index], ord->dist);
+		}
+		for (size_t p = 0; p < 97 * 41; ++p) {
+			++n_pixels;
+			if (cam->pixels[p] != ref->pixels[p]) ++n_differ;
+		}
+	}
+	// Only texels at the rounding edges may be different:
+	assert(n_differ * 1000 < n_pixels);
+	d3d_free_camera(cam);
+	d3d_free_camera(ref);
+	d3d_free_texture(txtr);
+	tear_down_world(&world);
+)
+
+CTF_TEST(d3d_culled_sprites_draw_same_frame,
+	struct test_world world;
+	set_up_world(&world, 40, 30);
+	d3d_texture *txtr = d3d_new_texture(5, 6, 1);
+	assert(txtr);
+	*d3d_texture_get(txtr, 2, 3) = 2;
+	size_t n = 300;
+	d3d_sprite_s sprites[300];
+	struct d3d_sprite_order all[300];
+	set_up_sprites(sprites, n, txtr, 40, 30);
+	d3d_camera *cam = d3d_new_camera(1.2, 0.6, 80, 30, 0);
+	d3d_camera *ref = d3d_new_camera(1.2, 0.6, 80, 30, 0);
+	assert(cam && ref);
+	unsigned long seed = 9;
+	for (int i = 0; i < 20; ++i) {
+		d3d_vec_s pos = { 20 + i % 7 * 0.3, 15 - i % 5 * 0.4 };
+		d3d_scalar facing = i * 0.3;
+		// Move the sprites a bit so both sorting paths are used:
+		for (size_t s = 0; s < n; ++s) {
+			sprites[s].pos.x += test_frand(&seed) * 0.2 - 0.1;
+		}
+		d3d_draw(cam, pos, facing, world.board, i % 3 ? n : 50, sprites);
+		// Draw every sprite without culling, farthest first:
+		d3d_draw(ref, pos, facing, world.board, 0, NULL);
+		size_t n_ref = i % 3 ? n : 50;
+		for (size_t s = 0; s < n_ref; ++s) {
+			d3d_scalar dx = sprites[s].pos.x - pos.x;
+			d3d_scalar dy = sprites[s].pos.y - pos.y;
+			all[s].dist = sqrt(dx * dx + dy * dy);
+			all[s].index = s;
+		}
+		insertion_sort_orders(all, n_ref);
+		for (size_t s = n_ref; s--; ) {
+			draw_sprite_dist(ref, pos, facing,
+				&sprites[all[s].index], all[s].dist, 0, 80);
+		}
+		assert(cameras_match(cam, ref));
+	}
+	d3d_free_camera(cam);
+	d3d_free_camera(ref);
+	d3d_free_texture(txtr);
+	tear_down_world(&world);
+)
+
+CTF_TEST(d3d_sprite_spans_draw_same_frame,
+	struct test_world world;
+	set_up_world(&world, 40, 30);
+	d3d_texture *txtr = d3d_new_texture(7, 11, 0);
+	assert(txtr);
+	unsigned long seed = 10;
+	for (size_t x = 0; x < 7; ++x) {
+		for (size_t y = 0; y < 11; ++y) {
+			// Mostly holes, with some runs touching the ends:
+			*d3d_texture_get(txtr, x, y) = test_rand(&seed) % 3 ?
+				0 : 1 + x % 3;
+		}
+	}
+	d3d_sprite_s sprites[80];
+	set_up_sprites(sprites, 80, txtr, 40, 30);
+	for (size_t i = 0; i < 80; ++i) {
+		sprites[i].transparent = 0;
+	}
+	d3d_camera *cam = d3d_new_camera(1.2, 0.6, 90, 47, 0);
+	d3d_camera *ref = d3d_new_camera(1.2, 0.6, 90, 47, 0);
+	assert(cam && ref);
+	for (int i = 0; i < 20; ++i) {
+		d3d_vec_s pos = { 20 + i % 7 * 0.3, 15 - i % 5 * 0.4 };
+		assert(!d3d_texture_prepare_sprite(txtr, 0));
+		// Reading a pixel keeps the spans:
+		d3d_texture_read(txtr, 0, 0);
+		assert(txtr->spans);
+		d3d_draw(cam, pos, i * 0.3, world.board, 80, sprites);
+		// Throw the spans away and draw pixel by pixel:
+		d3d_texture_get(txtr, 0, 0);
+		d3d_draw(ref, pos, i * 0.3, world.board, 0, NULL);
+		size_t n = sort_sprites(ref, pos, i * 0.3, 80, sprites);
+		for (size_t j = n; j--; ) {
+			struct d3d_sprite_order *ord = &ref->order[j];
+			draw_sprite_dist(ref, pos, i * 0.3,
+				&sprites[ord->index], ord->dist, 0, 90);
+		}
+		assert(cameras_match(cam, ref));
+		// Drawing does not find the spans by itself:
+		d3d_draw(cam, pos, i * 0.3, world.board, 80, sprites);
+		assert(!txtr->spans);
+		assert(cameras_match(cam, ref));
+	}
+	// Spans for another transparent pixel are not used:
+	assert(!d3d_texture_prepare_sprite(txtr, 1));
+	d3d_draw(cam, (d3d_vec_s){ 20, 15 }, 0, world.board, 80, sprites);
+	assert(txtr->spans->transparent == 1);
+	d3d_free_camera(cam);
+	d3d_free_camera(ref);
+	d3d_free_texture(txtr);
+	tear_down_world(&world);
+)
+
+// Count the pixels where two cameras of the same dimensions differ.
+static size_t count_different_pixels(d3d_camera *a, d3d_camera *b)
+{
+	size_t n = 0;
+	for (size_t i = 0; i < a->width * a->height; ++i) {
+		n += a->pixels[i] != b->pixels[i];
+	}
+	return n;
+}
+
+CTF_TEST(d3d_reused_rays_draw_nearly_same_frame,
+	struct test_world world;
+	set_up_world(&world, 40, 30);
+	d3d_camera *cam = d3d_new_camera(1.2, 0.6, 120, 40, 0);
+	d3d_camera *ref = d3d_new_camera(1.2, 0.6, 120, 40, 0);
+	assert(cam && ref);
+	assert(!d3d_camera_set_options(cam, D3D_REUSE_RAYS));
+	assert(d3d_camera_options(cam) == D3D_REUSE_RAYS);
+	d3d_vec_s pos = { 20.5, 15.5 };
+	size_t n_different = 0;
+	// Turn by arbitrary angles both ways:
+	for (int i = 0; i < 40; ++i) {
+		d3d_scalar facing = (i < 20 ? i : 40 - i) * 0.037;
+		d3d_draw(cam, pos, facing, world.board, 0, NULL);
+		d3d_draw(ref, pos, facing, world.board, 0, NULL);
+		n_different += count_different_pixels(cam, ref);
+	}
+	// Intersecting a face directly may round a pixel differently now and then:
+	assert(n_different <= 40);
+	// Turn by whole columns:
+	n_different = 0;
+	for (int i = 0; i < 20; ++i) {
+		d3d_scalar facing = 1 - i * 3 * (d3d_scalar)1.2 / 120;
+		d3d_draw(cam, pos, facing, world.board, 0, NULL);
+		d3d_draw(ref, pos, facing, world.board, 0, NULL);
+		n_different += count_different_pixels(cam, ref);
+	}
+	assert(n_different == 0);
+	// Changing the board or moving casts everything again:
+	*d3d_board_get(world.board, 21, 15) = &world.blocks[0];
+	d3d_draw(cam, pos, 0.5, world.board, 0, NULL);
+	d3d_draw(ref, pos, 0.5, world.board, 0, NULL);
+	assert(cameras_match(cam, ref));
+	pos.x += 0.25;
+	d3d_draw(cam, pos, 0.5, world.board, 0, NULL);
+	d3d_draw(ref, pos, 0.5, world.board, 0, NULL);
+	assert(cameras_match(cam, ref));
+	assert(!d3d_camera_set_options(cam, 0));
+	assert(!cam->hits);
+	d3d_free_camera(cam);
+	d3d_free_camera(ref);
+	tear_down_world(&world);
+)
+
+CTF_TEST(d3d_cached_world_draws_same_frame,
+	struct test_world world;
+	set_up_world(&world, 40, 30);
+	d3d_sprite_s sprites[50];
+	set_up_sprites(sprites, 50, world.txtrs[2], 40, 30);
+	d3d_camera *cam = d3d_new_camera(1.2, 0.6, 77, 31, 0);
+	d3d_camera *ref = d3d_new_camera(1.2, 0.6, 77, 31, 0);
+	assert(cam && ref);
+	assert(!d3d_camera_set_options(cam, D3D_CACHE_WORLD));
+	for (int i = 0; i < 30; ++i) {
+		// Stand still for a few frames at a time while sprites move:
+		d3d_vec_s pos = { 18.5 + i / 4, 14.5 };
+		d3d_scalar facing = i / 4 * 0.8;
+		for (size_t j = 0; j < 50; ++j) {
+			sprites[j].pos.x = 15 + (i + j) % 11;
+		}
+		if (i == 13) {
+			*d3d_board_get(world.board, (size_t)pos.x + 1, 14) =
+				&world.blocks[0];
+		}
+		d3d_draw(cam, pos, facing, world.board, 50, sprites);
+		d3d_draw(ref, pos, facing, world.board, 50, sprites);
+		assert(cameras_match(cam, ref));
+	}
+	d3d_free_camera(cam);
+	d3d_free_camera(ref);
+	tear_down_world(&world);
+)
+
+CTF_TEST(d3d_coherent_rays_draw_same_frame,
+	struct test_world world;
+	set_up_world(&world, 40, 30);
+	d3d_camera *cam = d3d_new_camera(1.2, 0.6, 130, 40, 0);
+	d3d_camera *ref = d3d_new_camera(1.2, 0.6, 130, 40, 0);
+	assert(cam && ref);
+	assert(!d3d_camera_set_options(cam, D3D_COHERENT_RAYS));
+	// Threads split the columns up differently:
+	d3d_camera_set_threads(cam, 3);
+	size_t n_different = 0;
+	unsigned long seed = 12;
+	for (int i = 0; i < 30; ++i) {
+		d3d_vec_s pos = {
+			1 + test_frand(&seed) * 38, 1 + test_frand(&seed) * 28
+		};
+		d3d_draw(cam, pos, i * 0.4, world.board, 0, NULL);
+		d3d_draw(ref, pos, i * 0.4, world.board, 0, NULL);
+		n_different += count_different_pixels(cam, ref);
+	}
+	assert(n_different == 0);
+	d3d_free_camera(cam);
+	d3d_free_camera(ref);
+	tear_down_world(&world);
+)
+
+CTF_TEST(d3d_board_flags_choose_same_frame,
+	struct test_world world;
+	set_up_world(&world, 30, 30);
+	d3d_texture *small = d3d_new_texture(2, 3, 5);
+	assert(small);
+	d3d_block_s plain = {{ NULL, NULL, NULL, NULL, world.txtrs[1], NULL }};
+	d3d_block_s odd = {{ NULL, NULL, NULL, NULL, small, world.txtrs[3] }};
+	d3d_block_s pillar = {{
+		world.txtrs[0], world.txtrs[0], world.txtrs[0], world.txtrs[0],
+		world.txtrs[1], world.txtrs[3]
+	}};
+	d3d_board *board = d3d_new_board(30, 30, &plain);
+	assert(board);
+	// Ceilings everywhere of one size and no floors:
+	assert(board_face_flags(board, D3D_DUP)
+		== (BOARD_ANY | BOARD_ALL | BOARD_UNIFORM));
+	assert(!(board_face_flags(board, D3D_DDOWN) & BOARD_ANY));
+	d3d_camera *cam = d3d_new_camera(1.2, 0.9, 60, 41, 0);
+	d3d_camera *ref = d3d_new_camera(1.2, 0.9, 60, 41, 0);
+	assert(cam && ref);
+	unsigned long seed = 6;
+	for (int i = 0; i < 40; ++i) {
+		if (i == 10) {
+			// Floors on some tiles, all the same size:
+			*d3d_board_get(board, 10, 11) = &pillar;
+			*d3d_board_get(board, 20, 15) = &pillar;
+		} else if (i == 20) {
+			// A ceiling of another size:
+			*d3d_board_get(board, 14, 14) = &odd;
+		} else if (i == 30) {
+			// A tile with no ceiling:
+			*d3d_board_get(board, 16, 13) = &world.blocks[4];
+		}
+		d3d_vec_s pos = {
+			12 + test_frand(&seed) * 6, 12 + test_frand(&seed) * 6
+		};
+		d3d_draw(cam, pos, i * 0.4, board, 0, NULL);
+		// Draw the reference with the flags that allow anything:
+		unsigned flags = board->flags;
+		board->flags = BOARD_ANY | BOARD_ANY << BOARD_FLOOR_SHIFT;
+		d3d_draw(ref, pos, i * 0.4, board, 0, NULL);
+		board->flags = flags;
+		assert(cameras_match(cam, ref));
+	}
+	assert(board_face_flags(board, D3D_DUP) == BOARD_ANY);
+	assert(board_face_flags(board, D3D_DDOWN)
+		== (BOARD_ANY | BOARD_UNIFORM));
+	d3d_free_camera(cam);
+	d3d_free_camera(ref);
+	d3d_free_board(board);
+	d3d_free_texture(small);
+	tear_down_world(&world);
+)
+
+CTF_TEST(d3d_draw_many_draws_same_frames,
+	struct test_world world;
+	set_up_world(&world, 40, 30);
+	d3d_sprite_s sprites[50];
+	set_up_sprites(sprites, 50, world.txtrs[2], 40, 30);
+	d3d_camera *cams[5], *refs[5];
+	for (size_t c = 0; c < 5; ++c) {
+		cams[c] = d3d_new_camera(1.2, 0.6, 70 + c * 10, 30, 0);
+		refs[c] = d3d_new_camera(1.2, 0.6, 70 + c * 10, 30, 0);
+		assert(cams[c] && refs[c]);
+	}
+	// These cameras are drawn on the threads of the first:
+	d3d_camera_set_threads(cams[0], 3);
+	assert(!d3d_camera_set_options(cams[1], D3D_CACHE_WORLD));
+	unsigned long seed = 8;
+	for (int i = 0; i < 12; ++i) {
+		d3d_pose_s poses[5];
+		d3d_vec_s pos = {
+			2 + test_frand(&seed) * 36, 2 + test_frand(&seed) * 26
+		};
+		for (size_t c = 0; c < 5; ++c) {
+			poses[c].cam = cams[c];
+			// Two cameras share a position and two are nearby:
+			poses[c].pos.x = pos.x + (c < 2 ? 0 : (d3d_scalar)0.3);
+			poses[c].pos.y = pos.y + (c < 4 ? 0 : (d3d_scalar)0.3);
+			poses[c].facing = i * 0.3 + c * 1.3;
+		}
+		if (i == 5) poses[3].pos.x = -1;
+		// Part way through, the list of sprites gets shorter:
+		size_t n_sprites = i < 8 ? 50 : 20;
+		d3d_draw_many(i % 3 ? 5 : 4, poses, world.board, n_sprites,
+			sprites);
+		for (size_t c = 0; c < (i % 3 ? 5u : 4u); ++c) {
+			d3d_draw(refs[c], poses[c].pos, poses[c].facing,
+				world.board, n_sprites, sprites);
+			assert(cameras_match(cams[c], refs[c]));
+		}
+	}
+	for (size_t c = 0; c < 5; ++c) {
+		d3d_free_camera(cams[c]);
+		d3d_free_camera(refs[c]);
+	}
+	tear_down_world(&world);
+)
+
+CTF_TEST(d3d_cast_rays_match_drawn_rays,
+	struct test_world world;
+	set_up_world(&world, 40, 30);
+	d3d_vec_s origins[300], dirs[300];
+	d3d_ray_hit_s hits[300];
+	unsigned long seed = 9;
+	for (size_t i = 0; i < 300; ++i) {
+		origins[i].x = (d3d_scalar)0.01 + test_frand(&seed) * 39.98;
+		origins[i].y = (d3d_scalar)0.01 + test_frand(&seed) * 29.98;
+		d3d_scalar angle = test_frand(&seed) * 2 * PI;
+		// The directions are not unit vectors:
+		dirs[i].x = cos(angle) * (1 + i % 5);
+		dirs[i].y = sin(angle) * (1 + i % 5);
+	}
+	origins[10].x = -3;
+	dirs[20].x = dirs[20].y = 0;
+	d3d_cast_rays(world.board, 300, origins, dirs, hits);
+	for (size_t i = 0; i < 300; ++i) {
+		if (i == 10 || i == 20) {
+			assert(!hits[i].block);
+			assert(hits[i].dist == 0);
+			continue;
+		}
+		d3d_scalar len = hypot(dirs[i].x, dirs[i].y);
+		d3d_vec_s dir = { dirs[i].x / len, dirs[i].y / len };
+		struct d3d_hit hit;
+		CAST_RAY(world.board, origins[i], dir, &hit);
+		assert(hits[i].block == hit.block);
+		assert(hits[i].dist == hit.dist);
+		if (hit.block) {
+			assert(hits[i].block->faces[hits[i].face] == hit.txtr);
+		} else {
+			assert(hits[i].pos.x <= 0 || hits[i].pos.x >= 40
+			    || hits[i].pos.y <= 0 || hits[i].pos.y >= 30);
+		}
+	}
+	tear_down_world(&world);
+)
+
+#endif /* CTF_TESTS_ENABLED */
@@ -23,7 +23,20 @@
  *    compile d3d.c and your code with the same setting of this option.
  *  - D3D_HEADER_INCLUDE: If this is defined, instead of '#include "d3d.h"',
  *    d3d.c will use '#include D3D_HEADER_INCLUDE'. This is ONLY useful when
- *    compiling d3d.c, not the client code. */
+ *    compiling d3d.c, not the client code.
+ *  - D3D_USE_PTHREADS: Allow cameras to draw using several threads with
+ *    d3d_camera_set_threads. The code must then be linked with the POSIX
+ *    threads library. This is ONLY useful when compiling d3d.c, not the
+ *    client code.
+ *  - D3D_LEGACY_HIT_WALL: Cast rays by repeatedly stepping a floating-point
+ *    position to the next grid line instead of walking the grid with a DDA.
+ *    The results are the same except for rays passing exactly through
+ *    corners. This is slower and only exists for comparison. It is ONLY
+ *    useful when compiling d3d.c, not the client code.
+ *  - D3D_LEGACY_FLOOR: Find where each pixel sees the floor or ceiling by
+ *    dividing the wall displacement, rather than using the per-row distances
+ *    cached in the camera. This only exists for comparison. It is ONLY useful
+ *    when compiling d3d.c, not the client code. */
 
 /* Custom allocator routines. These have the same contract of behaviour as the
  * corresponding functions in the standard library. They are meant for internal
@@ -90,6 +103,13 @@ typedef struct d3d_camera_s d3d_camera;
 struct d3d_board_s;
 typedef struct d3d_board_s d3d_board;
 
+/* A tile of a compact board. The low D3D_CELL_BLOCK_BITS bits are the index of
+ * the tile's block in the board's palette. The library ignores the other bits,
+ * so you can keep your own data about the tile there. */
+typedef unsigned short d3d_cell;
+#define D3D_CELL_BLOCK_BITS 12
+#define D3D_CELL_BLOCK_MASK ((1 << D3D_CELL_BLOCK_BITS) - 1)
+
 /* A direction. The possible values are all listed below. */
 typedef enum {
 	D3D_DPOSX, /* Positive x direction. */
@@ -124,6 +144,53 @@ size_t d3d_camera_height(const d3d_camera *cam);
  * not modify the camera in any way. */
 d3d_pixel *d3d_camera_get(d3d_camera *cam, size_t x, size_t y);
 
+/* Get all the pixels in the camera's view at once, in column-major order: pixel
+ * (x, y) is at index y + x * height. The pointer is valid like one returned by
+ * d3d_camera_get. */
+const d3d_pixel *d3d_camera_pixels(const d3d_camera *cam);
+
+/* Set how many threads the camera draws with. The screen is split into that
+ * many bands of columns, one drawn by the thread calling d3d_draw and the rest
+ * by worker threads owned by the camera. The workers wait around between calls
+ * to d3d_draw. 0 is treated like 1, which means no workers. If d3d.c was not
+ * compiled with D3D_USE_PTHREADS, only 1 thread is possible. On failure, -1 is
+ * returned and the camera is left drawing with 1 thread. Otherwise, 0 is
+ * returned. */
+int d3d_camera_set_threads(d3d_camera *cam, size_t n_threads);
+
+/* Get the number of threads the camera draws with. */
+size_t d3d_camera_threads(const d3d_camera *cam);
+
+/* Options for drawing with a camera. These are bits to be ORed together and
+ * passed to d3d_camera_set_options.
+ *  - D3D_REUSE_RAYS: Remember what each column's ray hit. When the camera is
+ *    next drawn from the same position on the same unchanged board, as when
+ *    it only turns, a column whose ray lies between two of the old rays that
+ *    hit the same face of the same tile is worked out from that face instead
+ *    of casting the ray again. This is exact except that something narrower
+ *    than a column between the two old rays can be missed.
+ *  - D3D_CACHE_WORLD: Keep a copy of the walls, floor, and ceiling drawn.
+ *    When the camera is next drawn from the same position and facing on the
+ *    same unchanged board, that copy is used and only the sprites are drawn
+ *    again. Changes to the pixels of textures are not noticed, so the option
+ *    should be turned off and on again after such changes.
+ *  - D3D_COHERENT_RAYS: Cast rays for only some columns at first. Where the
+ *    rays at both ends of a run of columns hit the same face of the same tile
+ *    and no face lies between the rays, the columns in between are worked out
+ *    from that face. Elsewhere, more rays are cast. This draws just what
+ *    casting every ray would, but long flat walls are drawn faster. */
+#define D3D_REUSE_RAYS 0x1
+#define D3D_CACHE_WORLD 0x2
+#define D3D_COHERENT_RAYS 0x4
+
+/* Set the camera's drawing options to a combination of the options above. 0 is
+ * returned on success. On failure, -1 is returned and the options are left
+ * unchanged. All options are off for new cameras. */
+int d3d_camera_set_options(d3d_camera *cam, unsigned options);
+
+/* Get the camera's drawing options. */
+unsigned d3d_camera_options(const d3d_camera *cam);
+
 /* Destroy a camera object. It shall never be used again. */
 void d3d_free_camera(d3d_camera *cam);
 
@@ -132,25 +199,74 @@ void d3d_free_camera(d3d_camera *cam);
  * are 0, as a dimension of 0 cannot be stretched across another dimension. */
 d3d_texture *d3d_new_texture(size_t width, size_t height, d3d_pixel fill);
 
+/* Get the number of bytes a texture with the given dimensions takes up, or 0 if
+ * that can't be represented. Dimensions of 0 are treated as 1, as above. The
+ * result is a multiple of the alignment textures need, so textures can be put
+ * one after another in memory that is aligned for anything, such as memory
+ * from malloc. */
+size_t d3d_texture_footprint(size_t width, size_t height);
+
+/* Make a texture in memory provided by the caller, with its pixels initialized
+ * to the fill pixel. mem must be aligned for the texture and must hold at least
+ * d3d_texture_footprint(width, height) bytes. The texture is returned, and
+ * it points to mem. It must be destroyed with d3d_destroy_texture, not
+ * d3d_free_texture, and mem must outlive it. */
+d3d_texture *d3d_init_texture(
+	void *mem,
+	size_t width,
+	size_t height,
+	d3d_pixel fill);
+
 /* Get the width of the texture in pixels. */
 size_t d3d_texture_width(const d3d_texture *txtr);
 
 /* Get the height of the texture in pixels. */
 size_t d3d_texture_height(const d3d_texture *txtr);
 
-/* Get a pixel at a coordinate on a texture. NULL is returned if the coordinates
- * are out of range. The pointer is valid until the texture is used (indirectly)
- * in d3d_draw. This function does not modify the texture in any way. */
+/* Get a pixel at a coordinate on a texture so that it can be changed. NULL is
+ * returned if the coordinates are out of range. The pointer is valid until the
+ * texture is used (indirectly) in d3d_draw. Since the pixel might be changed,
+ * the runs found by d3d_texture_prepare_sprite are thrown away; other than
+ * that, this function does not modify the texture. */
 d3d_pixel *d3d_texture_get(d3d_texture *txtr, size_t x, size_t y);
 
+/* Get a pixel at a coordinate on a texture only to read it. This works like
+ * d3d_texture_get, except that the texture is left completely alone. */
+const d3d_pixel *d3d_texture_read(const d3d_texture *txtr, size_t x, size_t y);
+
+/* Find the runs of pixels in each column of the texture that are not the
+ * transparent pixel, so that sprites with the texture and that transparent
+ * pixel are drawn by copying only those runs. Sprites with textures that were
+ * not prepared for their transparent pixel are drawn pixel by pixel instead;
+ * d3d_draw never prepares textures by itself. The runs are thrown away when
+ * d3d_texture_get is called. 0 is returned on success and -1 if allocation
+ * fails, in which case sprites are still drawn correctly. */
+int d3d_texture_prepare_sprite(d3d_texture *txtr, d3d_pixel transparent);
+
 /* Permanently destroy a texture. */
 void d3d_free_texture(d3d_texture *txtr);
 
+/* Free what a texture made with d3d_init_texture holds, but not the memory it
+ * was made in. The texture shall never be used again. */
+void d3d_destroy_texture(d3d_texture *txtr);
+
 /* Create a new board with a width and height. All its blocks are initially
  * set to the block fill. If fill is NULL, all the blocks are set to an
  * empty/transparent block. NULL is returned if allocation fails. */
 d3d_board *d3d_new_board(size_t width, size_t height, const d3d_block_s *fill);
 
+/* Create a new compact board with a width and height. Each tile is a d3d_cell
+ * holding an index into the palette, which has n_blocks blocks. The palette
+ * is not copied, so it must last as long as the board. All the tiles are
+ * initially 0, referring to the first block of the palette. NULL is returned
+ * if allocation fails or n_blocks is 0 or more than D3D_CELL_BLOCK_MASK + 1.
+ * Compact boards take about a quarter of the memory of other boards. */
+d3d_board *d3d_new_compact_board(
+	size_t width,
+	size_t height,
+	size_t n_blocks,
+	const d3d_block_s palette[]);
+
 /* Get the width of the board in blocks. */
 size_t d3d_board_width(const d3d_board *board);
 
@@ -160,10 +276,21 @@ size_t d3d_board_height(const d3d_board *board);
 /* Get a block in a board. If the coordinates are out of range, NULL is
  * returned. Otherwise, a pointer to a block POINTER is returned. This pointed-
  * to pointer can be modified with a new block pointer. The outer pointer is
- * valid until the board is used in d3d_draw. This function does not modify the
- * board in any way. */
+ * valid until the board is used in d3d_draw. The board notes that the block
+ * may change, and the next d3d_draw with the board updates what it knows about
+ * where the board is empty. NULL is always returned for compact boards. */
 const d3d_block_s **d3d_board_get(d3d_board *board, size_t x, size_t y);
 
+/* Get a cell in a compact board. This works like d3d_board_get, except that
+ * the cell can be modified instead of a block pointer. If the cell is given a
+ * block index outside the palette, the index is reset to 0 when the board is
+ * next drawn. NULL is always returned for boards that are not compact. */
+d3d_cell *d3d_board_cell(d3d_board *board, size_t x, size_t y);
+
+/* Read a cell in a compact board without noting that it may change. 0 is
+ * returned if the coordinates are out of range or the board is not compact. */
+d3d_cell d3d_board_read_cell(const d3d_board *board, size_t x, size_t y);
+
 /* Permanently destroy a board. */
 void d3d_free_board(d3d_board *board);
 
@@ -182,7 +309,11 @@ void d3d_free_board(d3d_board *board);
  *
  * Out-of-bounds coordinates are tolerated. However, it is unspecified what
  * pixels will be captured if the camera is not within the borders of the board.
- * Sprites outside the board will not be drawn. */
+ * Sprites outside the board will not be drawn.
+ *
+ * If blocks of the board were gotten with d3d_board_get since it was last
+ * drawn, this updates data inside the board. The board may not be drawn from
+ * two threads at once then. The sprite textures are only read. */
 void d3d_draw(
 	d3d_camera *cam,
 	d3d_vec_s cam_pos,
@@ -191,23 +322,129 @@ void d3d_draw(
 	size_t n_sprites,
 	const d3d_sprite_s sprites[]);
 
+/* A camera and where it draws from, for d3d_draw_many. pos and facing mean the
+ * same as cam_pos and cam_facing in d3d_draw. */
+typedef struct {
+	d3d_camera *cam;
+	d3d_vec_s pos;
+	d3d_scalar facing;
+} d3d_pose_s;
+
+/* Draw the same board and sprites with several cameras at once. Each camera
+ * ends up with the same pixels as from d3d_draw, except that sprites at almost
+ * exactly the same distance may overlap the other way around. No camera may
+ * appear twice in the list.
+ *
+ * The work that does not depend on the camera is done once: the board is
+ * brought up to date before any camera draws. The sprites are sorted by
+ * distance once for each group of cameras within a tile of each other, and each
+ * camera of the group only culls them and touches up the order. If the list is
+ * at least as long as the threads of the first camera with more than one
+ * thread, the cameras are drawn on those threads at the same time, each by one
+ * thread. Otherwise, they are drawn one after the other, each with its own
+ * threads. */
+void d3d_draw_many(
+	size_t n_poses,
+	const d3d_pose_s poses[],
+	const d3d_board *board,
+	size_t n_sprites,
+	const d3d_sprite_s sprites[]);
+
+/* What a ray cast with d3d_cast_rays hit. */
+typedef struct {
+	/* The block hit, or NULL if the ray left the board first. */
+	const d3d_block_s *block;
+	/* The index into block->faces of the face hit. If the ray left the
+	 * board, this is the direction in which it left. */
+	d3d_direction face;
+	/* Where the ray stopped: where it hit the face, or where it left the
+	 * board. */
+	d3d_vec_s pos;
+	/* How far the ray travelled to get to pos. */
+	d3d_scalar dist;
+} d3d_ray_hit_s;
+
+/* Cast n_rays rays across the board, finding the first face each one hits.
+ * Ray i starts at origins[i] and goes in the direction dirs[i], which need not
+ * have length 1. What it hits is put in hits[i]. A ray whose origin is outside
+ * the board or whose direction is zero has a NULL block, a dist of 0, and a pos
+ * equal to its origin. Only the horizontal faces (the sides of blocks) are
+ * hit. This uses the same ray casting as d3d_draw, and like d3d_draw, it brings
+ * the board up to date if its blocks were gotten with d3d_board_get. */
+void d3d_cast_rays(
+	const d3d_board *board,
+	size_t n_rays,
+	const d3d_vec_s origins[],
+	const d3d_vec_s dirs[],
+	d3d_ray_hit_s hits[]);
+
 #endif /* D3D_H_ */
 
 /* Complete structure definitions. */
 #if defined(D3D_USE_INTERNAL_STRUCTS) && !defined(D3D_INTERNAL_H_)
 #define D3D_INTERNAL_H_
 
+// A run of pixels in a texture column, from row top up to but not including row
+// bottom.
+struct d3d_span {
+	size_t top, bottom;
+};
+
+// The opaque runs of each column of a texture, for drawing it as a sprite.
+struct d3d_sprite_spans {
+	// The pixel the runs do not include.
+	d3d_pixel transparent;
+	// The runs of column x are from runs[starts[x]] up to but not including
+	// runs[starts[x + 1]]. There are width + 1 starts.
+	size_t *starts;
+	// The runs of all the columns, each column's from top to bottom.
+	struct d3d_span runs[];
+};
+
 struct d3d_texture_s {
 	// Width and height in pixels.
 	size_t width, height;
+	// The opaque runs, or NULL if they haven't been found.
+	struct d3d_sprite_spans *spans;
 	// Column-major pixels.
 	d3d_pixel pixels[];
 };
 
+// Information about where a ray cast from the camera ended up.
+struct d3d_hit {
+	// The block hit, or NULL if the ray left the board.
+	const d3d_block_s *block;
+	// The texture of the face hit. This is undefined if block is NULL.
+	const d3d_texture *txtr;
+	// The direction used to orient the texture on the face. This is the
+	// direction of travel if the ray hit the outside of a block, or the
+	// opposite direction if it hit the inside of a block.
+	d3d_direction face;
+	// Where the ray stopped, on the grid line it last crossed.
+	d3d_vec_s pos;
+	// How far the ray travelled to get to pos.
+	d3d_scalar dist;
+};
+
+// What a camera drew a frame of, to tell whether things remembered from that
+// frame still apply.
+struct d3d_view {
+	// The board drawn, or NULL if nothing is remembered.
+	const d3d_board *board;
+	// The revision of the board then.
+	unsigned long revision;
+	// Where the camera was and its canonical facing.
+	d3d_vec_s pos;
+	d3d_scalar facing;
+};
+
 // This is for drawing multiple sprites.
 struct d3d_sprite_order {
-	// The distance from the camera
+	// The distance from the camera. While sorting, this is the squared
+	// distance, or infinity if the sprite was culled.
 	d3d_scalar dist;
+	// The squared distance quantized to 32 bits, for radix sorting.
+	unsigned long key;
 	// The corresponding index into the given d3d_sprite_s list
 	size_t index;
 };
@@ -222,7 +459,8 @@ struct d3d_camera_s {
 	d3d_block_s blank_block;
 	// The last buffer used when sorting sprites, or NULL the first time.
 	struct d3d_sprite_order *order;
-	// The capacity (allocation size) of the field above.
+	// The capacity of the field above. Twice this many orders are allocated,
+	// the second half being scratch space for sorting.
 	size_t order_buf_cap;
 	// The last sprites drawn.
 	const d3d_sprite_s *last_sprites;
@@ -232,10 +470,30 @@ struct d3d_camera_s {
 	// relative to the center of the screen, in radians
 	// For example, the 0th item is tan(fov.y / 2)
 	d3d_scalar *tans;
+	// For each row of the screen, the horizontal distance from the camera
+	// to where that row sees the floor or ceiling, which is 0.5 / |tans|.
+	d3d_scalar *rowdists;
 	// For each column of the screen, the distance from the camera to the
 	// first wall in that direction. This is calculated when drawing columns
 	// and is used when drawing sprites.
 	d3d_scalar *dists;
+	// The options from d3d_camera_set_options.
+	unsigned options;
+	// With D3D_REUSE_RAYS or D3D_COHERENT_RAYS, the hits of the columns
+	// being drawn and of the columns last drawn. These are swapped after
+	// each frame. They are both NULL without those options.
+	struct d3d_hit *hits, *last_hits;
+	// What last_hits were cast in.
+	struct d3d_view hits_view;
+	// With D3D_CACHE_WORLD, the pixels of the last frame before sprites were
+	// drawn, and what they show. This is NULL without the option. The
+	// dists of that frame are left in dists.
+	d3d_pixel *world;
+	struct d3d_view world_view;
+	// The worker threads drawing bands of the screen, or NULL if drawing is
+	// all done by the thread calling d3d_draw. This is always NULL without
+	// D3D_USE_PTHREADS.
+	struct d3d_pool *pool;
 	// The pixels of the screen in column-major order.
 	d3d_pixel pixels[];
 };
@@ -243,6 +501,31 @@ struct d3d_camera_s {
 struct d3d_board_s {
 	// The width and height of the board, in blocks
 	size_t width, height;
+	// For each tile, in the same order as blocks, the distance in tiles to
+	// the nearest block with faces on its sides, or to the outside of the
+	// board. The distance is the larger of the x and y differences. It is
+	// capped at 255. A ray in a tile with a distance d can cross d - 1
+	// lines along each axis without hitting anything.
+	unsigned char *skip;
+	// The tiles from (dirty_x0, dirty_y0) up to but not including
+	// (dirty_x1, dirty_y1) may have changed since skip was last updated.
+	size_t dirty_x0, dirty_y0, dirty_x1, dirty_y1;
+	// This is incremented whenever a tile may be changed.
+	unsigned long revision;
+	// Flags summarizing the ceilings and floors of the tiles, used to choose
+	// how to draw them. These are brought up to date with skip. See
+	// BOARD_ANY and the others in d3d.c.
+	unsigned flags;
+	// A texture of a ceiling and of a floor on the board, or NULL if there
+	// are none. These are what BOARD_UNIFORM compares sizes to.
+	const d3d_texture *samples[2];
+	// For compact boards, the tiles in the same order as blocks, stored
+	// where blocks would be. This is NULL for other boards, which use the
+	// blocks array instead.
+	d3d_cell *cells;
+	// The blocks that cells refer to, and how many there are.
+	const d3d_block_s *palette;
+	size_t n_palette;
 	// The blocks of the boards. These are pointers to save space with many
 	// identical blocks.
 	const d3d_block_s *blocks[];
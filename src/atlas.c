@@ -0,0 +1,212 @@
+#include "atlas.h"
+#include "xalloc.h"
+#include <stdbool.h>
+#include <stdlib.h>
+
+// Textures are put in chunks of at least this many bytes.
+#define CHUNK_SIZE 65536
+
+// A piece of memory holding textures one after another.
+struct atlas_chunk {
+	struct atlas_chunk *next;
+	size_t used;
+	size_t cap;
+	// Memory from malloc is aligned for textures.
+	unsigned char *mem;
+};
+
+// A distinct texture in the atlas, found by the hash of its contents. The
+// entries form an open addressing hash table whose capacity is a power of two.
+struct atlas_entry {
+	unsigned long hash;
+	d3d_texture *txtr;
+};
+
+void atlas_init(struct atlas *atl)
+{
+	atl->chunks = NULL;
+	atl->entries = NULL;
+	atl->n_entries = 0;
+	atl->cap_entries = 0;
+	atl->bytes_used = 0;
+	atl->bytes_saved = 0;
+}
+
+// FNV-1a over the dimensions and the pixels.
+static unsigned long hash_texture(size_t width, size_t height,
+	const d3d_pixel *pixels)
+{
+	unsigned long hash = 2166136261UL;
+	hash = (hash ^ width) * 16777619UL;
+	hash = (hash ^ height) * 16777619UL;
+	for (size_t i = 0; i < width * height; ++i) {
+		hash = (hash ^ (unsigned long)pixels[i]) * 16777619UL;
+	}
+	return hash;
+}
+
+static bool texture_equals(const d3d_texture *txtr, size_t width, size_t height,
+	const d3d_pixel *pixels)
+{
+	if (d3d_texture_width(txtr) != width
+	 || d3d_texture_height(txtr) != height)
+		return false;
+	for (size_t x = 0; x < width; ++x) {
+		for (size_t y = 0; y < height; ++y) {
+			if (*d3d_texture_read(txtr, x, y) != pixels[y + height * x])
+				return false;
+		}
+	}
+	return true;
+}
+
+// Get the first slot to look in for a texture with the hash, in a table with the
+// capacity cap. Following slots are looked in until an empty one is found.
+static size_t first_slot(unsigned long hash, size_t cap)
+{
+	return hash & (cap - 1);
+}
+
+static void grow_entries(struct atlas *atl)
+{
+	size_t new_cap = atl->cap_entries ? atl->cap_entries * 2 : 64;
+	struct atlas_entry *entries = xcalloc(new_cap, sizeof(*entries));
+	for (size_t i = 0; i < atl->cap_entries; ++i) {
+		struct atlas_entry *old = &atl->entries[i];
+		if (!old->txtr) continue;
+		size_t slot = first_slot(old->hash, new_cap);
+		while (entries[slot].txtr) slot = (slot + 1) & (new_cap - 1);
+		entries[slot] = *old;
+	}
+	free(atl->entries);
+	atl->entries = entries;
+	atl->cap_entries = new_cap;
+}
+
+// Get size bytes of memory aligned for a texture from the chunks.
+static void *alloc_in_chunk(struct atlas *atl, size_t size)
+{
+	struct atlas_chunk *chunk = atl->chunks;
+	if (!chunk || chunk->cap - chunk->used < size) {
+		chunk = xmalloc(sizeof(*chunk));
+		chunk->cap = size > CHUNK_SIZE ? size : CHUNK_SIZE;
+		chunk->mem = xmalloc(chunk->cap);
+		chunk->used = 0;
+		chunk->next = atl->chunks;
+		atl->chunks = chunk;
+	}
+	void *mem = chunk->mem + chunk->used;
+	chunk->used += size;
+	atl->bytes_used += size;
+	return mem;
+}
+
+d3d_texture *atlas_texture(struct atlas *atl, size_t width, size_t height,
+	const d3d_pixel *pixels)
+{
+	size_t size = d3d_texture_footprint(width, height);
+	// A texture too big to represent can't be allocated either:
+	if (size == 0) assert_alloc(NULL);
+	unsigned long hash = hash_texture(width, height, pixels);
+	if ((atl->n_entries + 1) * 2 > atl->cap_entries) grow_entries(atl);
+	size_t mask = atl->cap_entries - 1;
+	size_t slot = first_slot(hash, atl->cap_entries);
+	for (; atl->entries[slot].txtr; slot = (slot + 1) & mask) {
+		struct atlas_entry *entry = &atl->entries[slot];
+		if (entry->hash == hash
+		 && texture_equals(entry->txtr, width, height, pixels)) {
+			atl->bytes_saved += size;
+			return entry->txtr;
+		}
+	}
+	d3d_texture *txtr = d3d_init_texture(alloc_in_chunk(atl, size),
+		width, height, 0);
+	for (size_t x = 0; x < width; ++x) {
+		for (size_t y = 0; y < height; ++y) {
+			*d3d_texture_get(txtr, x, y) = pixels[y + height * x];
+		}
+	}
+	atl->entries[slot].hash = hash;
+	atl->entries[slot].txtr = txtr;
+	++atl->n_entries;
+	return txtr;
+}
+
+size_t atlas_count(const struct atlas *atl)
+{
+	return atl->n_entries;
+}
+
+size_t atlas_bytes_used(const struct atlas *atl)
+{
+	return atl->bytes_used;
+}
+
+size_t atlas_bytes_saved(const struct atlas *atl)
+{
+	return atl->bytes_saved;
+}
+
+void atlas_free(struct atlas *atl)
+{
+	for (size_t i = 0; i < atl->cap_entries; ++i) {
+		d3d_destroy_texture(atl->entries[i].txtr);
+	}
+	free(atl->entries);
+	struct atlas_chunk *chunk = atl->chunks;
+	while (chunk) {
+		struct atlas_chunk *next = chunk->next;
+		free(chunk->mem);
+		free(chunk);
+		chunk = next;
+	}
+}
+
+#if CTF_TESTS_ENABLED
+
+#	include "libctf.h"
+#	include <assert.h>
+
+CTF_TEST(atlas_stores_identical_textures_once,
+	struct atlas atl;
+	atlas_init(&atl);
+	d3d_pixel a[6] = { 1, 2, 3, 4, 5, 6 };
+	d3d_pixel b[6] = { 1, 2, 3, 4, 5, 7 };
+	d3d_texture *ta = atlas_texture(&atl, 2, 3, a);
+	d3d_texture *tb = atlas_texture(&atl, 2, 3, b);
+	// Same pixels with other dimensions:
+	d3d_texture *tc = atlas_texture(&atl, 3, 2, a);
+	assert(ta != tb && ta != tc && tb != tc);
+	assert(*d3d_texture_read(ta, 1, 0) == 4);
+	assert(*d3d_texture_read(tc, 1, 0) == 3);
+	// Textures are packed one after another:
+	assert((char *)tb - (char *)ta
+		== (ptrdiff_t)d3d_texture_footprint(2, 3));
+	assert(atlas_bytes_saved(&atl) == 0);
+	assert(atlas_texture(&atl, 2, 3, a) == ta);
+	assert(atlas_texture(&atl, 2, 3, b) == tb);
+	assert(atlas_count(&atl) == 3);
+	assert(atlas_bytes_saved(&atl) == 2 * d3d_texture_footprint(2, 3));
+	atlas_free(&atl);
+)
+
+CTF_TEST(atlas_grows,
+	struct atlas atl;
+	atlas_init(&atl);
+	d3d_pixel pixels[100];
+	d3d_texture *txtrs[1000];
+	for (size_t i = 0; i < 1000; ++i) {
+		for (size_t p = 0; p < 100; ++p) {
+			pixels[p] = (d3d_pixel)(i + p * (i / 256 + 1));
+		}
+		txtrs[i] = atlas_texture(&atl, 10, 10, pixels);
+	}
+	assert(atlas_count(&atl) == 1000);
+	assert(atlas_bytes_used(&atl) == 1000 * d3d_texture_footprint(10, 10));
+	for (size_t i = 0; i < 1000; ++i) {
+		assert(*d3d_texture_read(txtrs[i], 0, 0) == (d3d_pixel)i);
+	}
+	atlas_free(&atl);
+)
+
+#endif /* CTF_TESTS_ENABLED */
@@ -0,0 +1,47 @@
+#ifndef ATLAS_H_
+#define ATLAS_H_
+
+#include "d3d.h"
+#include <stddef.h>
+
+// Private types defined in atlas.c
+struct atlas_chunk;
+struct atlas_entry;
+
+// Textures packed one after another into large chunks of memory, so that
+// textures loaded together are near each other, with each distinct texture
+// stored only once. The fields are private.
+struct atlas {
+	struct atlas_chunk *chunks;
+	struct atlas_entry *entries;
+	size_t n_entries;
+	size_t cap_entries;
+	size_t bytes_used;
+	size_t bytes_saved;
+};
+
+// Initialize an empty atlas.
+void atlas_init(struct atlas *atl);
+
+// Get a texture in the atlas with the given dimensions and pixels. The width and
+// height must be positive. The pixel at (x, y) is pixels[y + height * x]. If a
+// texture with the same dimensions and pixels is already in the atlas, that is
+// returned instead of a new one. The atlas owns the texture, which lasts until
+// the atlas is freed.
+d3d_texture *atlas_texture(struct atlas *atl, size_t width, size_t height,
+	const d3d_pixel *pixels);
+
+// Count the distinct textures in the atlas.
+size_t atlas_count(const struct atlas *atl);
+
+// Get the number of bytes the atlas takes up for its textures.
+size_t atlas_bytes_used(const struct atlas *atl);
+
+// Get the number of bytes saved by reusing identical textures rather than
+// storing them again.
+size_t atlas_bytes_saved(const struct atlas *atl);
+
+// Free an atlas and all its textures.
+void atlas_free(struct atlas *atl);
+
+#endif /* ATLAS_H_ */
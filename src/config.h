@@ -19,6 +19,11 @@
 // In the screensaver, the camera goes out at most this far (measured in tiles.)
 #define TITLE_SCREEN_RADIUS 0.5
 
+// The screensaver repeats itself, so it keeps the frames it has drawn to show
+// them again. It keeps at most this many bytes of them. If one cycle takes more
+// at the current screen size, every frame is drawn when it is shown.
+#define TITLE_SCREEN_CACHE_BYTES (64L << 20)
+
 // The number of ticks a turn lasts, triggered by a single key press. This is to
 // smooth out key detection speeds for different terminals, as some wait longer
 // before registering another press.
@@ -42,6 +47,19 @@
 // camera_with_dims in ui-util.c for details.
 #define CAM_FOV_X 1.2
 
+// Whether the 3D scene is drawn at a lower resolution and stretched to fit the
+// screen when drawing and showing it takes too long. If this is 0, the scene is
+// always drawn at the size of the screen.
+#define DYNAMIC_RESOLUTION 1
+
+// With DYNAMIC_RESOLUTION, drawing and showing the scene should take at most
+// this many microseconds. This leaves some of FRAME_DELAY for everything else.
+#define RENDER_BUDGET_USEC (FRAME_DELAY * 700L)
+
+// The 3D scene is drawn with at most this many threads. Fewer are used if the
+// computer has fewer processors.
+#define MAX_RENDER_THREADS 8
+
 // The character carrying the foreground color for pixels in the 3D scene.
 #define SCENE_FG_CHAR ':'
 
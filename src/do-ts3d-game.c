@@ -4,10 +4,12 @@
 #include "logger.h"
 #include "play-level.h"
 #include "player.h"
+#include "recording.h"
 #include "d3d.h"
 #include "map.h"
 #include "menu.h"
 #include "save-state.h"
+#include "spectate.h"
 #include "ticker.h"
 #include "ui-util.h"
 #include "util.h"
@@ -22,6 +24,10 @@
 // Character cell width of menu. Must be enough to fit width 40 text.
 #define MENU_WIDTH 41
 
+// The number of frames in one cycle of the title screensaver. After this many
+// frames, the camera is back where it started.
+#define TITLE_FRAMES ((size_t)(2 * (double)PI / TITLE_SCREEN_SPEED + 0.5))
+
 // Screen state, including the menu and screensaver. The fields are public.
 struct screen_state {
 	// Whether the screen state is the right size for the physical screen.
@@ -34,10 +40,19 @@ struct screen_state {
 	struct title_state {
 		bool initialized;
 		d3d_camera *cam;
-		// Parameter for camera direction and position:
-		d3d_scalar t;
+		// The frame of the cycle to show next, which decides the camera
+		// direction and position:
+		size_t frame;
+		// TITLE_FRAMES frames of the camera's size, each drawn the
+		// first time it is shown, or NULL if they don't fit in
+		// TITLE_SCREEN_CACHE_BYTES or in memory.
+		d3d_pixel *frames;
+		// For each frame, whether it has been drawn yet.
+		bool *drawn;
 		d3d_board *board;
 		struct screen_area area;
+		// What the camera's frames are shown with:
+		struct presenter presenter;
 		struct color_map *color_map;
 	} title;
 };
@@ -69,13 +84,76 @@ static int load_title_state(struct title_state *state, struct loader *ldr)
 	// Screen area not yet initialized:
 	state->area = (struct screen_area) { 0, 0, 1, 1 };
 	state->cam = camera_with_dims(state->area.width, state->area.height);
-	state->t = 0.0;
+	state->frame = 0;
+	state->frames = NULL;
+	state->drawn = NULL;
+	presenter_init(&state->presenter);
 	state->board = map->board;
 	state->color_map = loader_color_map(ldr);
 	state->initialized = true;
 	return 0;
 }
 
+// Forget the frames of the title screensaver and make room for new ones of the
+// camera's size. The frames are left NULL if they would be too big.
+static void reset_title_frames(struct title_state *state)
+{
+	free(state->frames);
+	free(state->drawn);
+	state->frames = NULL;
+	state->drawn = NULL;
+	size_t frame_size = d3d_camera_width(state->cam)
+		* d3d_camera_height(state->cam) * sizeof(d3d_pixel);
+	if (frame_size > (size_t)TITLE_SCREEN_CACHE_BYTES / TITLE_FRAMES)
+		return;
+	state->frames = malloc(frame_size * TITLE_FRAMES);
+	state->drawn = calloc(TITLE_FRAMES, sizeof(*state->drawn));
+	if (!state->frames || !state->drawn) {
+		free(state->frames);
+		free(state->drawn);
+		state->frames = NULL;
+		state->drawn = NULL;
+	}
+}
+
+// Copy the camera's pixels to the frame, or the other way around if to_cam is
+// true. The frame is in column-major order.
+static void copy_title_frame(d3d_camera *cam, d3d_pixel *frame, bool to_cam)
+{
+	size_t width = d3d_camera_width(cam);
+	size_t height = d3d_camera_height(cam);
+	for (size_t x = 0; x < width; ++x) {
+		for (size_t y = 0; y < height; ++y) {
+			d3d_pixel *pix = d3d_camera_get(cam, x, y);
+			if (to_cam) {
+				*pix = *frame++;
+			} else {
+				*frame++ = *pix;
+			}
+		}
+	}
+}
+
+// Draw the given frame of the title screensaver with its camera.
+static void draw_title_frame(struct title_state *state, size_t frame)
+{
+	// Parameter for camera direction and position:
+	d3d_scalar t = (d3d_scalar)frame / TITLE_FRAMES * 2 * PI;
+	// theta is always increasing, but at a fluctuating rate so that it
+	// pauses when the camera is facing the letters:
+	d3d_scalar theta = -t - sin(t * 4 - PI) / 4;
+	// r is at its highest when the camera is facing a letter:
+	d3d_scalar r = (cos(theta * 4) + (d3d_scalar)0.5)
+		/ (d3d_scalar)1.5 * (d3d_scalar)TITLE_SCREEN_RADIUS;
+	d3d_scalar x = r * cos(theta);
+	d3d_scalar y = r * sin(theta);
+	d3d_vec_s pos = {
+		x + (d3d_scalar)d3d_board_width(state->board) / 2,
+		y + (d3d_scalar)d3d_board_height(state->board) / 2
+	};
+	d3d_draw(state->cam, pos, theta, state->board, 0, NULL);
+}
+
 // Update the screen (the menu and the screensaver.)
 static void do_screen_tick(struct screen_state *state)
 {
@@ -93,6 +171,9 @@ static void do_screen_tick(struct screen_state *state)
 			state->title.cam = camera_with_dims(
 				state->title.area.width,
 				state->title.area.height);
+			reset_title_frames(&state->title);
+			// The screen may have been cleared:
+			presenter_invalidate(&state->title.presenter);
 		}
 		if (state->menu.initialized)
 			menu_mark_area_changed(&state->menu.menu);
@@ -100,24 +181,25 @@ static void do_screen_tick(struct screen_state *state)
 	}
 	// Update the screen:
 	if (state->title.initialized) {
-		// theta is always increasing, but at a fluctuating rate so that
-		// it pauses when the camera is facing the letters:
-		d3d_scalar theta = -state->title.t
-			- sin(state->title.t * 4.0 - PI) / 4.0;
-		// r is at its highest when the camera is facing a letter:
-		d3d_scalar r = (cos(theta * 4.0) + 0.5) / 1.5
-			* TITLE_SCREEN_RADIUS;
-		d3d_scalar x = r * cos(theta);
-		d3d_scalar y = r * sin(theta);
-		d3d_vec_s pos = {
-			x + d3d_board_width(state->title.board) / 2.0,
-			y + d3d_board_height(state->title.board) / 2.0
-		};
-		d3d_draw(state->title.cam, pos, theta,
-			state->title.board, 0, NULL);
-		display_frame(state->title.cam, &state->title.area,
-			state->title.color_map);
-		state->title.t += TITLE_SCREEN_SPEED;
+		struct title_state *title = &state->title;
+		d3d_pixel *frame = NULL;
+		if (title->frames) {
+			frame = title->frames + title->frame
+				* d3d_camera_width(title->cam)
+				* d3d_camera_height(title->cam);
+		}
+		if (frame && title->drawn[title->frame]) {
+			copy_title_frame(title->cam, frame, true);
+		} else {
+			draw_title_frame(title, title->frame);
+			if (frame) {
+				copy_title_frame(title->cam, frame, false);
+				title->drawn[title->frame] = true;
+			}
+		}
+		present_frame(&title->presenter, title->cam, &title->area,
+			title->color_map);
+		title->frame = (title->frame + 1) % TITLE_FRAMES;
 	}
 	if (state->menu.initialized) menu_draw(&state->menu.menu);
 	refresh();
@@ -125,7 +207,12 @@ static void do_screen_tick(struct screen_state *state)
 
 static void destroy_screen_state(struct screen_state *state)
 {
-	if (state->title.initialized) d3d_free_camera(state->title.cam);
+	if (state->title.initialized) {
+		d3d_free_camera(state->title.cam);
+		free(state->title.frames);
+		free(state->title.drawn);
+		presenter_destroy(&state->title.presenter);
+	}
 	if (state->menu.initialized) menu_destroy(&state->menu.menu);
 }
 
@@ -169,7 +256,7 @@ static int write_save_state(struct save_state *save, const char *state_file,
 }
 
 int do_ts3d_game(const char *data_dir, const char *state_file,
-	struct logger *log)
+	const char *record_file, const char *spectate_path, struct logger *log)
 {
 	int ret = -1;
 	struct loader ldr;
@@ -177,6 +264,28 @@ int do_ts3d_game(const char *data_dir, const char *state_file,
 	logger_free(loader_set_logger(&ldr, log));
 	struct save_state save;
 	if (load_save_state(&save, state_file, log)) goto error_save_state;
+	// The recorder to give to play_level, NULL if not recording:
+	struct recorder recorder, *rec = NULL;
+	if (record_file) {
+		if (recorder_open(&recorder, record_file)) {
+			logger_printf(log, LOGGER_ERROR,
+				"Cannot record to %s: %s\n", record_file,
+				strerror(errno));
+			goto error_recorder;
+		}
+		rec = &recorder;
+	}
+	// The server to give to play_level, NULL if not sharing:
+	struct spectate_server server, *spec = NULL;
+	if (spectate_path) {
+		if (spectate_open(&server, spectate_path)) {
+			logger_printf(log, LOGGER_ERROR,
+				"Cannot share the game at %s: %s\n",
+				spectate_path, strerror(errno));
+			goto error_spectate;
+		}
+		spec = &server;
+	}
 	// ncurses reads ESCDELAY and waits that many ms after an ESC key press.
 	// This here is lowered from "1000":
 	try_setenv("ESCDELAY", STRINGIFY(FRAME_DELAY), 0);
@@ -235,7 +344,7 @@ int do_ts3d_game(const char *data_dir, const char *state_file,
 					menu_set_message(menu, "Level locked");
 					beep();
 				} else if (play_level(data_dir, &save,
-					selected->tag, &timer, log))
+					selected->tag, &timer, log, rec, spec))
 				{
 					menu_set_message(menu,
 						"Error loading map");
@@ -309,6 +418,13 @@ error_menu:
 	destroy_screen_state(&screen_state);
 error_color:
 	endwin();
+	if (spec) spectate_close(spec);
+error_spectate:
+	if (rec && recorder_close(rec)) {
+		logger_printf(log, LOGGER_WARNING,
+			"Error writing recording %s\n", record_file);
+	}
+error_recorder:
 	save_state_destroy(&save);
 error_save_state:
 	loader_free(&ldr);
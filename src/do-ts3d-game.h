@@ -5,9 +5,13 @@ struct logger; // Weak dependency
 
 // Run a game of Thing Shooter 3D. This will take control of the terminal.
 // data_dir is the path of the game data root directory. state_file is the path
-// of the file where persistent state is kept. The return value is 0 for success
-// or -1 for some kind of failure. Log messages are printed to log.
+// of the file where persistent state is kept. If record_file is not NULL, the
+// frames of the levels played are recorded there (see recording.h.) If
+// spectate_path is not NULL, spectators can watch the levels played through a
+// socket there (see spectate.h.) The return value is 0 for success or -1 for
+// some kind of failure. Log messages are printed to log.
 int do_ts3d_game(const char *data_dir, const char *state_file,
+		const char *record_file, const char *spectate_path,
 		struct logger *log);
 
 #endif /* DO_TS3D_GAME_H_ */
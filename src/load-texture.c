@@ -11,11 +11,6 @@
 #include <stdio.h>
 #include <string.h>
 
-static d3d_texture *new_empty_texture(void)
-{
-	return assert_alloc(d3d_new_texture(1, 1, TRANSPARENT_PIXEL));
-}
-
 d3d_texture *load_texture(struct loader *ldr, const char *name)
 {
 	FILE *file;
@@ -37,9 +32,14 @@ d3d_texture *load_texture(struct loader *ldr, const char *name)
 		if (lines[y].len > width) width = lines[y].len;
 	}
 	struct color_map *colors = loader_color_map(ldr);
+	d3d_pixel *pixels;
+	size_t n_lines = height;
 	if (width > 0 && height > 0) {
-		txtr = assert_alloc(d3d_new_texture(width, height,
-			TRANSPARENT_PIXEL));
+		// The pixels are column-major, like in the atlas:
+		pixels = xmalloc(width * height * sizeof(*pixels));
+		for (size_t i = 0; i < width * height; ++i) {
+			pixels[i] = TRANSPARENT_PIXEL;
+		}
 		for (size_t y = 0; y < height; ++y) {
 			struct string *line = &lines[y];
 			size_t x;
@@ -51,13 +51,21 @@ d3d_texture *load_texture(struct loader *ldr, const char *name)
 						LOGGER_WARNING,
 						"Pixel not registered: %c\n",
 						line->text[x]);
-				*d3d_texture_get(txtr, x, y) = pix;
+				pixels[y + height * x] = pix;
 			}
 		}
 	} else {
-		txtr = new_empty_texture();
+		width = height = 1;
+		pixels = xmalloc(sizeof(*pixels));
+		*pixels = TRANSPARENT_PIXEL;
 	}
-	for (size_t i = 0; i < height; ++i) {
+	// Identical textures are only stored once:
+	txtr = atlas_texture(loader_atlas(ldr), width, height, pixels);
+	// Any texture might be drawn as a sprite, and d3d_draw does not find
+	// the opaque runs by itself:
+	d3d_texture_prepare_sprite(txtr, TRANSPARENT_PIXEL);
+	free(pixels);
+	for (size_t i = 0; i < n_lines; ++i) {
 		free(lines[i].text);
 	}
 	free(lines);
@@ -12,6 +12,7 @@
 void loader_init(struct loader *ldr, const char *root)
 {
 	ldr->txtrs_dir = mid_cat(root, DIRSEP, "textures");
+	atlas_init(&ldr->atlas);
 	table_init(&ldr->txtrs, 16);
 	ldr->ents_dir = mid_cat(root, DIRSEP, "ents");
 	table_init(&ldr->ents, 16);
@@ -91,23 +92,34 @@ d3d_texture **loader_texture(struct loader *ldr, const char *name, FILE **file)
 
 const d3d_texture *loader_empty_texture(struct loader *ldr)
 {
-	if (!ldr->empty_txtr)
+	if (!ldr->empty_txtr) {
 		ldr->empty_txtr = assert_alloc(d3d_new_texture(1, 1,
 			TRANSPARENT_PIXEL));
+		d3d_texture_prepare_sprite(ldr->empty_txtr, TRANSPARENT_PIXEL);
+	}
 	return ldr->empty_txtr;
 }
 
 void loader_print_summary(struct loader *ldr)
 {
 	logger_printf(ldr->log, LOGGER_INFO,
-		"Load summary: %lu maps, %lu entity types, %lu textures, "
+		"Load summary: %lu maps, %lu entity types, %lu textures "
+		"(%lu distinct in %lu bytes, %lu bytes saved), "
 		"%lu color pairs\n",
 		(unsigned long)table_count(&ldr->maps),
 		(unsigned long)table_count(&ldr->ents),
 		(unsigned long)table_count(&ldr->txtrs),
+		(unsigned long)atlas_count(&ldr->atlas),
+		(unsigned long)atlas_bytes_used(&ldr->atlas),
+		(unsigned long)atlas_bytes_saved(&ldr->atlas),
 		(unsigned long)color_map_count_pairs(&ldr->colors));
 }
 
+struct atlas *loader_atlas(struct loader *ldr)
+{
+	return &ldr->atlas;
+}
+
 struct color_map *loader_color_map(struct loader *ldr)
 {
 	return &ldr->colors;
@@ -132,9 +144,9 @@ void loader_free(struct loader *ldr)
 	d3d_free_texture(ldr->empty_txtr);
 	TABLE_FOR_EACH(&ldr->txtrs, key, val) {
 		free((char *)key);
-		d3d_free_texture(*val);
 	}
 	table_free(&ldr->txtrs);
+	atlas_free(&ldr->atlas);
 	free(ldr->txtrs_dir);
 	TABLE_FOR_EACH(&ldr->ents, key, val) {
 		free((char *)key);
@@ -160,8 +172,8 @@ CTF_TEST(loader_loads_only_once,
 	FILE *file;
 	struct loader ldr;
 	loader_init(&ldr, "data");
-	d3d_texture *empty = assert_alloc(d3d_new_texture(0, 0,
-		TRANSPARENT_PIXEL));
+	d3d_pixel pix = TRANSPARENT_PIXEL;
+	d3d_texture *empty = atlas_texture(loader_atlas(&ldr), 1, 1, &pix);
 	d3d_texture **loaded = loader_texture(&ldr, "empty", &file);
 	*loaded = empty;
 	assert(*loader_texture(&ldr, "empty", &file) == empty);
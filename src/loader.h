@@ -1,6 +1,7 @@
 #ifndef LOADER_H_
 #define LOADER_H_
 
+#include "atlas.h"
 #include "d3d.h"
 #include "table.h"
 #include "ui-util.h"
@@ -14,6 +15,7 @@ struct ent_type;
 // An object for loading game resources recursively. The fields are private.
 struct loader {
 	d3d_texture *empty_txtr;
+	struct atlas atlas;
 	table txtrs;
 	char *txtrs_dir;
 	table ents;
@@ -50,6 +52,10 @@ const d3d_texture *loader_empty_texture(struct loader *ldr);
 // Print to the INFO log a count of all that has been loaded thus far.
 void loader_print_summary(struct loader *ldr);
 
+// Get a non-owned reference to the atlas holding the loader's textures. The
+// textures in the table of loaded textures are all in it.
+struct atlas *loader_atlas(struct loader *ldr);
+
 // Get a non-owned reference to the loader's current color map.
 struct color_map *loader_color_map(struct loader *ldr);
 
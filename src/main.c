@@ -1,5 +1,6 @@
 #include "do-ts3d-game.h"
 #include "logger.h"
+#include "replay.h"
 #include "util.h"
 #include "xalloc.h"
 #include <errno.h>
@@ -28,8 +29,20 @@ static void print_help(const char *progname)
 "                or error) to the destination file. If the file name's empty,\n"
 "                messages are printed to stderr.\n"
 "  -L level      Do not log messages of the given log level.\n"
+"  -p recording  Play back a recording made with -r instead of the game. The\n"
+"                keys P, +, -, the arrows, and Q pause, change speed, seek,\n"
+"                and quit.\n"
+"  -r rec_file   Record the 3D scene of the levels played to rec_file,\n"
+"                adding to the end of it.\n"
 "  -s state_file Read persistent state from state_file.\n"
+"  -S speed      Play back a recording speed times as fast as it was made.\n"
 "  -v            Print version information.\n"
+"  -w sock_path  Let spectators watch the levels played through a Unix socket\n"
+"                made at sock_path.\n"
+"  -W sock_path  Watch the game shared at sock_path with -w instead of\n"
+"                playing. Q quits.\n"
+"  -x dir        Write the frames of the recording given with -p to dir as\n"
+"                PPM images instead of playing it back.\n"
 "\n"
 "Game data and state is looked for in $TS3D_ROOT, or $HOME/.ts3d by default*.\n"
 "If the root directory doesn't exist, it will be created. The paths for data\n"
@@ -38,6 +51,8 @@ static void print_help(const char *progname)
 "can override the environment variables if given.\n"
 "ts3d by default logs to the file 'log' in the game's root directory, or to\n"
 "the $TS3D_LOG variable if it is set. Again, options override this.\n"
+"The playing screen is drawn with Curses unless $TS3D_OUTPUT is \"ansi\", in\n"
+"which case escape sequences are written to the terminal directly.\n"
 "\n"
 "* There are exceptions. If you are using this on Windows, the default\n"
 "storage location is instead %AppData%\\ts3d. In packaged versions of this\n"
@@ -148,6 +163,18 @@ int main(int argc, char *argv[])
 	char *data_dir = NULL;
 	// State file path, NULL for default:
 	char *state_file = NULL;
+	// Recording to make, NULL for none:
+	const char *record_file = NULL;
+	// Socket to share the game through, NULL for none:
+	const char *spectate_path = NULL;
+	// Socket of the game to watch, NULL for none:
+	const char *watch_path = NULL;
+	// Recording to play back or export, NULL for none:
+	const char *play_file = NULL;
+	// Playback speed:
+	double speed = 1;
+	// Directory to export the recording to, NULL to play it back:
+	const char *export_dir = NULL;
 	// Logger to be used by do_ts3d_game:
 	struct logger log;
 	// Default log destination file path, NULL until initialized:
@@ -157,7 +184,7 @@ int main(int argc, char *argv[])
 	int opt;
 	logger_init(&log);
 	logger_set_output(&log, LOGGER_ALL, UNTOUCHED_MARKER, false);
-	while ((opt = getopt(argc, argv, "d:hl:L:s:v")) >= 0) {
+	while ((opt = getopt(argc, argv, "d:hl:L:p:r:s:S:vw:W:x:")) >= 0) {
 		switch (opt) {
 		case 'd':
 			free(data_dir);
@@ -173,20 +200,43 @@ int main(int argc, char *argv[])
 		case 'L':
 			if (remove_log_dest(progname, &log, optarg)) goto end;
 			break;
+		case 'p':
+			play_file = optarg;
+			break;
+		case 'r':
+			record_file = optarg;
+			break;
 		case 's':
 			free(state_file);
 			state_file = str_dup(optarg);
 			break;
+		case 'S':
+			speed = strtod(optarg, NULL);
+			if (!(speed > 0)) {
+				fprintf(stderr, "%s: Invalid speed: %s\n",
+					progname, optarg);
+				goto end;
+			}
+			break;
 		case 'v':
 			print_version(progname);
 			ret = 0;
 			goto end;
+		case 'w':
+			spectate_path = optarg;
+			break;
+		case 'W':
+			watch_path = optarg;
+			break;
+		case 'x':
+			export_dir = optarg;
+			break;
 		default:
 			error = true;
 			break;
 		}
 	}
-	if (error) {
+	if (error || (export_dir && !play_file)) {
 		print_usage(progname, stderr);
 		goto end;
 	}
@@ -214,7 +264,16 @@ int main(int argc, char *argv[])
 		if (logger_get_output(&log, LOGGER_ERROR) == UNTOUCHED_MARKER)
 			logger_set_output(&log, LOGGER_ERROR, log_def, false);
 	}
-	ret = do_ts3d_game(data_dir, state_file, &log);
+	if (watch_path) {
+		ret = watch_game(watch_path, &log);
+	} else if (export_dir) {
+		ret = export_recording(play_file, export_dir, &log);
+	} else if (play_file) {
+		ret = replay_recording(play_file, speed, &log);
+	} else {
+		ret = do_ts3d_game(data_dir, state_file, record_file,
+			spectate_path, &log);
+	}
 	if (ret < 0) {
 		FILE *err_log = logger_get_output(&log, LOGGER_ERROR);
 		if (err_log) {
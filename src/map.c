@@ -23,20 +23,19 @@
 // means the 0th row in the JSON is the last row of the board object and vice
 // versa. This comment is referenced in relevant parts of the code.
 
-static uint8_t *get_wall(struct map *map, size_t x, size_t y)
+// The wall bits of a tile are kept in its board cell above the block index.
+static void set_wall(struct map *map, size_t x, size_t y, uint8_t wall)
 {
-	return &map->walls[y * d3d_board_width(map->board) + x];
+	d3d_cell *cell = d3d_board_cell(map->board, x, y);
+	*cell = (*cell & D3D_CELL_BLOCK_MASK)
+		| (d3d_cell)(wall & 0xF) << D3D_CELL_BLOCK_BITS;
 }
 
 static uint8_t get_wall_ck(const struct map *map, long lx, long ly)
 {
-	size_t x = (size_t)lx, y = (size_t)ly;
-	if (x < d3d_board_width(map->board) && y < d3d_board_height(map->board))
-	{
-		return *get_wall((struct map *)map, x, y);
-	} else {
-		return 0;
-	}
+	// Out-of-range tiles give 0:
+	return d3d_board_read_cell(map->board, (size_t)lx, (size_t)ly)
+		>> D3D_CELL_BLOCK_BITS;
 }
 
 static void parse_block(d3d_block_s *block, uint8_t *wall, struct json_node *nd,
@@ -124,7 +123,7 @@ void map_check_walls(struct map *map, d3d_vec_s *pos, d3d_scalar radius)
 		} else if (east > x) {
 			// Correct the east.
 			if (bitat(here, D3D_DPOSX)) {
-				pos->x = x + 1.0 - radius;
+				pos->x = x + 1 - radius;
 			} else if (!south_corrected) {
 				// Detect southeast corner collision.
 				uint8_t ne = get_wall_ck(map, east, south);
@@ -137,7 +136,7 @@ void map_check_walls(struct map *map, d3d_vec_s *pos, d3d_scalar radius)
 					if (south_dist > east_dist) {
 						pos->y = y + radius;
 					} else {
-						pos->x = x + 1.0 - radius;
+						pos->x = x + 1 - radius;
 					}
 				}
 			}
@@ -146,7 +145,7 @@ void map_check_walls(struct map *map, d3d_vec_s *pos, d3d_scalar radius)
 		// Correct the north side and maybe east/west.
 		bool north_corrected = bitat(here, D3D_DPOSY);
 		d3d_scalar north_dist = ceil(pos->y) - pos->y;
-		if (north_corrected) pos->y = y + 1.0 - radius;
+		if (north_corrected) pos->y = y + 1 - radius;
 		if (west < x) {
 			// Correct the west.
 			if (bitat(here, D3D_DNEGX)) {
@@ -161,7 +160,7 @@ void map_check_walls(struct map *map, d3d_vec_s *pos, d3d_scalar radius)
 						- floor(pos->x);
 					// Do correction needing less movement.
 					if (north_dist > west_dist) {
-						pos->y = y + 1.0 - radius;
+						pos->y = y + 1 - radius;
 					} else {
 						pos->x = x + radius;
 					}
@@ -170,7 +169,7 @@ void map_check_walls(struct map *map, d3d_vec_s *pos, d3d_scalar radius)
 		} else if (east > x) {
 			// Correct the east.
 			if (bitat(here, D3D_DPOSX)) {
-				pos->x = x + 1.0 - radius;
+				pos->x = x + 1 - radius;
 			} else if (!north_corrected) {
 				// Detect northeast corner collision.
 				uint8_t se = get_wall_ck(map, east, north);
@@ -180,9 +179,9 @@ void map_check_walls(struct map *map, d3d_vec_s *pos, d3d_scalar radius)
 					d3d_scalar east_dist = ceil(pos->x)
 						- pos->x;
 					if (north_dist > east_dist) {
-						pos->y = y + 1.0 - radius;
+						pos->y = y + 1 - radius;
 					} else {
-						pos->x = x + 1.0 - radius;
+						pos->x = x + 1 - radius;
 					}
 				}
 			}
@@ -192,7 +191,7 @@ void map_check_walls(struct map *map, d3d_vec_s *pos, d3d_scalar radius)
 		if (bitat(here, D3D_DNEGX)) pos->x = x + radius;
 	} else if (east > x) {
 		// Correct only the east side.
-		if (bitat(here, D3D_DPOSX)) pos->x = x + 1.0 - radius;
+		if (bitat(here, D3D_DPOSX)) pos->x = x + 1 - radius;
 	}
 }
 
@@ -233,7 +232,7 @@ error_kind:
 
 static uint8_t normalize_wall(const struct map *map, size_t x, size_t y)
 {
-	uint8_t here = map->walls[y * d3d_board_width(map->board) + x];
+	uint8_t here = get_wall_ck(map, x, y);
 	d3d_direction dirs[] = {D3D_DNEGY, D3D_DPOSY, D3D_DNEGX, D3D_DPOSX};
 	for (size_t i = 0; i < ARRSIZE(dirs); ++i) {
 		d3d_direction dir = dirs[i];
@@ -241,10 +240,9 @@ static uint8_t normalize_wall(const struct map *map, size_t x, size_t y)
 		if (here & bit) break;
 		size_t there_x = x, there_y = y;
 		move_direction(dir, &there_x, &there_y);
-		if (d3d_board_get(map->board, there_x, there_y)) {
-			uint8_t there =
-				map->walls[there_y * d3d_board_width(map->board)
-				+ there_x];
+		if (there_x < d3d_board_width(map->board)
+		 && there_y < d3d_board_height(map->board)) {
+			uint8_t there = get_wall_ck(map, there_x, there_y);
 			if (bitat(there, flip_direction(dir))) here |= bit;
 		} else {
 			here |= bit;
@@ -287,7 +285,6 @@ struct map *load_map(struct loader *ldr, const char *name)
 	map->name = str_dup(name);
 	map->prereq = NULL;
 	map->board = NULL;
-	map->walls = NULL;
 	map->blocks = NULL;
 	map->ents = NULL;
 	map->n_ents = 0;
@@ -318,16 +315,24 @@ struct map *load_map(struct loader *ldr, const char *name)
 	}
 	if ((got = json_map_get(&jtree, "prereq", TAKE_NODE | JN_STRING)))
 		map->prereq = got->str;
-	uint8_t *walls = NULL;
-	size_t n_blocks = 0;
+	// Block 0 is empty and the rest are from the map, starting at 1.
+	size_t n_blocks = 1;
 	if ((got = json_map_get(&jtree, "blocks", JN_LIST))) {
-		n_blocks = got->list.n_vals;
-		walls = xmalloc(n_blocks);
-		map->blocks = xmalloc(n_blocks * sizeof(*map->blocks));
-		for (size_t i = 0; i < n_blocks; ++i) {
-			parse_block(&map->blocks[i], &walls[i],
-				&got->list.vals[i], ldr);
+		if (got->list.n_vals > D3D_CELL_BLOCK_MASK) {
+			logger_printf(log, LOGGER_ERROR,
+				"Map \"%s\" has more than %d blocks\n", name,
+				D3D_CELL_BLOCK_MASK);
+			goto format_error;
 		}
+		n_blocks += got->list.n_vals;
+	}
+	uint8_t *walls = xmalloc(n_blocks);
+	map->blocks = xmalloc(n_blocks * sizeof(*map->blocks));
+	walls[0] = 0;
+	memset(&map->blocks[0], 0, sizeof(*map->blocks));
+	for (size_t i = 1; i < n_blocks; ++i) {
+		parse_block(&map->blocks[i], &walls[i], &got->list.vals[i - 1],
+			ldr);
 	}
 	struct json_node_data_list *layout = NULL;
 	if ((got = json_map_get(&jtree, "layout", JN_LIST)))
@@ -343,8 +348,8 @@ struct map *load_map(struct loader *ldr, const char *name)
 		}
 	}
 	if (layout && width > 0 && height > 0) {
-		map->board = assert_alloc(d3d_new_board(width, height, NULL));
-		map->walls = xcalloc(height, width);
+		map->board = assert_alloc(d3d_new_compact_board(width, height,
+			n_blocks, map->blocks));
 		// See DIRECTION NOTE regarding y:
 		for (size_t r = 0, y = height - 1; r < height; ++r, --y) {
 			if (layout->vals[y].kind != JN_LIST) continue;
@@ -352,28 +357,28 @@ struct map *load_map(struct loader *ldr, const char *name)
 				&layout->vals[r].d.list;
 			for (size_t x = 0; x < row->n_vals; ++x) {
 				if (row->vals[x].kind != JN_NUMBER) continue;
-				size_t idx = row->vals[x].d.num;
+				size_t idx = row->vals[x].d.num + 1;
 				if (idx >= n_blocks) continue;
-				*d3d_board_get(map->board, x, y) =
-					&map->blocks[idx];
-				*get_wall(map, x, y) = walls[idx];
+				*d3d_board_cell(map->board, x, y) = idx;
+				set_wall(map, x, y, walls[idx]);
 			}
 		}
 		for (size_t y = 0; y < height; ++y) {
 			for (size_t x = 0; x < width; ++x) {
-				*get_wall(map, x, y) =
-					normalize_wall(map, x, y);
+				set_wall(map, x, y, normalize_wall(map, x, y));
 			}
 		}
 	} else {
 		width = height = 1;
-		map->board = assert_alloc(d3d_new_board(width, height, NULL));
-		map->walls = xcalloc(1, 1);
+		map->board = assert_alloc(d3d_new_compact_board(width, height,
+			n_blocks, map->blocks));
 	}
 	free(walls);
-	map->player.pos.x = CLAMP(map->player.pos.x, 0, width - 0.01);
+	map->player.pos.x = CLAMP(map->player.pos.x, 0,
+		width - (d3d_scalar)0.01);
 	// See DIRECTION NOTE:
-	map->player.pos.y = height - CLAMP(map->player.pos.y, 0.01, height);
+	map->player.pos.y = height - CLAMP(map->player.pos.y,
+		(d3d_scalar)0.01, height);
 	map->n_ents = 0;
 	if ((got = json_map_get(&jtree, "ents", JN_LIST))) {
 		map->ents = xmalloc(got->list.n_vals * sizeof(*map->ents));
@@ -386,7 +391,8 @@ struct map *load_map(struct loader *ldr, const char *name)
 			}
 		}
 	}
-	if (!map->board) map->board = assert_alloc(d3d_new_board(0, 0, NULL));
+	if (!map->board) map->board = assert_alloc(
+		d3d_new_compact_board(0, 0, n_blocks, map->blocks));
 	free_json_tree(&jtree);
 	*mapp = map;
 	return map;
@@ -404,7 +410,6 @@ void map_free(struct map *map)
 	free(map->name);
 	free(map->prereq);
 	d3d_free_board(map->board);
-	free(map->walls);
 	free(map->blocks);
 	free(map->ents);
 	free(map);
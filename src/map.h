@@ -28,14 +28,14 @@ struct map {
 	// The file name (excluding .json) of the map which must be completed to
 	// allow entry to this one. NULL indicates no prerequisite.
 	char *prereq;
-	// The board of visual blocks from the blocks array.
+	// The compact board of visual blocks from the blocks array. The bits of
+	// each cell above D3D_CELL_BLOCK_BITS document the walls. If the bit
+	// (1 << direction) is set in those bits, there is a wall in that
+	// direction.
 	d3d_board *board;
-	// The grid of the same width and height as the board, documenting the
-	// walls. If the bit (1 << direction) is set in a tile, there is a wall
-	// in that direction.
-	uint8_t *walls;
-	// The blocks used in the board. These refer to textures in the table
-	// passed to load_map(s).
+	// The blocks used in the board, which is its palette. Block 0 is empty,
+	// and the rest are the map's blocks in order. These refer to textures
+	// in the table passed to load_map(s).
 	d3d_block_s *blocks;
 	// The starting number of entities.
 	size_t n_ents;
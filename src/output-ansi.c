@@ -0,0 +1,304 @@
+// The ANSI output backend writes the playing screen to the terminal with escape
+// sequences itself. Everything drawn in a frame is put in one buffer, which is
+// written with one write() when the output is flushed. The terminal must
+// understand the usual VT100 cursor movement and SGR color sequences, which is
+// nearly every terminal around today.
+
+#include "output.h"
+#include "config.h"
+#include "grow.h"
+#include "pixel.h"
+#include "util.h"
+#include "xalloc.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+// The color given to SGR for the terminal's default color.
+#define DEFAULT_COLOR 9
+
+// A style is a number packing whether the text is bold and its foreground and
+// background colors as numbers given to SGR.
+#define make_style(bold, fg, bg) ((bold) << 8 | (fg) << 4 | (bg))
+#define style_bold(style) ((style) >> 8)
+#define style_fg(style) ((style) >> 4 & 15)
+#define style_bg(style) ((style) & 15)
+
+// The style of the text in popups.
+#define POPUP_STYLE make_style(0, DEFAULT_COLOR, DEFAULT_COLOR)
+
+static void put(struct output *out, const char *str, size_t len)
+{
+	memcpy(growc(&out->buf, &out->len, &out->cap, len), str, len);
+}
+
+static void put_num(struct output *out, int num)
+{
+	char digits[16];
+	size_t n = sizeof(digits);
+	do {
+		digits[--n] = '0' + num % 10;
+		num /= 10;
+	} while (num > 0 && n > 0);
+	put(out, digits + n, sizeof(digits) - n);
+}
+
+static void move_to(struct output *out, int x, int y)
+{
+	put(out, "\033[", 2);
+	put_num(out, y + 1);
+	put(out, ";", 1);
+	put_num(out, x + 1);
+	put(out, "H", 1);
+}
+
+static void set_style(struct output *out, int style)
+{
+	if (style == out->style) return;
+	char *seq = growc(&out->buf, &out->len, &out->cap, 11);
+	memcpy(seq, style_bold(style) ? "\033[01;3_;4_m" : "\033[22;3_;4_m",
+		11);
+	seq[6] = '0' + style_fg(style);
+	seq[9] = '0' + style_bg(style);
+	out->style = style;
+}
+
+// Find the style of a curses cell, looking up its color pair.
+static int chtype_style(chtype ch)
+{
+	int fg = DEFAULT_COLOR, bg = DEFAULT_COLOR;
+	short pair = PAIR_NUMBER(ch & A_COLOR);
+	short pair_fg, pair_bg;
+	// The curses colors are numbered like SGR's:
+	if (pair > 0 && pair_content(pair, &pair_fg, &pair_bg) != ERR) {
+		if (pair_fg >= 0 && pair_fg < 8) fg = pair_fg;
+		if (pair_bg >= 0 && pair_bg < 8) bg = pair_bg;
+	}
+	return make_style((ch & A_BOLD) != 0, fg, bg);
+}
+
+static void put_cell(struct output *out, chtype ch)
+{
+	set_style(out, chtype_style(ch));
+	*growc(&out->buf, &out->len, &out->cap, 1) = ch & A_CHARTEXT;
+}
+
+// Put a run of changed scene cells from the presenter. Each run of cells with
+// the same style only changes the style once.
+static void put_run(void *arg, int x, int y, const d3d_pixel *pixels, size_t n)
+{
+	struct output *out = arg;
+	move_to(out, x, y);
+	size_t i = 0;
+	while (i < n) {
+		int style = out->pixel_styles[pixels[i]];
+		size_t same = i + 1;
+		while (same < n && out->pixel_styles[pixels[same]] == style) {
+			++same;
+		}
+		set_style(out, style);
+		memset(growc(&out->buf, &out->len, &out->cap, same - i),
+			SCENE_FG_CHAR, same - i);
+		i = same;
+	}
+}
+
+static void put_popup(struct output *out, const struct screen_area *area)
+{
+	set_style(out, POPUP_STYLE);
+	for (int y = 0; y < area->height; ++y) {
+		int len;
+		const char *line = popup_line(out->popup, y, &len);
+		int left = (area->width - len) / 2;
+		move_to(out, area->x, area->y + y);
+		char *row = growc(&out->buf, &out->len, &out->cap,
+			area->width);
+		memset(row, ' ', area->width);
+		memcpy(row + left, line, len);
+	}
+}
+
+// Write all the buffered bytes to the terminal.
+static void write_all(struct output *out)
+{
+	const char *bytes = out->buf;
+	size_t left = out->len;
+	while (left > 0) {
+		ssize_t written = write(STDOUT_FILENO, bytes, left);
+		if (written < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		bytes += written;
+		left -= written;
+	}
+	out->len = 0;
+}
+
+static void ansi_init(struct output *out)
+{
+	const chtype *cells = color_map_cells(out->colors);
+	for (size_t p = 0; p < ARRSIZE(out->pixel_styles); ++p) {
+		out->pixel_styles[p] = chtype_style(cells[p]);
+	}
+}
+
+static void ansi_present(struct output *out, d3d_camera *cam,
+	const struct screen_area *area)
+{
+	presenter_update(&out->presenter, cam, area, put_run, out);
+}
+
+static void ansi_meter(struct output *out, const struct meter *meter)
+{
+	move_to(out, meter->x, meter->y);
+	for (int i = 0; i < meter->width; ++i) {
+		put_cell(out, meter_cell(meter, i));
+	}
+}
+
+static void ansi_text(struct output *out, int x, int y, chtype attrs,
+	const char *text)
+{
+	move_to(out, x, y);
+	for (const char *chrp = text; *chrp != '\0'; ++chrp) {
+		put_cell(out, attrs | (unsigned char)*chrp);
+	}
+	// The scene under the text is drawn again next time:
+	presenter_damage(&out->presenter, x, y, (int)strlen(text));
+}
+
+static void ansi_popup(struct output *out, const char *UNUSED_VAR(text))
+{
+	// The scene under the popup last shown is sent again:
+	struct screen_area *area = &out->popup_shown;
+	for (int y = area->y; y < area->y + area->height; ++y) {
+		presenter_damage(&out->presenter, area->x, y, area->width);
+	}
+	area->width = 0;
+}
+
+static void ansi_resize(struct output *out)
+{
+	put(out, "\033[0m\033[2J", 8);
+	out->style = -1;
+	out->popup_shown.width = 0;
+}
+
+static void ansi_flush(struct output *out)
+{
+	struct screen_area area;
+	if (out->popup_stale && popup_area(out->popup, &area)) {
+		put_popup(out, &area);
+		out->popup_shown = area;
+	}
+	if (out->len > 0) {
+		// Leave the terminal as curses expects to find it, since it
+		// draws everything else:
+		put(out, "\033[0m", 4);
+		move_to(out, getcurx(curscr), getcury(curscr));
+		out->style = -1;
+		write_all(out);
+	}
+}
+
+static void ansi_destroy(struct output *out)
+{
+	free(out->buf);
+}
+
+const struct output_backend ansi_output_backend = {
+	.name = "ansi",
+	.init = ansi_init,
+	.present = ansi_present,
+	.meter = ansi_meter,
+	.text = ansi_text,
+	.popup = ansi_popup,
+	.resize = ansi_resize,
+	.flush = ansi_flush,
+	.destroy = ansi_destroy,
+};
+
+#if CTF_TESTS_ENABLED
+
+#	include "libctf.h"
+#	include <assert.h>
+#	include <stdio.h>
+
+// Set up an output with only what the ANSI encoding uses.
+static void init_test_output(struct output *out)
+{
+	memset(out, 0, sizeof(*out));
+	out->style = -1;
+}
+
+// Check that the bytes buffered are exactly the string, then empty the buffer.
+static void assert_buffered(struct output *out, const char *str)
+{
+	assert(out->len == strlen(str));
+	assert(!memcmp(out->buf, str, out->len));
+	out->len = 0;
+}
+
+CTF_TEST(ansi_puts_numbers_and_moves,
+	struct output out;
+	init_test_output(&out);
+	put_num(&out, 0);
+	assert_buffered(&out, "0");
+	put_num(&out, 1234);
+	assert_buffered(&out, "1234");
+	// Positions count from 1 in escape sequences:
+	move_to(&out, 4, 0);
+	assert_buffered(&out, "\033[1;5H");
+	move_to(&out, 79, 23);
+	assert_buffered(&out, "\033[24;80H");
+	free(out.buf);
+)
+
+CTF_TEST(ansi_sets_style_only_when_changed,
+	struct output out;
+	init_test_output(&out);
+	set_style(&out, make_style(1, 3, DEFAULT_COLOR));
+	assert_buffered(&out, "\033[01;33;49m");
+	set_style(&out, make_style(1, 3, DEFAULT_COLOR));
+	assert_buffered(&out, "");
+	set_style(&out, make_style(0, 2, 0));
+	assert_buffered(&out, "\033[22;32;40m");
+	free(out.buf);
+)
+
+CTF_TEST(ansi_runs_change_style_once_per_run,
+	struct output out;
+	init_test_output(&out);
+	out.pixel_styles[5] = out.pixel_styles[6] = make_style(0, 1, 1);
+	out.pixel_styles[7] = make_style(0, 2, 2);
+	const d3d_pixel pixels[] = { 5, 6, 6, 7, 5 };
+	put_run(&out, 2, 3, pixels, ARRSIZE(pixels));
+	char expected[64];
+	snprintf(expected, sizeof(expected),
+		"\033[4;3H\033[22;31;41m%c%c%c\033[22;32;42m%c\033[22;31;41m%c",
+		SCENE_FG_CHAR, SCENE_FG_CHAR, SCENE_FG_CHAR, SCENE_FG_CHAR,
+		SCENE_FG_CHAR);
+	assert_buffered(&out, expected);
+	// The style carries over to the next run:
+	put_run(&out, 0, 0, pixels, 1);
+	snprintf(expected, sizeof(expected), "\033[1;1H%c", SCENE_FG_CHAR);
+	assert_buffered(&out, expected);
+	free(out.buf);
+)
+
+CTF_TEST(ansi_popup_pads_lines,
+	struct output out;
+	init_test_output(&out);
+	out.popup = "Hi\nthere";
+	struct screen_area area = { 10, 5, 7, 4 };
+	put_popup(&out, &area);
+	assert_buffered(&out, "\033[22;39;49m"
+		"\033[6;11H       "
+		"\033[7;11H  Hi   "
+		"\033[8;11H there "
+		"\033[9;11H       ");
+	free(out.buf);
+)
+
+#endif /* CTF_TESTS_ENABLED */
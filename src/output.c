@@ -0,0 +1,166 @@
+#include "output.h"
+#include "util.h"
+#include <string.h>
+
+static const struct output_backend *const backends[] = {
+	&curses_output_backend,
+	&ansi_output_backend,
+};
+
+int output_init(struct output *out, const char *name,
+	struct color_map *colors)
+{
+	int ret = 0;
+	out->backend = backends[0];
+	if (name) {
+		size_t i;
+		for (i = 0; i < ARRSIZE(backends); ++i) {
+			if (!strcmp(backends[i]->name, name)) break;
+		}
+		if (i < ARRSIZE(backends)) {
+			out->backend = backends[i];
+		} else {
+			ret = -1;
+		}
+	}
+	out->colors = colors;
+	presenter_init(&out->presenter);
+	out->popup = NULL;
+	out->popup_stale = false;
+	out->popup_win = NULL;
+	out->popup_shown.width = 0;
+	out->buf = NULL;
+	out->len = out->cap = 0;
+	out->style = -1;
+	out->backend->init(out);
+	return ret;
+}
+
+const char *output_name(const struct output *out)
+{
+	return out->backend->name;
+}
+
+void output_present(struct output *out, d3d_camera *cam,
+	const struct screen_area *area)
+{
+	out->backend->present(out, cam, area);
+	out->popup_stale = out->popup != NULL;
+}
+
+void output_meter(struct output *out, const struct meter *meter)
+{
+	out->backend->meter(out, meter);
+	out->popup_stale = out->popup != NULL;
+}
+
+void output_text(struct output *out, int x, int y, chtype attrs,
+	const char *text)
+{
+	out->backend->text(out, x, y, attrs, text);
+	out->popup_stale = out->popup != NULL;
+}
+
+void output_popup(struct output *out, const char *text)
+{
+	if (text == out->popup
+	 || (text && out->popup && !strcmp(text, out->popup))) return;
+	out->backend->popup(out, text);
+	out->popup = text;
+	out->popup_stale = text != NULL;
+}
+
+void output_resize(struct output *out)
+{
+	presenter_invalidate(&out->presenter);
+	out->popup_stale = out->popup != NULL;
+	out->backend->resize(out);
+}
+
+void output_flush(struct output *out)
+{
+	out->backend->flush(out);
+	out->popup_stale = false;
+}
+
+void output_destroy(struct output *out)
+{
+	out->backend->destroy(out);
+	if (out->popup_win) delwin(out->popup_win);
+	presenter_destroy(&out->presenter);
+}
+
+static void curses_init(struct output *UNUSED_VAR(out))
+{
+}
+
+static void curses_present(struct output *out, d3d_camera *cam,
+	const struct screen_area *area)
+{
+	present_frame(&out->presenter, cam, area, out->colors);
+}
+
+static void curses_meter(struct output *UNUSED_VAR(out),
+	const struct meter *meter)
+{
+	meter_draw(meter);
+}
+
+static void curses_text(struct output *out, int x, int y, chtype attrs,
+	const char *text)
+{
+	attron(attrs);
+	mvaddstr(y, x, text);
+	attroff(attrs);
+	// The scene under the text is drawn again next time:
+	presenter_damage(&out->presenter, x, y, getcurx(stdscr) - x);
+}
+
+static void curses_popup(struct output *out, const char *UNUSED_VAR(text))
+{
+	if (out->popup_win) {
+		delwin(out->popup_win);
+		out->popup_win = NULL;
+		// What was under the popup is shown again:
+		touchwin(stdscr);
+	}
+}
+
+static void curses_resize(struct output *out)
+{
+	// The popup is made again in the new middle of the screen:
+	if (out->popup_win) {
+		delwin(out->popup_win);
+		out->popup_win = NULL;
+	}
+}
+
+static void curses_flush(struct output *out)
+{
+	refresh();
+	if (out->popup) {
+		// The window is only made when the popup is shown, and is only
+		// shown if it fits:
+		if (!out->popup_win) out->popup_win = popup_window(out->popup);
+		if (out->popup_win) {
+			touchwin(out->popup_win);
+			wrefresh(out->popup_win);
+		}
+	}
+}
+
+static void curses_destroy(struct output *UNUSED_VAR(out))
+{
+}
+
+const struct output_backend curses_output_backend = {
+	.name = "curses",
+	.init = curses_init,
+	.present = curses_present,
+	.meter = curses_meter,
+	.text = curses_text,
+	.popup = curses_popup,
+	.resize = curses_resize,
+	.flush = curses_flush,
+	.destroy = curses_destroy,
+};
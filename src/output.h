@@ -0,0 +1,107 @@
+#ifndef OUTPUT_H_
+#define OUTPUT_H_
+
+// The game screen is drawn through an output, which sends it to the terminal
+// with one of several backends. Curses is always used for input and for the
+// menus; only the playing screen is drawn by the backend.
+
+#include "d3d.h"
+#include "ui-util.h"
+#include <stddef.h>
+
+struct output;
+
+// A way of sending the playing screen to the terminal. Nothing drawn is
+// guaranteed to be shown until the output is flushed.
+struct output_backend {
+	// The name the backend is chosen by.
+	const char *name;
+	// Prepare to draw to the whole screen.
+	void (*init)(struct output *out);
+	// Show the camera's current scene in the area of the screen, sending
+	// only the cells that changed since the last frame if possible.
+	void (*present)(struct output *out, d3d_camera *cam,
+		const struct screen_area *area);
+	// Draw the meter. Its win is only used by the curses backend.
+	void (*meter)(struct output *out, const struct meter *meter);
+	// Draw text starting at (x, y) with the curses attributes.
+	void (*text)(struct output *out, int x, int y, chtype attrs,
+		const char *text);
+	// Note that the popup text changed to the new text, or to NULL if the
+	// popup went away. The popup itself is shown by flush.
+	void (*popup)(struct output *out, const char *text);
+	// Note that the screen changed size and everything must be drawn again.
+	void (*resize)(struct output *out);
+	// Show what was drawn, with the popup on top if there is one.
+	void (*flush)(struct output *out);
+	// Free the backend's resources.
+	void (*destroy)(struct output *out);
+};
+
+// The backends. Curses is the default.
+extern const struct output_backend curses_output_backend;
+extern const struct output_backend ansi_output_backend;
+
+// An output. The fields are private to the backends.
+struct output {
+	const struct output_backend *backend;
+	// The colors of the scene's pixels.
+	struct color_map *colors;
+	// Keeps track of the cells of the scene shown.
+	struct presenter presenter;
+	// The text of the popup to show, or NULL if there is none.
+	const char *popup;
+	// Whether the popup must be shown again the next flush.
+	bool popup_stale;
+	// The curses window of the popup shown, or NULL.
+	WINDOW *popup_win;
+	// Where the ANSI backend last showed a popup. The width is 0 if it
+	// didn't.
+	struct screen_area popup_shown;
+	// The ANSI backend's bytes to write at the next flush.
+	char *buf;
+	size_t len, cap;
+	// The ANSI backend's current style (see output-ansi.c), or -1 if it's
+	// not known.
+	int style;
+	// The ANSI backend's styles for each pixel.
+	int pixel_styles[256];
+};
+
+// Initialize an output with the backend of the given name. If the name is NULL,
+// the default backend is used. -1 is returned if there's no backend by that
+// name, in which case the default is used anyway. The color map must be applied
+// and must live as long as the output.
+int output_init(struct output *out, const char *name,
+	struct color_map *colors);
+
+// Get the name of the output's backend.
+const char *output_name(const struct output *out);
+
+// Show the camera's current scene in the area of the screen.
+void output_present(struct output *out, d3d_camera *cam,
+	const struct screen_area *area);
+
+// Draw the meter.
+void output_meter(struct output *out, const struct meter *meter);
+
+// Draw text starting at (x, y) with the curses attributes, such as A_BOLD.
+void output_text(struct output *out, int x, int y, chtype attrs,
+	const char *text);
+
+// Set the text of the popup shown in the middle of the screen over everything
+// else, or remove it if text is NULL. The text must live as long as it is shown.
+// The popup appears at the next flush. The scene under a popup that goes away
+// is drawn again at the next present.
+void output_popup(struct output *out, const char *text);
+
+// Note that the screen changed size. Everything is drawn again.
+void output_resize(struct output *out);
+
+// Show everything drawn since the last flush.
+void output_flush(struct output *out);
+
+// Free resources associated with the output.
+void output_destroy(struct output *out);
+
+#endif /* OUTPUT_H_ */
@@ -4,14 +4,20 @@
 #include "map.h"
 #include "loader.h"
 #include "logger.h"
+#include "output.h"
 #include "pixel.h"
 #include "player.h"
+#include "recording.h"
+#include "render-scale.h"
 #include "save-state.h"
+#include "spectate.h"
 #include "ticker.h"
 #include "ui-util.h"
 #include "util.h"
 #include <ctype.h>
 #include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <tgmath.h>
 #include <time.h>
 
@@ -104,8 +110,8 @@ static void move_ents(struct ents *ents, struct map *map, struct player *player)
 			disp.y += move.y - epos->y;
 			*epos = move;
 		}
-		if (disp.x != 0.0) evel->x = disp.x;
-		if (disp.y != 0.0) evel->y = disp.y;
+		if (disp.x != 0) evel->x = disp.x;
+		if (disp.y != 0) evel->y = disp.y;
 	}
 }
 
@@ -123,23 +129,118 @@ static void hit_ents(struct ents *ents)
 	}
 }
 
+// How many bullets' paths shoot_bullets checks at once.
+#define SIGHT_BATCH 32
+
+// Bullets that die at walls and can hurt the player, waiting for their paths
+// to be checked before they are shot.
+struct sight_batch {
+	size_t n;
+	ent_id shooters[SIGHT_BATCH];
+	// Where each bullet would start and the velocity it would have.
+	d3d_vec_s origins[SIGHT_BATCH], vels[SIGHT_BATCH];
+};
+
+// Get the velocity of a bullet shot by the entity: the entity's own velocity,
+// plus the bullet's speed in the same direction.
+static d3d_vec_s bullet_vel(struct ents *ents, ent_id e)
+{
+	d3d_vec_s vel = *ents_vel(ents, e), d_vel = vel;
+	vec_norm_mul(&d_vel, ents_type(ents, e)->bullet->speed);
+	vel.x += d_vel.x;
+	vel.y += d_vel.y;
+	return vel;
+}
+
+// Check whether a bullet shot by the entity would be on a team that can hit the
+// player.
+static bool bullet_can_hit(struct ents *ents, ent_id e,
+	const struct player *player)
+{
+	struct ent_type *bullet = ents_type(ents, e)->bullet;
+	enum team team = bullet->team_override == TEAM_INVALID ?
+		ents_team(ents, e) : bullet->team_override;
+	return teams_can_collide(team, player->start->team);
+}
+
+// Add the bullet of the entity to the entity pool at the position and with the
+// velocity given.
+static void shoot(struct ents *ents, ent_id e, d3d_vec_s pos, d3d_vec_s vel)
+{
+	ent_id bullet = ents_add(ents, ents_type(ents, e)->bullet,
+		ents_team(ents, e), &pos);
+	*ents_vel(ents, bullet) = vel;
+}
+
+// Get how close the segment from a to b comes to the point p.
+static d3d_scalar segment_dist(d3d_vec_s a, d3d_vec_s b, d3d_vec_s p)
+{
+	d3d_scalar dx = b.x - a.x, dy = b.y - a.y;
+	d3d_scalar len2 = dx * dx + dy * dy;
+	d3d_scalar t = 0;
+	if (len2 > 0) {
+		t = ((p.x - a.x) * dx + (p.y - a.y) * dy) / len2;
+		if (t < 0) t = 0;
+		else if (t > 1) t = 1;
+	}
+	return hypot(a.x + t * dx - p.x, a.y + t * dy - p.y);
+}
+
+// Shoot the bullets in the batch that the player could run into before a wall
+// kills them, then empty the batch. Their paths are all cast at once. A bullet
+// is only held back if, for its whole flight up to the wall, it stays further
+// from the player than the player could walk in that time plus both of their
+// radii.
+static void shoot_if_clear(struct ents *ents, const d3d_board *board,
+	const struct player *player, struct sight_batch *batch)
+{
+	d3d_ray_hit_s hits[SIGHT_BATCH];
+	d3d_cast_rays(board, batch->n, batch->origins, batch->vels, hits);
+	for (size_t i = 0; i < batch->n; ++i) {
+		d3d_vec_s from = batch->origins[i], vel = batch->vels[i];
+		ent_id e = batch->shooters[i];
+		if (hits[i].block) {
+			d3d_scalar flight = hypot(hits[i].pos.x - from.x,
+				hits[i].pos.y - from.y) / hypot(vel.x, vel.y);
+			d3d_scalar reach = player->body.radius
+				+ ents_type(ents, e)->bullet->width / 2
+				+ player->start->type->speed * flight;
+			d3d_scalar miss = segment_dist(from, hits[i].pos,
+				player->body.pos);
+			// Don't waste a bullet that can't get to the player:
+			if (miss > reach) continue;
+		}
+		shoot(ents, e, from, vel);
+	}
+	batch->n = 0;
+}
+
 // Shoot the bullets of the entities who want to shoot, adding them to the
-// entity pool.
-static void shoot_bullets(struct ents *ents)
+// entity pool. Bullets that die at walls and can hurt the player are only shot
+// if the player could get in their way before a wall kills them. Other bullets,
+// like the monsters and pickups some entities spawn, are always shot.
+static void shoot_bullets(struct ents *ents, const d3d_board *board,
+	const struct player *player)
 {
+	struct sight_batch batch;
+	batch.n = 0;
 	ENTS_FOR_EACH(ents, e) {
 		struct ent_type *type = ents_type(ents, e);
-		if (type->bullet && chance_decide(type->shoot_chance)) {
-			d3d_vec_s pos = *ents_pos(ents, e);
-			ent_id bullet = ents_add(ents, type->bullet,
-				ents_team(ents, e), &pos);
-			d3d_vec_s *bvel = ents_vel(ents, bullet), d_bvel;
-			d_bvel = *bvel = *ents_vel(ents, e);
-			vec_norm_mul(&d_bvel, ents_type(ents, bullet)->speed);
-			bvel->x += d_bvel.x;
-			bvel->y += d_bvel.y;
+		if (!type->bullet || !chance_decide(type->shoot_chance))
+			continue;
+		d3d_vec_s pos = *ents_pos(ents, e);
+		d3d_vec_s vel = bullet_vel(ents, e);
+		if (!type->bullet->wall_die || !bullet_can_hit(ents, e, player)) {
+			shoot(ents, e, pos, vel);
+			continue;
 		}
+		batch.shooters[batch.n] = e;
+		batch.origins[batch.n] = pos;
+		batch.vels[batch.n] = vel;
+		if (++batch.n == SIGHT_BATCH)
+			shoot_if_clear(ents, board, player, &batch);
 	}
+	if (batch.n > 0) shoot_if_clear(ents, board, player, &batch);
 }
 
 // Count the remaining number of targets standing in the way of level winning.
@@ -153,7 +254,8 @@ static int get_remaining(struct ents *ents)
 }
 
 int play_level(const char *root_dir, struct save_state *save,
-	const char *map_name, struct ticker *timer, struct logger *log)
+	const char *map_name, struct ticker *timer, struct logger *log,
+	struct recorder *rec, struct spectate_server *spec)
 {
 	struct loader ldr;
 	loader_init(&ldr, root_dir);
@@ -196,9 +298,6 @@ int play_level(const char *root_dir, struct save_state *save,
 	struct ents ents;
 	init_entities(&ents, map);
 	d3d_board *board = map->board;
-	WINDOW *dead_popup = NULL;
-	WINDOW *pause_popup = NULL;
-	WINDOW *quit_popup = NULL;
 	d3d_camera *cam = NULL;
 	struct player player;
 	player_init(&player, map);
@@ -206,10 +305,21 @@ int play_level(const char *root_dir, struct save_state *save,
 	int translation = '\0'; // No initial translation
 	int turn_duration = 0; // No initial turning
 	bool won = false;
+	bool dead = false;
 	bool paused = false;
 	bool quitting = false;
 	bool do_redraw = true;
 	struct screen_area area = { 0, 0, 1, 1 };
+	struct output out;
+	const char *backend = getenv("TS3D_OUTPUT");
+	if (output_init(&out, backend, loader_color_map(&ldr))) {
+		logger_printf(loader_logger(&ldr), LOGGER_WARNING,
+			"Unknown output \"%s\"; using \"%s\" instead\n",
+			backend, output_name(&out));
+	}
+	struct render_scale scale;
+	render_scale_init(&scale, RENDER_BUDGET_USEC);
+	bool rescaled = false;
 	clear();
 	for (;;) {
 		static const char dead_msg[] =
@@ -236,8 +346,8 @@ int play_level(const char *root_dir, struct save_state *save,
 			// LINES - 1 so that one is reserved for the health and
 			// reload meters:
 			area.height = LINES > 0 ? LINES - 1 : 0;
-			d3d_free_camera(cam);
-			cam = camera_with_dims(area.width, area.height);
+			rescaled = true;
+			output_resize(&out);
 			// Takes up the left half of the bottom:
 			health_meter.x = 0;
 			health_meter.y = area.height;
@@ -248,86 +358,80 @@ int play_level(const char *root_dir, struct save_state *save,
 			reload_meter.y = area.height;
 			reload_meter.width = area.width - health_meter.width;
 			reload_meter.win = stdscr;
-			if (dead_popup) {
-				delwin(dead_popup);
-				dead_popup = popup_window(dead_msg);
-			}
-			if (pause_popup) {
-				delwin(pause_popup);
-				pause_popup = popup_window(pause_msg);
-			}
-			if (quit_popup) {
-				delwin(quit_popup);
-				quit_popup = popup_window(quit_msg);
-			}
 			do_redraw = true;
 		}
+		if (rescaled) {
+			// The camera is only replaced between frames:
+			int width, height;
+			render_scale_dims(&scale, area.width, area.height,
+				&width, &height);
+			d3d_free_camera(cam);
+			cam = camera_with_dims(width, height);
+			logger_printf(loader_logger(&ldr), LOGGER_INFO,
+				"Drawing the scene at %dx%d for a %dx%d area\n",
+				width, height, area.width, area.height);
+			rescaled = false;
+		}
 		int remaining = get_remaining(&ents);
 		// Player wins if all targets gone and they are not, or if they
 		// won already:
 		won = won || (remaining <= 0 && !player_is_dead(&player));
 		bool lost = !won && player_is_dead(&player);
+		// Display the popup for the current state if possible:
+		if (dead) {
+			output_popup(&out, dead_msg);
+		} else if (!lost && quitting) {
+			output_popup(&out, quit_msg);
+		} else if (!lost && paused) {
+			output_popup(&out, pause_msg);
+		} else {
+			output_popup(&out, NULL);
+		}
 		if (do_redraw) {
+			long long start = ticker_usec();
 			d3d_draw(cam, player.body.pos, player.facing, board,
 				ents_num(&ents), ents_sprites(&ents));
-			display_frame(cam, &area, loader_color_map(&ldr));
+			output_present(&out, cam, &area);
+			rescaled = DYNAMIC_RESOLUTION && render_scale_measure(
+				&scale, (long)(ticker_usec() - start));
+			if (rec) recorder_add(rec, cam);
+			if (spec) spectate_publish(spec, cam);
 			health_meter.fraction = player_health_fraction(&player);
-			meter_draw(&health_meter);
+			output_meter(&out, &health_meter);
 			reload_meter.fraction = player_reload_fraction(&player);
-			meter_draw(&reload_meter);
-			attron(A_BOLD);
+			output_meter(&out, &reload_meter);
 			if (won) {
-				mvaddstr(0, 0,
+				output_text(&out, 0, 0, A_BOLD,
 					"YOU WIN! Press Y to return to menu.");
 			} else {
-				mvprintw(0, 0, "TARGETS LEFT: %d", remaining);
+				char targets[32];
+				snprintf(targets, sizeof(targets),
+					"TARGETS LEFT: %d", remaining);
+				output_text(&out, 0, 0, A_BOLD, targets);
 			}
-			attroff(A_BOLD);
-			refresh();
 		}
 		do_redraw = resized;
-		if (dead_popup) {
-			// Display the death popup if possible.
-			touchwin(dead_popup);
-			wrefresh(dead_popup);
+		output_flush(&out);
+		if (dead) {
+			// The game goes on under the death popup.
 		} else if (!lost && quitting) {
-			if (quit_popup) {
-				// Display the quit popup if possible.
-				touchwin(quit_popup);
-				wrefresh(quit_popup);
-			}
 			switch (lowkey) {
 			case 'y':
 				goto quit;
 			case 'n':
-				if (quit_popup) {
-					delwin(quit_popup);
-					quit_popup = NULL;
-					touchwin(stdscr);
-					do_redraw = true;
-				}
+				do_redraw = true;
 				quitting = false;
 				break;
 			}
 			continue;
 		} else if (!lost && paused) {
-			if (pause_popup) {
-				// Display the pause popup if possible.
-				touchwin(pause_popup);
-				wrefresh(pause_popup);
-			}
 			switch (lowkey) {
 			case 'p':
-				if (pause_popup) {
-					delwin(pause_popup);
-					pause_popup = NULL;
-					touchwin(stdscr);
-					do_redraw = true;
-				}
+				do_redraw = true;
 				paused = false;
 				break;
 			case 'x':
-				quit_popup = popup_window(quit_msg);
+				do_redraw = true;
 				quitting = true;
 				break;
 			}
@@ -341,14 +445,12 @@ int play_level(const char *root_dir, struct save_state *save,
 		} else if (lost) {
 			// Player lost, entities still simulated. Y to quit.
 			if (lowkey == 'y') goto quit;
-			if (!dead_popup) dead_popup = popup_window(dead_msg);
+			dead = true;
 		} else if (lowkey == 'p') {
 			paused = true;
-			pause_popup = popup_window(pause_msg);
 			continue;
 		} else if (lowkey == 'x' || key == ESC) {
 			quitting = true;
-			quit_popup = popup_window(quit_msg);
 			continue;
 		} else {
 			// Otherwise, let the player be controlled.
@@ -363,7 +465,7 @@ int play_level(const char *root_dir, struct save_state *save,
 		// if the player is dead:
 		if (key != lowkey || key == ' ')
 			player_try_shoot(&player, &ents);
-		shoot_bullets(&ents);
+		shoot_bullets(&ents, board, &player);
 		player_tick(&player);
 		ents_tick(&ents);
 		ents_clean_up_dead(&ents);
@@ -371,10 +473,8 @@ int play_level(const char *root_dir, struct save_state *save,
 quit:
 	clear();
 	refresh();
-	if (pause_popup) delwin(pause_popup);
-	if (quit_popup) delwin(quit_popup);
-	if (dead_popup) delwin(dead_popup);
 	d3d_free_camera(cam);
+	output_destroy(&out);
 	// Record the player's winning:
 	if (won) save_state_mark_complete(save, map_name);
 	ents_destroy(&ents);
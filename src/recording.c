@@ -0,0 +1,602 @@
+#include "recording.h"
+#include "grow.h"
+#include "ticker.h"
+#include "xalloc.h"
+#include <errno.h>
+#include <string.h>
+
+#ifdef _WIN32
+#	include <io.h>
+#	define ftruncate _chsize
+#else
+#	include <unistd.h>
+#endif
+
+// Runs of changed pixels closer together than this are written as one, since
+// the pixels between cost no more than starting a new run.
+#define RUN_MERGE_GAP 3
+
+static void put_u16(unsigned char *at, unsigned long num)
+{
+	at[0] = num & 0xFF;
+	at[1] = num >> 8 & 0xFF;
+}
+
+static void put_u32(unsigned char *at, unsigned long num)
+{
+	put_u16(at, num & 0xFFFF);
+	put_u16(at + 2, num >> 16 & 0xFFFF);
+}
+
+static unsigned long get_u16(const unsigned char *at)
+{
+	return at[0] | (unsigned long)at[1] << 8;
+}
+
+static unsigned long get_u32(const unsigned char *at)
+{
+	return get_u16(at) | get_u16(at + 2) << 16;
+}
+
+static void put_varint(struct recorder *rec, size_t num)
+{
+	do {
+		unsigned char byte = num & 0x7F;
+		num >>= 7;
+		if (num > 0) byte |= 0x80;
+		*growc(&rec->data, &rec->len, &rec->cap, 1) = byte;
+	} while (num > 0);
+}
+
+// Read a varint from the data at *at, before end. *at is moved past it. false
+// is returned if the data ends first or the number is too big.
+static bool get_varint(const unsigned char **at, const unsigned char *end,
+	size_t *num)
+{
+	*num = 0;
+	for (int shift = 0; *at < end && shift < 32; shift += 7) {
+		unsigned char byte = *(*at)++;
+		*num |= (size_t)(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) return true;
+	}
+	return false;
+}
+
+static void put_pixels(struct recorder *rec, const d3d_pixel *pixels, size_t n)
+{
+	char *to = growc(&rec->data, &rec->len, &rec->cap, n);
+	if (sizeof(*pixels) == 1) {
+		memcpy(to, pixels, n);
+		return;
+	}
+	for (size_t i = 0; i < n; ++i) {
+		to[i] = (unsigned char)pixels[i];
+	}
+}
+
+// Find the first pixel from i on where the frames differ, or n if there is
+// none. Whole words are compared where possible.
+static size_t next_change(const d3d_pixel *a, const d3d_pixel *b, size_t i,
+	size_t n)
+{
+	size_t word = sizeof(size_t) / sizeof(*a);
+	for (; i + word <= n; i += word) {
+		size_t wa, wb;
+		memcpy(&wa, a + i, sizeof(wa));
+		memcpy(&wb, b + i, sizeof(wb));
+		if (wa != wb) break;
+	}
+	while (i < n && a[i] == b[i]) {
+		++i;
+	}
+	return i;
+}
+
+// Put the runs of pixels that differ from the last frame.
+static void put_delta(struct recorder *rec, const d3d_pixel *pixels, size_t n)
+{
+	size_t end = 0;
+	size_t start;
+	while ((start = next_change(rec->last, pixels, end, n)) < n) {
+		put_varint(rec, start - end);
+		end = start + 1;
+		// Extend the run while the changes are close together:
+		size_t next;
+		while (end < n && (next = next_change(rec->last, pixels, end, n))
+			< n && next - end < RUN_MERGE_GAP)
+		{
+			end = next + 1;
+		}
+		put_varint(rec, end - start);
+		put_pixels(rec, pixels + start, end - start);
+	}
+}
+
+// Cut off an incomplete frame record at the end of the recording in the file,
+// as left by a game killed while writing it, so that more can be added after
+// the complete ones. A file holding only the start of the magic bytes is made
+// empty. -1 is returned if the file is not a recording or on error, with errno
+// set. Anything else after the complete records is taken to mean the file is
+// not a recording, so that it is never cut.
+static int cut_incomplete(FILE *file)
+{
+	if (fseek(file, 0, SEEK_END)) return -1;
+	long size = ftell(file);
+	if (size < 0) return -1;
+	rewind(file);
+	char magic[sizeof(RECORDING_MAGIC) - 1];
+	size_t n_magic = fread(magic, 1, sizeof(magic), file);
+	if (ferror(file)) return -1;
+	if (memcmp(magic, RECORDING_MAGIC, n_magic)) goto not_recording;
+	long end = 0;
+	if (n_magic == sizeof(magic)) {
+		end = sizeof(magic);
+		unsigned char header[RECORDING_HEADER_SIZE];
+		while (size - end >= RECORDING_HEADER_SIZE) {
+			if (fread(header, sizeof(header), 1, file) != 1) return -1;
+			if (header[0] != 'K' && header[0] != 'D') goto not_recording;
+			unsigned long record_size = RECORDING_HEADER_SIZE
+				+ get_u32(header + 1);
+			// Only the last record can run past the end:
+			if (record_size > (unsigned long)(size - end)) break;
+			end += record_size;
+			if (fseek(file, end, SEEK_SET)) return -1;
+		}
+	}
+	if (end < size && ftruncate(fileno(file), end)) return -1;
+	return fseek(file, end, SEEK_SET);
+
+not_recording:
+	errno = EINVAL;
+	return -1;
+}
+
+int recorder_open(struct recorder *rec, const char *path)
+{
+	FILE *file = fopen(path, "r+b");
+	if (!file && errno == ENOENT) file = fopen(path, "w+b");
+	if (!file) return -1;
+	if (cut_incomplete(file)) {
+		int err = errno;
+		fclose(file);
+		errno = err;
+		return -1;
+	}
+	recorder_init(rec, file);
+	return 0;
+}
+
+void recorder_init(struct recorder *rec, FILE *file)
+{
+	rec->file = file;
+	// An empty file gets the magic bytes first:
+	if (file) {
+		fseek(file, 0, SEEK_END);
+		if (ftell(file) == 0) fputs(RECORDING_MAGIC, file);
+	}
+	rec->last = NULL;
+	rec->width = rec->height = 0;
+	rec->n_deltas = 0;
+	rec->start_usec = -1;
+	rec->data = NULL;
+	rec->len = rec->cap = 0;
+}
+
+const char *recorder_encode(struct recorder *rec, const d3d_camera *cam,
+	size_t *size)
+{
+	long long now = ticker_usec();
+	if (rec->start_usec < 0) rec->start_usec = now;
+	size_t width = d3d_camera_width(cam), height = d3d_camera_height(cam);
+	size_t n = width * height;
+	const d3d_pixel *pixels = d3d_camera_pixels(cam);
+	char kind;
+	// The header is filled in once the size of the data is known:
+	rec->len = 0;
+	growc(&rec->data, &rec->len, &rec->cap, RECORDING_HEADER_SIZE);
+	if (width != rec->width || height != rec->height
+	 || rec->n_deltas >= RECORDING_KEYFRAME_INTERVAL - 1) {
+		kind = 'K';
+		put_pixels(rec, pixels, n);
+		if (n > rec->width * rec->height)
+			rec->last = xrealloc(rec->last, n * sizeof(*rec->last));
+		rec->width = width;
+		rec->height = height;
+		rec->n_deltas = 0;
+	} else {
+		kind = 'D';
+		put_delta(rec, pixels, n);
+		++rec->n_deltas;
+	}
+	memcpy(rec->last, pixels, n * sizeof(*pixels));
+	unsigned char *header = (unsigned char *)rec->data;
+	header[0] = kind;
+	put_u32(header + 1, rec->len - RECORDING_HEADER_SIZE);
+	put_u32(header + 5, (unsigned long)((now - rec->start_usec) / 1000));
+	put_u16(header + 9, width);
+	put_u16(header + 11, height);
+	*size = rec->len;
+	return rec->data;
+}
+
+void recorder_force_keyframe(struct recorder *rec)
+{
+	rec->n_deltas = RECORDING_KEYFRAME_INTERVAL;
+}
+
+void recorder_add(struct recorder *rec, const d3d_camera *cam)
+{
+	size_t size;
+	const char *record = recorder_encode(rec, cam, &size);
+	fwrite(record, 1, size, rec->file);
+	// The record reaches the file even if the game is killed later:
+	fflush(rec->file);
+}
+
+int recorder_close(struct recorder *rec)
+{
+	int ret = 0;
+	if (rec->file) {
+		if (ferror(rec->file)) ret = -1;
+		if (fclose(rec->file)) ret = -1;
+	}
+	free(rec->last);
+	free(rec->data);
+	return ret;
+}
+
+int recording_open(struct recording *rec, const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file) return -1;
+	return recording_init(rec, file);
+}
+
+void recording_init_stream(struct recording *rec)
+{
+	rec->file = NULL;
+	rec->pixels = NULL;
+	rec->width = rec->height = 0;
+	rec->msec = 0;
+	rec->frame = -1;
+	rec->keyframes = NULL;
+	rec->n_keyframes = rec->keyframes_cap = 0;
+	rec->data = NULL;
+	rec->data_cap = 0;
+}
+
+int recording_init(struct recording *rec, FILE *file)
+{
+	char magic[sizeof(RECORDING_MAGIC) - 1];
+	recording_init_stream(rec);
+	rec->file = file;
+	if (fread(magic, sizeof(magic), 1, file) != 1
+	 || memcmp(magic, RECORDING_MAGIC, sizeof(magic))) {
+		recording_close(rec);
+		errno = 0;
+		return -1;
+	}
+	return 0;
+}
+
+// Apply the runs of a delta to the current frame. false is returned if they
+// don't fit in it.
+static bool apply_delta(struct recording *rec, const unsigned char *data,
+	size_t size)
+{
+	const unsigned char *at = data;
+	const unsigned char *end = at + size;
+	size_t n = rec->width * rec->height;
+	size_t i = 0;
+	while (at < end) {
+		size_t skip, len;
+		if (!get_varint(&at, end, &skip) || !get_varint(&at, end, &len)
+		 || skip > n - i || len > n - i - skip
+		 || len > (size_t)(end - at))
+			return false;
+		i += skip;
+		for (size_t j = 0; j < len; ++j) {
+			rec->pixels[i++] = *at++;
+		}
+	}
+	return true;
+}
+
+// Make the frame record with the header and data the current frame. The record
+// is at the offset in the file, or is not in a file if that is negative. 1 is
+// returned, or -1 if the record is broken.
+static int decode_record(struct recording *rec, const unsigned char *header,
+	const unsigned char *data, long offset)
+{
+	char kind = header[0];
+	size_t size = get_u32(header + 1);
+	size_t width = get_u16(header + 9), height = get_u16(header + 11);
+	if (kind == 'K') {
+		if (size != width * height) return -1;
+		if (size > rec->width * rec->height) {
+			rec->pixels = xrealloc(rec->pixels,
+				size * sizeof(*rec->pixels));
+		}
+		rec->width = width;
+		rec->height = height;
+		for (size_t i = 0; i < size; ++i) {
+			rec->pixels[i] = data[i];
+		}
+		if (offset >= 0 && (rec->n_keyframes == 0
+		 || rec->keyframes[rec->n_keyframes - 1].frame <= rec->frame))
+		{
+			struct recording_keyframe *key = GROWE(rec->keyframes,
+				rec->n_keyframes, rec->keyframes_cap);
+			key->offset = offset;
+			key->frame = rec->frame + 1;
+		}
+	} else if (kind == 'D') {
+		if (rec->frame < 0 || width != rec->width
+		 || height != rec->height || !apply_delta(rec, data, size))
+			return -1;
+	} else {
+		return -1;
+	}
+	rec->msec = get_u32(header + 5);
+	++rec->frame;
+	return 1;
+}
+
+int recording_next(struct recording *rec)
+{
+	long offset = ftell(rec->file);
+	unsigned char header[RECORDING_HEADER_SIZE];
+	size_t got = fread(header, 1, sizeof(header), rec->file);
+	if (got < sizeof(header)) goto end;
+	size_t size = get_u32(header + 1);
+	if (size > rec->data_cap) {
+		rec->data = xrealloc(rec->data, size);
+		rec->data_cap = size;
+	}
+	if (fread(rec->data, 1, size, rec->file) < size) goto end;
+	return decode_record(rec, header, (unsigned char *)rec->data, offset);
+
+end:
+	// A frame cut short by the game stopping counts as the end. The file
+	// is left where it was so this keeps happening:
+	if (ferror(rec->file)) return -1;
+	fseek(rec->file, offset, SEEK_SET);
+	return 0;
+}
+
+int recording_seek(struct recording *rec, long frame)
+{
+	if (frame < 0) frame = 0;
+	// Start from the last keyframe known before the frame, unless reading
+	// on from the current frame is quicker:
+	const struct recording_keyframe *from = NULL;
+	for (size_t i = 0; i < rec->n_keyframes; ++i) {
+		if (rec->keyframes[i].frame > frame) break;
+		from = &rec->keyframes[i];
+	}
+	if (from && (frame <= rec->frame || from->frame > rec->frame)) {
+		if (fseek(rec->file, from->offset, SEEK_SET)) return -1;
+		rec->frame = from->frame - 1;
+	}
+	int ret = 1;
+	while (rec->frame < frame && (ret = recording_next(rec)) > 0) {
+	}
+	return ret < 0 ? -1 : rec->frame >= 0;
+}
+
+long recording_feed(struct recording *rec, const char *bytes, size_t size)
+{
+	const unsigned char *header = (const unsigned char *)bytes;
+	if (size < RECORDING_HEADER_SIZE) return 0;
+	size_t data_size = get_u32(header + 1);
+	if (size - RECORDING_HEADER_SIZE < data_size) return 0;
+	if (decode_record(rec, header, header + RECORDING_HEADER_SIZE, -1) < 0)
+		return -1;
+	return RECORDING_HEADER_SIZE + data_size;
+}
+
+void recording_close(struct recording *rec)
+{
+	if (rec->file) fclose(rec->file);
+	free(rec->pixels);
+	free(rec->keyframes);
+	free(rec->data);
+}
+
+#if CTF_TESTS_ENABLED
+
+#	include "libctf.h"
+#	include <assert.h>
+#	include <unistd.h>
+
+// Draw frame number f of the test recording on the camera. Only a column and a
+// row change from frame to frame.
+static void draw_test_frame(d3d_camera *cam, int f)
+{
+	size_t width = d3d_camera_width(cam), height = d3d_camera_height(cam);
+	for (size_t x = 0; x < width; ++x) {
+		for (size_t y = 0; y < height; ++y) {
+			bool moving = x == f % width || y == f / 2 % height;
+			*d3d_camera_get(cam, x, y) =
+				(x * 7 + y * 3 + (moving ? f : 0)) % 64;
+		}
+	}
+}
+
+static bool test_frame_matches(const struct recording *in, d3d_camera *cam,
+	int f)
+{
+	draw_test_frame(cam, f);
+	size_t width = d3d_camera_width(cam), height = d3d_camera_height(cam);
+	return in->width == width && in->height == height
+		&& !memcmp(in->pixels, d3d_camera_pixels(cam),
+			width * height * sizeof(*in->pixels));
+}
+
+CTF_TEST(recording_reads_back_frames,
+	// The recording is read back through a copy of the file descriptor,
+	// since the recorder closes its file:
+	FILE *file = tmpfile();
+	assert(file);
+	int fd = dup(fileno(file));
+	assert(fd >= 0);
+	d3d_camera *cam = d3d_new_camera(1, 1, 5, 4, 0);
+	d3d_camera *small = d3d_new_camera(1, 1, 3, 2, 0);
+	assert(cam && small);
+	int n_frames = RECORDING_KEYFRAME_INTERVAL * 2 + 10;
+	struct recorder out;
+	recorder_init(&out, file);
+	for (int f = 0; f < n_frames; ++f) {
+		d3d_camera *drawn = f == 7 ? small : cam;
+		draw_test_frame(drawn, f);
+		recorder_add(&out, drawn);
+	}
+	assert(!recorder_close(&out));
+	struct recording in;
+	file = fdopen(fd, "rb");
+	assert(file);
+	rewind(file);
+	assert(!recording_init(&in, file));
+	for (int f = 0; f < n_frames; ++f) {
+		assert(recording_next(&in) == 1);
+		assert(in.frame == f);
+		assert(test_frame_matches(&in, f == 7 ? small : cam, f));
+	}
+	assert(recording_next(&in) == 0);
+	// Keyframes at the start, around the size change, and periodically:
+	assert(in.n_keyframes == 5);
+	assert(recording_seek(&in, 20) == 1);
+	assert(in.frame == 20);
+	assert(test_frame_matches(&in, cam, 20));
+	assert(recording_seek(&in, 7) == 1);
+	assert(test_frame_matches(&in, small, 7));
+	assert(recording_seek(&in, n_frames * 2) == 1);
+	assert(in.frame == n_frames - 1);
+	assert(test_frame_matches(&in, cam, n_frames - 1));
+	recording_close(&in);
+	d3d_free_camera(cam);
+	d3d_free_camera(small);
+)
+
+CTF_TEST(recording_fed_whole_records,
+	d3d_camera *cam = d3d_new_camera(1, 1, 5, 4, 0);
+	assert(cam);
+	struct recorder out;
+	recorder_init(&out, NULL);
+	struct recording in;
+	recording_init_stream(&in);
+	for (int f = 0; f < 3; ++f) {
+		draw_test_frame(cam, f);
+		size_t size;
+		const char *record = recorder_encode(&out, cam, &size);
+		// Only whole records are taken:
+		assert(recording_feed(&in, record, RECORDING_HEADER_SIZE - 1)
+			== 0);
+		assert(recording_feed(&in, record, size - 1) == 0);
+		assert(in.frame == f - 1);
+		assert(recording_feed(&in, record, size) == (long)size);
+		assert(in.frame == f);
+		assert(test_frame_matches(&in, cam, f));
+	}
+	// A delta that does not fit the frame is broken:
+	unsigned char broken[RECORDING_HEADER_SIZE + 2] = { 'D', 2 };
+	put_u16(broken + 9, 5);
+	put_u16(broken + 11, 4);
+	broken[RECORDING_HEADER_SIZE] = 30;
+	broken[RECORDING_HEADER_SIZE + 1] = 1;
+	assert(recording_feed(&in, (char *)broken, sizeof(broken)) == -1);
+	broken[0] = 'X';
+	assert(recording_feed(&in, (char *)broken, sizeof(broken)) == -1);
+	recording_close(&in);
+	assert(!recorder_close(&out));
+	d3d_free_camera(cam);
+)
+
+CTF_TEST(recording_cut_short_is_added_to_cleanly,
+	FILE *file = tmpfile();
+	assert(file);
+	int fd = dup(fileno(file));
+	assert(fd >= 0);
+	d3d_camera *cam = d3d_new_camera(1, 1, 5, 4, 0);
+	assert(cam);
+	struct recorder out;
+	recorder_init(&out, file);
+	for (int f = 0; f < 3; ++f) {
+		draw_test_frame(cam, f);
+		recorder_add(&out, cam);
+	}
+	// The game is killed partway through writing the next frame:
+	draw_test_frame(cam, 3);
+	size_t size;
+	const char *record = recorder_encode(&out, cam, &size);
+	assert(fwrite(record, 1, size - 2, file) == size - 2);
+	assert(!recorder_close(&out));
+	file = fdopen(fd, "r+b");
+	assert(file);
+	fd = dup(fileno(file));
+	assert(fd >= 0);
+	assert(!cut_incomplete(file));
+	recorder_init(&out, file);
+	for (int f = 3; f < 6; ++f) {
+		draw_test_frame(cam, f);
+		recorder_add(&out, cam);
+	}
+	assert(!recorder_close(&out));
+	struct recording in;
+	file = fdopen(fd, "rb");
+	assert(file);
+	rewind(file);
+	assert(!recording_init(&in, file));
+	for (int f = 0; f < 6; ++f) {
+		assert(recording_next(&in) == 1);
+		assert(test_frame_matches(&in, cam, f));
+	}
+	assert(recording_next(&in) == 0);
+	recording_close(&in);
+	d3d_free_camera(cam);
+)
+
+CTF_TEST(recording_cut_keeps_other_files,
+	FILE *file = tmpfile();
+	assert(file);
+	fputs("Not a recording", file);
+	assert(cut_incomplete(file) == -1);
+	assert(errno == EINVAL);
+	// Too short to be anything but the start of the magic bytes:
+	assert(!fseek(file, 0, SEEK_SET));
+	assert(!ftruncate(fileno(file), 0));
+	fputs("TS3", file);
+	assert(!cut_incomplete(file));
+	assert(ftell(file) == 0);
+	// Short, but not the start of the magic bytes:
+	fputs("todo\n", file);
+	assert(cut_incomplete(file) == -1);
+	assert(errno == EINVAL);
+	assert(!fseek(file, 0, SEEK_END));
+	assert(ftell(file) == 5);
+	// A recording with a broken record in the middle:
+	assert(!fseek(file, 0, SEEK_SET));
+	assert(!ftruncate(fileno(file), 0));
+	d3d_camera *cam = d3d_new_camera(1, 1, 5, 4, 0);
+	assert(cam);
+	struct recorder out;
+	recorder_init(&out, file);
+	for (int f = 0; f < 3; ++f) {
+		draw_test_frame(cam, f);
+		recorder_add(&out, cam);
+	}
+	long size = ftell(file);
+	assert(!fseek(file, sizeof(RECORDING_MAGIC) - 1, SEEK_SET));
+	unsigned char header[RECORDING_HEADER_SIZE];
+	assert(fread(header, sizeof(header), 1, file) == 1);
+	assert(!fseek(file, get_u32(header + 1), SEEK_CUR));
+	assert(fputc('X', file) == 'X');
+	assert(cut_incomplete(file) == -1);
+	assert(errno == EINVAL);
+	assert(!fseek(file, 0, SEEK_END));
+	assert(ftell(file) == size);
+	assert(!recorder_close(&out));
+	d3d_free_camera(cam);
+)
+
+#endif /* CTF_TESTS_ENABLED */
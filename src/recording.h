@@ -0,0 +1,140 @@
+#ifndef RECORDING_H_
+#define RECORDING_H_
+
+// Recordings of the frames of the 3D scene shown while playing. A recording
+// file starts with the eight bytes RECORDING_MAGIC, followed by any number of
+// frame records. A frame record has a header of 13 bytes:
+//
+//   kind     1 byte   'K' for a keyframe or 'D' for a delta
+//   size     4 bytes  the number of bytes of data after the header
+//   msec     4 bytes  milliseconds since the recorder started
+//   width    2 bytes  the width of the frame in pixels
+//   height   2 bytes  the height of the frame in pixels
+//
+// All numbers are unsigned and little-endian. The data of a keyframe is the
+// frame's pixels, one byte each, in the column-major order of d3d cameras. The
+// data of a delta is a list of runs of pixels that changed since the previous
+// frame, which is always the same size. Each run is the number of pixels
+// skipped since the end of the last run, the number of pixels in the run, and
+// the pixels. Both numbers are varints: seven bits at a time, least significant
+// first, with the top bit set on every byte but the last.
+//
+// Keyframes come every RECORDING_KEYFRAME_INTERVAL frames and whenever the size
+// changes, so a reader can start at any of them. Recordings appended to the
+// same file simply follow one another, starting with a keyframe; their times
+// start over.
+
+#include "d3d.h"
+#include <stdbool.h>
+#include <stdio.h>
+
+// The bytes at the start of a recording file.
+#define RECORDING_MAGIC "TS3DREC1"
+
+// The size in bytes of a frame record header.
+#define RECORDING_HEADER_SIZE 13
+
+// The maximum number of frames between keyframes.
+#define RECORDING_KEYFRAME_INTERVAL 150
+
+// Something that writes frames to a recording file. The fields are private.
+struct recorder {
+	FILE *file;
+	// The last frame written and its size. The width is 0 if there is none.
+	d3d_pixel *last;
+	size_t width, height;
+	// The number of deltas written since the last keyframe.
+	int n_deltas;
+	// When the first frame was written, in microseconds as from ticker_usec.
+	long long start_usec;
+	// The data of the frame record being built.
+	char *data;
+	size_t len, cap;
+};
+
+// Start recording to the file at the path, adding to the end of any recording
+// already there. An incomplete frame record at the end of it, as left by a game
+// that was killed, is cut off first. -1 is returned if the file couldn't be
+// opened or isn't a recording, with errno set.
+int recorder_open(struct recorder *rec, const char *path);
+
+// Start recording to the open file, which must be at its start or at the end
+// of a recording. The file is closed when the recorder is. If the file is NULL,
+// frames can only be encoded with recorder_encode.
+void recorder_init(struct recorder *rec, FILE *file);
+
+// Write the camera's current scene to the recording. The record is flushed to
+// the file right away, so that a game killed while recording leaves at most one
+// incomplete record at the end.
+void recorder_add(struct recorder *rec, const d3d_camera *cam);
+
+// Encode the frame record of the camera's current scene like recorder_add, but
+// return it instead of writing it. Its size is put in size. The record lasts
+// until the next frame is encoded.
+const char *recorder_encode(struct recorder *rec, const d3d_camera *cam,
+	size_t *size);
+
+// Make the next frame recorded a keyframe.
+void recorder_force_keyframe(struct recorder *rec);
+
+// Write everything buffered and close the file. -1 is returned if an error ever
+// happened writing.
+int recorder_close(struct recorder *rec);
+
+// Something that reads frames from a recording file. The fields besides the
+// public ones are private.
+struct recording {
+	// The current frame read, its size, and its time in milliseconds.
+	d3d_pixel *pixels;
+	size_t width, height;
+	unsigned long msec;
+	// The number of the current frame, counting from 0 at the start of the
+	// file. This is -1 before the first frame is read.
+	long frame;
+	FILE *file;
+	// The file offsets and frame numbers of the keyframes found so far.
+	struct recording_keyframe {
+		long offset;
+		long frame;
+	} *keyframes;
+	size_t n_keyframes, keyframes_cap;
+	// The data of the frame record being read.
+	char *data;
+	size_t data_cap;
+};
+
+// Open the recording at the path. -1 is returned if the file couldn't be opened
+// or isn't a recording, with errno set in the first case.
+int recording_open(struct recording *rec, const char *path);
+
+// Read the recording from the open file, which is at its start. -1 is returned
+// if it isn't a recording. The file is closed when the recording is, even on
+// failure.
+int recording_init(struct recording *rec, FILE *file);
+
+// Start reading a recording that is given record by record with recording_feed,
+// such as one coming over a stream. The magic bytes must be checked by the
+// caller.
+void recording_init_stream(struct recording *rec);
+
+// Make the frame record at the start of the bytes the current frame. The number
+// of bytes in the record is returned, 0 if they don't hold a whole record, or
+// -1 if the record is broken. Seeking is not possible in a recording read this
+// way.
+long recording_feed(struct recording *rec, const char *bytes, size_t size);
+
+// Read the next frame. 1 is returned if a frame was read, 0 at the end of the
+// file, and -1 if the file is broken. A last frame cut short, as by the game
+// being killed, counts as the end.
+int recording_next(struct recording *rec);
+
+// Go to the given frame number, or to the last one if there are not that many.
+// Decoding starts from the closest keyframe before it. 1 is returned if there is
+// a current frame afterward, 0 if the recording has no frames, and -1 if the
+// file is broken.
+int recording_seek(struct recording *rec, long frame);
+
+// Free resources associated with the recording and close its file.
+void recording_close(struct recording *rec);
+
+#endif /* RECORDING_H_ */
@@ -0,0 +1,88 @@
+#include "render-scale.h"
+
+// The smallest fraction the resolution goes down to, in steps.
+#define MIN_STEPS 2
+
+// A new resolution is given this many frames to show how long it takes before
+// the resolution changes again. This keeps the resolution from flickering.
+#define SETTLE_FRAMES 10
+
+// How much weight each frame gets in the average time per frame.
+#define SMOOTHING 0.2
+
+// The resolution is only raised if the frames are expected to take at most this
+// fraction of the budget afterward.
+#define RAISE_MARGIN 0.8
+
+void render_scale_init(struct render_scale *rs, long budget_usec)
+{
+	rs->steps = RENDER_SCALE_STEPS;
+	rs->avg_usec = -1;
+	rs->n_frames = 0;
+	rs->budget_usec = budget_usec;
+}
+
+bool render_scale_measure(struct render_scale *rs, long usec)
+{
+	if (rs->avg_usec < 0) {
+		rs->avg_usec = usec;
+	} else {
+		rs->avg_usec += (usec - rs->avg_usec) * SMOOTHING;
+	}
+	if (++rs->n_frames < SETTLE_FRAMES) return false;
+	int steps = rs->steps;
+	// The time is about proportional to the number of pixels:
+	double per_pixel = rs->avg_usec / ((double)steps * steps);
+	if (rs->avg_usec > rs->budget_usec) {
+		while (steps > MIN_STEPS
+		    && per_pixel * steps * steps > rs->budget_usec)
+			--steps;
+	} else if (steps < RENDER_SCALE_STEPS
+	        && per_pixel * (steps + 1) * (steps + 1)
+	           <= rs->budget_usec * RAISE_MARGIN) {
+		++steps;
+	}
+	if (steps == rs->steps) return false;
+	rs->steps = steps;
+	rs->avg_usec = -1;
+	rs->n_frames = 0;
+	return true;
+}
+
+void render_scale_dims(const struct render_scale *rs, int full_width,
+	int full_height, int *width, int *height)
+{
+	*width = full_width * rs->steps / RENDER_SCALE_STEPS;
+	*height = full_height * rs->steps / RENDER_SCALE_STEPS;
+	if (*width < 1) *width = 1;
+	if (*height < 1) *height = 1;
+}
+
+#if CTF_TESTS_ENABLED
+
+#	include "libctf.h"
+#	include <assert.h>
+
+CTF_TEST(render_scale_follows_frame_time,
+	struct render_scale rs;
+	int width, height;
+	render_scale_init(&rs, 10000);
+	// Frames well over budget make the resolution drop all at once:
+	for (int i = 0; i < SETTLE_FRAMES - 1; ++i) {
+		assert(!render_scale_measure(&rs, 40000));
+	}
+	assert(render_scale_measure(&rs, 40000));
+	render_scale_dims(&rs, 160, 48, &width, &height);
+	assert(width == 80 && height == 24);
+	// Fast frames raise it one step at a time, after settling:
+	for (int i = 0; i < SETTLE_FRAMES - 1; ++i) {
+		assert(!render_scale_measure(&rs, 1000));
+	}
+	assert(render_scale_measure(&rs, 1000));
+	render_scale_dims(&rs, 160, 48, &width, &height);
+	assert(width == 100 && height == 30);
+	render_scale_dims(&rs, 1, 1, &width, &height);
+	assert(width == 1 && height == 1);
+)
+
+#endif /* CTF_TESTS_ENABLED */
@@ -0,0 +1,39 @@
+#ifndef RENDER_SCALE_H_
+#define RENDER_SCALE_H_
+
+#include <stdbool.h>
+
+// The resolution the 3D scene is drawn at, as a fraction of the screen area it
+// is shown in. The fraction goes down when frames take longer than a budget and
+// back up when there is time to spare. The fields are private.
+struct render_scale {
+	// The fraction of the full width and height drawn, in steps of
+	// 1/RENDER_SCALE_STEPS.
+	int steps;
+	// The smoothed time per frame in microseconds, or negative if no frame
+	// has been measured at the current resolution.
+	double avg_usec;
+	// The number of frames measured at the current resolution.
+	int n_frames;
+	// The budget for a frame in microseconds.
+	long budget_usec;
+};
+
+// The resolution is changed in steps of one part in this many.
+#define RENDER_SCALE_STEPS 8
+
+// Start drawing at full resolution with the given budget per frame.
+void render_scale_init(struct render_scale *rs, long budget_usec);
+
+// Record that a frame took usec microseconds to draw and show. Returned is
+// whether the resolution changed. It only ever changes here, so a caller who
+// allocates a camera of the new size before the next frame never changes the
+// size of a frame partway through.
+bool render_scale_measure(struct render_scale *rs, long usec);
+
+// Get the dimensions to draw at for a screen area of the given size. They are
+// always at least 1.
+void render_scale_dims(const struct render_scale *rs, int full_width,
+	int full_height, int *width, int *height);
+
+#endif /* RENDER_SCALE_H_ */
@@ -0,0 +1,398 @@
+#include "replay.h"
+#include "config.h"
+#include "grow.h"
+#include "logger.h"
+#include "output.h"
+#include "pixel.h"
+#include "recording.h"
+#include "spectate.h"
+#include "ticker.h"
+#include "ui-util.h"
+#include "util.h"
+#include "xalloc.h"
+#include <curses.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// The arrow keys seek this many frames back or forward.
+#define SEEK_FRAMES 100
+
+// Pauses in the recording longer than this many milliseconds, such as the time
+// spent in the menus between levels, are skipped.
+#define MAX_GAP_MSEC 1000
+
+// The slowest and fastest speeds the viewer can choose.
+#define MIN_SPEED (1.0 / 64)
+#define MAX_SPEED 64.0
+
+// How many bytes a spectator reads from the game at a time.
+#define READ_SIZE 65536
+
+// The colors the exported images use for pixel colors, as RGB.
+static const unsigned char palette[8][3] = {
+	[PC_BLACK] = { 0, 0, 0 },
+	[PC_RED] = { 205, 0, 0 },
+	[PC_GREEN] = { 0, 205, 0 },
+	[PC_YELLOW] = { 205, 205, 0 },
+	[PC_BLUE] = { 0, 0, 238 },
+	[PC_MAGENTA] = { 205, 0, 205 },
+	[PC_CYAN] = { 0, 205, 205 },
+	[PC_WHITE] = { 229, 229, 229 },
+};
+
+static int open_recording(struct recording *rec, const char *path,
+	struct logger *log)
+{
+	if (recording_open(rec, path)) {
+		logger_printf(log, LOGGER_ERROR, "Cannot read recording %s: %s\n",
+			path, errno ? strerror(errno) : "Not a recording");
+		return -1;
+	}
+	return 0;
+}
+
+// Put the recording's current frame in the camera, replacing the camera if it
+// is not the right size. The camera is returned.
+static d3d_camera *take_frame(d3d_camera *cam, const struct recording *rec)
+{
+	if (!cam || d3d_camera_width(cam) != rec->width
+	 || d3d_camera_height(cam) != rec->height) {
+		d3d_free_camera(cam);
+		cam = assert_alloc(d3d_new_camera(1, 1, rec->width, rec->height,
+			0));
+	}
+	for (size_t x = 0; x < rec->width; ++x) {
+		for (size_t y = 0; y < rec->height; ++y) {
+			*d3d_camera_get(cam, x, y) =
+				rec->pixels[y + x * rec->height];
+		}
+	}
+	return cam;
+}
+
+// Take over the terminal to show frames, with colors for every opaque pixel and
+// the output backend named by $TS3D_OUTPUT. -1 is returned if colors are not
+// available, in which case the terminal is given back.
+static int start_screen(struct color_map *colors, struct output *out,
+	struct logger *log)
+{
+	try_setenv("ESCDELAY", STRINGIFY(FRAME_DELAY), 0);
+	initscr();
+	cbreak();
+	if (start_color() == ERR) {
+		logger_printf(log, LOGGER_ERROR, "start_color() failed\n");
+		endwin();
+		return -1;
+	}
+	set_application_title("Thing Shooter 3D");
+	timeout(0);
+	curs_set(0);
+	noecho();
+	keypad(stdscr, TRUE);
+	color_map_init(colors);
+	for (d3d_pixel p = 0; p < 64; ++p) {
+		color_map_add_pair(colors, p);
+	}
+	color_map_apply(colors);
+	const char *backend = getenv("TS3D_OUTPUT");
+	if (output_init(out, backend, colors)) {
+		logger_printf(log, LOGGER_WARNING,
+			"Unknown output \"%s\"; using \"%s\" instead\n",
+			backend, output_name(out));
+	}
+	clear();
+	return 0;
+}
+
+// Give the terminal back after start_screen.
+static void end_screen(struct color_map *colors, struct output *out)
+{
+	clear();
+	refresh();
+	output_destroy(out);
+	color_map_destroy(colors);
+	endwin();
+}
+
+// Fit the area for frames to the screen, leaving the bottom line for status.
+static void fit_area(struct screen_area *area, struct output *out)
+{
+	update_term_size();
+	area->width = COLS;
+	area->height = LINES > 0 ? LINES - 1 : 0;
+	output_resize(out);
+}
+
+// Show the text on the status line under the area, over its whole width.
+static void show_status(struct output *out, const struct screen_area *area,
+	const char *text)
+{
+	char line[256];
+	int width = area->width < (int)sizeof(line) - 1 ?
+		area->width : (int)sizeof(line) - 1;
+	snprintf(line, sizeof(line), "%-*.*s", width, width, text);
+	output_text(out, 0, area->height, A_REVERSE, line);
+}
+
+// Read the next frame of the recording. If it starts a new recording or comes
+// after a long pause, the clock is moved so that it comes a frame after the one
+// shown. The return value is like recording_next's.
+static int next_frame(struct recording *rec, unsigned long shown_msec,
+	double *clock)
+{
+	int status = recording_next(rec);
+	if (status > 0 && (rec->msec < shown_msec
+	 || rec->msec - shown_msec > MAX_GAP_MSEC))
+		*clock += (double)rec->msec - (shown_msec + FRAME_DELAY);
+	return status;
+}
+
+int replay_recording(const char *path, double speed, struct logger *log)
+{
+	int ret = -1;
+	struct recording rec;
+	if (open_recording(&rec, path, log)) return -1;
+	int status = recording_next(&rec);
+	if (status <= 0) {
+		logger_printf(log, LOGGER_ERROR, "Recording %s has no frames\n",
+			path);
+		goto error_frames;
+	}
+	struct color_map colors;
+	struct output out;
+	if (start_screen(&colors, &out, log)) goto error_screen;
+	// The frame shown is in the camera. The next frame to show is in rec
+	// unless status is 0. clock is the time in the recording:
+	d3d_camera *cam = take_frame(NULL, &rec);
+	long shown = rec.frame;
+	unsigned long shown_msec = rec.msec;
+	double clock = rec.msec;
+	status = next_frame(&rec, shown_msec, &clock);
+	struct screen_area area = { 0, 0, 1, 1 };
+	bool resized = true;
+	bool paused = false;
+	struct ticker timer;
+	ticker_init(&timer, FRAME_DELAY);
+	long long last_usec = ticker_usec();
+	ret = 0;
+	for (;;) {
+		tick(&timer);
+		long seek_to = -1;
+		switch (getch()) {
+		case 'q':
+		case 'x':
+		case ESC:
+			goto end;
+		case 'p':
+		case ' ':
+			paused = !paused;
+			break;
+		case '+':
+			if (speed < MAX_SPEED) speed *= 2;
+			break;
+		case '-':
+			if (speed > MIN_SPEED) speed /= 2;
+			break;
+		case KEY_LEFT:
+			seek_to = shown > SEEK_FRAMES ? shown - SEEK_FRAMES : 0;
+			break;
+		case KEY_RIGHT:
+			seek_to = shown + SEEK_FRAMES;
+			break;
+		case KEY_RESIZE:
+			resized = true;
+			break;
+		}
+		long long now = ticker_usec();
+		if (!paused) clock += (now - last_usec) / 1000.0 * speed;
+		last_usec = now;
+		if (seek_to >= 0) {
+			// Seeking shows the frame sought right away:
+			status = recording_seek(&rec, seek_to);
+			if (status > 0) clock = rec.msec;
+		}
+		while (status > 0 && clock >= rec.msec) {
+			cam = take_frame(cam, &rec);
+			shown = rec.frame;
+			shown_msec = rec.msec;
+			status = next_frame(&rec, shown_msec, &clock);
+		}
+		if (status < 0) {
+			logger_printf(log, LOGGER_WARNING,
+				"Recording %s is broken after frame %ld\n",
+				path, shown);
+			status = 0;
+		}
+		if (resized) {
+			fit_area(&area, &out);
+			resized = false;
+		}
+		output_present(&out, cam, &area);
+		char status_text[256];
+		snprintf(status_text, sizeof(status_text),
+			"Frame %ld  %lu.%03lus  Speed %gx  %s"
+			"  P: pause  +/-: speed  Arrows: seek  Q: quit",
+			shown, shown_msec / 1000, shown_msec % 1000, speed,
+			paused ? "PAUSED" : status == 0 ? "END" : "");
+		show_status(&out, &area, status_text);
+		output_flush(&out);
+	}
+end:
+	d3d_free_camera(cam);
+	end_screen(&colors, &out);
+error_screen:
+error_frames:
+	recording_close(&rec);
+	return ret;
+}
+
+int export_recording(const char *path, const char *dir, struct logger *log)
+{
+	int ret = 0;
+	struct recording rec;
+	if (open_recording(&rec, path, log)) return -1;
+	size_t name_size = strlen(dir) + 32;
+	char *name = xmalloc(name_size);
+	unsigned char *row = NULL;
+	int status;
+	while ((status = recording_next(&rec)) > 0) {
+		snprintf(name, name_size, "%s/%06ld.ppm", dir, rec.frame);
+		FILE *img = fopen(name, "wb");
+		if (!img) {
+			logger_printf(log, LOGGER_ERROR, "Cannot write %s: %s\n",
+				name, strerror(errno));
+			ret = -1;
+			break;
+		}
+		fprintf(img, "P6\n# msec %lu\n%zu %zu\n255\n", rec.msec,
+			rec.width, rec.height);
+		row = xrealloc(row, rec.width * 3);
+		for (size_t y = 0; y < rec.height; ++y) {
+			for (size_t x = 0; x < rec.width; ++x) {
+				d3d_pixel p = rec.pixels[y + x * rec.height];
+				unsigned char *rgb = row + x * 3;
+				// The foreground only covers some of a cell:
+				for (int c = 0; c < 3; ++c) {
+					rgb[c] = p < 64 ? (palette[pixel_bg(p)][c] * 3
+						+ palette[pixel_fg(p)][c]) / 4 : 0;
+				}
+			}
+			fwrite(row, 3, rec.width, img);
+		}
+		if (ferror(img) | fclose(img)) {
+			logger_printf(log, LOGGER_ERROR, "Error writing %s\n",
+				name);
+			ret = -1;
+			break;
+		}
+	}
+	if (status < 0) {
+		logger_printf(log, LOGGER_ERROR,
+			"Recording %s is broken after frame %ld\n", path,
+			rec.frame);
+		ret = -1;
+	}
+	free(row);
+	free(name);
+	recording_close(&rec);
+	return ret;
+}
+
+int watch_game(const char *path, struct logger *log)
+{
+	int ret = -1;
+	int fd = spectate_connect(path);
+	if (fd < 0) {
+		logger_printf(log, LOGGER_ERROR, "Cannot watch the game at %s: %s\n",
+			path, strerror(errno));
+		return -1;
+	}
+	struct color_map colors;
+	struct output out;
+	if (start_screen(&colors, &out, log)) goto error_screen;
+	// The bytes received but not yet decoded:
+	char *buf = NULL;
+	size_t len = 0, cap = 0;
+	// Whether the magic bytes were received, and whether the game is still
+	// sending:
+	bool started = false, sending = true;
+	struct recording rec;
+	recording_init_stream(&rec);
+	d3d_camera *cam = NULL;
+	long shown = -1;
+	struct screen_area area = { 0, 0, 1, 1 };
+	bool resized = true;
+	struct ticker timer;
+	ticker_init(&timer, FRAME_DELAY);
+	ret = 0;
+	for (;;) {
+		tick(&timer);
+		int key = getch();
+		if (key == 'q' || key == 'x' || key == ESC) break;
+		if (key == KEY_RESIZE) resized = true;
+		// Take everything sent since last time:
+		while (sending) {
+			char *to = growc(&buf, &len, &cap, READ_SIZE);
+			ssize_t got = read(fd, to, READ_SIZE);
+			len -= READ_SIZE - (got > 0 ? got : 0);
+			if (got > 0) continue;
+			if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK
+			 && errno != EINTR))
+				sending = false;
+			break;
+		}
+		size_t used = 0;
+		if (!started && len >= sizeof(RECORDING_MAGIC) - 1) {
+			if (memcmp(buf, RECORDING_MAGIC,
+				sizeof(RECORDING_MAGIC) - 1))
+			{
+				logger_printf(log, LOGGER_ERROR,
+					"%s is not a shared game\n", path);
+				ret = -1;
+				break;
+			}
+			used = sizeof(RECORDING_MAGIC) - 1;
+			started = true;
+		}
+		// Only the newest frame received is shown:
+		long got = 0;
+		while (started
+		 && (got = recording_feed(&rec, buf + used, len - used)) > 0) {
+			used += got;
+		}
+		if (got < 0) {
+			logger_printf(log, LOGGER_ERROR,
+				"The game at %s sent a broken frame\n", path);
+			ret = -1;
+			break;
+		}
+		memmove(buf, buf + used, len - used);
+		len -= used;
+		if (rec.frame != shown) {
+			cam = take_frame(cam, &rec);
+			shown = rec.frame;
+		}
+		if (resized) {
+			fit_area(&area, &out);
+			resized = false;
+		}
+		if (cam) output_present(&out, cam, &area);
+		char status_text[256];
+		snprintf(status_text, sizeof(status_text),
+			"Watching %s  %s  Q: quit", path,
+			!sending ? "The game stopped sharing."
+			: shown < 0 ? "Waiting for the game..." : "");
+		show_status(&out, &area, status_text);
+		output_flush(&out);
+	}
+	d3d_free_camera(cam);
+	recording_close(&rec);
+	free(buf);
+	end_screen(&colors, &out);
+error_screen:
+	close(fd);
+	return ret;
+}
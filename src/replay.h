@@ -0,0 +1,24 @@
+#ifndef REPLAY_H_
+#define REPLAY_H_
+
+struct logger; // Weak dependency
+
+// Play back the recording at the path (see recording.h) in the terminal, speed
+// times as fast as it was recorded. The viewer can pause, seek, and change the
+// speed. The screen is drawn with the output backend named by $TS3D_OUTPUT.
+// The return value is 0 for success or -1 for failure. Log messages are printed
+// to log.
+int replay_recording(const char *path, double speed, struct logger *log);
+
+// Write each frame of the recording at the path as a PPM image in the directory
+// dir. The images are named by frame number, and say the time of their frame in
+// milliseconds in a comment. Each pixel of a frame becomes one pixel of its
+// image. The return value is like replay_recording's.
+int export_recording(const char *path, const char *dir, struct logger *log);
+
+// Watch the game shared at the Unix socket path (see spectate.h) in the terminal
+// until the viewer quits or the game stops sharing. The return value is like
+// replay_recording's.
+int watch_game(const char *path, struct logger *log);
+
+#endif /* REPLAY_H_ */
@@ -0,0 +1,477 @@
+#include "spectate.h"
+#include "xalloc.h"
+#include "util.h"
+#include <errno.h>
+#include <string.h>
+
+#ifndef _WIN32
+
+#	include <fcntl.h>
+#	include <signal.h>
+#	include <sys/socket.h>
+#	include <sys/stat.h>
+#	include <sys/un.h>
+#	include <unistd.h>
+
+// Fill in the address of the socket path. false is returned if the path is too
+// long, with errno set.
+static bool socket_address(struct sockaddr_un *addr, const char *path)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	strcpy(addr->sun_path, path);
+	return true;
+}
+
+static int set_nonblocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+	return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Set up everything but the listening socket and its path.
+static void init_ring(struct spectate_server *srv)
+{
+	recorder_init(&srv->enc, NULL);
+	srv->ring = xmalloc(SPECTATE_RING_SIZE);
+	srv->head = 0;
+	srv->need_key = false;
+	srv->n_spectators = 0;
+}
+
+int spectate_open(struct spectate_server *srv, const char *path)
+{
+	struct sockaddr_un addr;
+	if (!socket_address(&addr, path)) return -1;
+	srv->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (srv->fd < 0) return -1;
+	if (bind(srv->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		if (errno != EADDRINUSE) goto error_socket;
+		// Take the place of a socket left by a game that's gone, but
+		// never of anything else at the path:
+		struct stat st;
+		if (lstat(path, &st) || !S_ISSOCK(st.st_mode)) {
+			errno = EADDRINUSE;
+			goto error_socket;
+		}
+		int probe = spectate_connect(path);
+		if (probe >= 0 || errno != ECONNREFUSED) {
+			if (probe >= 0) close(probe);
+			errno = EADDRINUSE;
+			goto error_socket;
+		}
+		if (unlink(path)
+		 || bind(srv->fd, (struct sockaddr *)&addr, sizeof(addr)))
+			goto error_socket;
+	}
+	if (listen(srv->fd, SPECTATE_MAX_SPECTATORS)
+	 || set_nonblocking(srv->fd)) {
+		int err = errno;
+		unlink(path);
+		errno = err;
+		goto error_socket;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	srv->path = str_dup(path);
+	init_ring(srv);
+	return 0;
+
+error_socket:;
+	int err = errno;
+	close(srv->fd);
+	errno = err;
+	return -1;
+}
+
+static void drop_spectator(struct spectate_server *srv, int i)
+{
+	close(srv->spectators[i].fd);
+	srv->spectators[i] = srv->spectators[--srv->n_spectators];
+}
+
+// Let in the spectator connected through the socket fd. They are sent the magic
+// bytes and wait for a keyframe. If there is no room for them, the socket is
+// closed and false is returned.
+static bool add_spectator(struct spectate_server *srv, int fd)
+{
+	static const char magic[] = RECORDING_MAGIC;
+	// A fresh socket always has room for the magic bytes:
+	if (srv->n_spectators >= SPECTATE_MAX_SPECTATORS
+	 || set_nonblocking(fd)
+	 || write(fd, magic, sizeof(magic) - 1)
+		!= (ssize_t)sizeof(magic) - 1) {
+		close(fd);
+		return false;
+	}
+	struct spectator *spec = &srv->spectators[srv->n_spectators++];
+	spec->fd = fd;
+	spec->pos = spec->record_end = srv->head;
+	spec->waiting = true;
+	srv->need_key = true;
+	return true;
+}
+
+// Accept everyone waiting to connect.
+static void accept_spectators(struct spectate_server *srv)
+{
+	int fd;
+	while ((fd = accept(srv->fd, NULL, NULL)) >= 0) {
+		add_spectator(srv, fd);
+	}
+}
+
+// Put a frame record at the head of the ring.
+static void put_record(struct spectate_server *srv, const char *record,
+	size_t size)
+{
+	size_t at = srv->head % SPECTATE_RING_SIZE;
+	size_t first = SPECTATE_RING_SIZE - at;
+	if (first > size) first = size;
+	memcpy(srv->ring + at, record, first);
+	memcpy(srv->ring, record + first, size - first);
+	srv->head += size;
+}
+
+// Get the size of the frame record starting at the byte number pos of the
+// stream, header included.
+static unsigned long long record_size(const struct spectate_server *srv,
+	unsigned long long pos)
+{
+	unsigned long long size = 0;
+	// The size is in bytes 1 to 4 of the header:
+	for (int i = 4; i >= 1; --i) {
+		size_t at = (pos + i) % SPECTATE_RING_SIZE;
+		size = size << 8 | (unsigned char)srv->ring[at];
+	}
+	return RECORDING_HEADER_SIZE + size;
+}
+
+// Send the spectator as much of the ring as their socket takes. false is
+// returned if they left.
+static bool send_spectator(struct spectate_server *srv, struct spectator *spec)
+{
+	while (spec->pos < srv->head) {
+		size_t at = spec->pos % SPECTATE_RING_SIZE;
+		size_t len = SPECTATE_RING_SIZE - at;
+		if (len > srv->head - spec->pos) len = srv->head - spec->pos;
+		ssize_t sent = write(spec->fd, srv->ring + at, len);
+		if (sent < 0) {
+			if (errno == EINTR) continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+		spec->pos += sent;
+		// Every record passed is still in the ring:
+		while (spec->record_end <= spec->pos
+		 && spec->record_end < srv->head) {
+			spec->record_end += record_size(srv, spec->record_end);
+		}
+	}
+	return true;
+}
+
+void spectate_publish(struct spectate_server *srv, const d3d_camera *cam)
+{
+	accept_spectators(srv);
+	if (srv->n_spectators == 0) return;
+	if (srv->need_key) recorder_force_keyframe(&srv->enc);
+	size_t size;
+	const char *record = recorder_encode(&srv->enc, cam, &size);
+	if (size > SPECTATE_RING_SIZE) return;
+	if (record[0] == 'K') {
+		// Those waiting start with this:
+		for (int i = 0; i < srv->n_spectators; ++i) {
+			struct spectator *spec = &srv->spectators[i];
+			if (spec->waiting) {
+				spec->pos = spec->record_end = srv->head;
+				spec->waiting = false;
+			}
+		}
+		srv->need_key = false;
+	}
+	put_record(srv, record, size);
+	for (int i = 0; i < srv->n_spectators; ++i) {
+		struct spectator *spec = &srv->spectators[i];
+		if (spec->waiting) continue;
+		if (srv->head - spec->pos > SPECTATE_RING_SIZE) {
+			// What they were to be sent next was overwritten.
+			// They can only skip ahead if they were not sent part
+			// of a record:
+			if (spec->pos == spec->record_end) {
+				spec->waiting = true;
+				srv->need_key = true;
+			} else {
+				drop_spectator(srv, i--);
+			}
+		} else if (!send_spectator(srv, spec)) {
+			drop_spectator(srv, i--);
+		}
+	}
+}
+
+// Disconnect everyone and free what init_ring set up.
+static void destroy_ring(struct spectate_server *srv)
+{
+	while (srv->n_spectators > 0) {
+		drop_spectator(srv, 0);
+	}
+	recorder_close(&srv->enc);
+	free(srv->ring);
+}
+
+void spectate_close(struct spectate_server *srv)
+{
+	destroy_ring(srv);
+	close(srv->fd);
+	unlink(srv->path);
+	free(srv->path);
+}
+
+int spectate_connect(const char *path)
+{
+	struct sockaddr_un addr;
+	if (!socket_address(&addr, path)) return -1;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) return -1;
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))
+	 || set_nonblocking(fd)) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+#else /* defined(_WIN32) */
+
+// Unix domain sockets are not supported on Windows here.
+
+int spectate_open(struct spectate_server *UNUSED_VAR(srv),
+	const char *UNUSED_VAR(path))
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+void spectate_publish(struct spectate_server *UNUSED_VAR(srv),
+	const d3d_camera *UNUSED_VAR(cam))
+{
+}
+
+void spectate_close(struct spectate_server *UNUSED_VAR(srv))
+{
+}
+
+int spectate_connect(const char *UNUSED_VAR(path))
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif /* defined(_WIN32) */
+
+#if CTF_TESTS_ENABLED && !defined(_WIN32)
+
+#	include "grow.h"
+#	include "libctf.h"
+#	include <assert.h>
+
+// The size of the test cameras. Every pixel changes every frame, so that the
+// ring fills up quickly.
+#define TEST_WIDTH 200
+#define TEST_HEIGHT 100
+
+static void draw_test_frame(d3d_camera *cam, int f)
+{
+	for (size_t x = 0; x < TEST_WIDTH; ++x) {
+		for (size_t y = 0; y < TEST_HEIGHT; ++y) {
+			*d3d_camera_get(cam, x, y) = (x * 7 + y * 3 + f) % 64;
+		}
+	}
+}
+
+// A spectator's end of the stream and what they decoded from it.
+struct test_watcher {
+	int fd;
+	char *buf;
+	size_t len, cap;
+	// How many bytes to skip after the magic bytes.
+	size_t skip;
+	bool started, closed;
+	struct recording rec;
+};
+
+// Connect a watcher to the server through a socket pair.
+static void connect_watcher(struct spectate_server *srv, struct test_watcher *w)
+{
+	int fds[2];
+	assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+	assert(add_spectator(srv, fds[0]));
+	assert(!set_nonblocking(fds[1]));
+	w->fd = fds[1];
+	w->buf = NULL;
+	w->len = w->cap = 0;
+	w->skip = 0;
+	w->started = w->closed = false;
+	recording_init_stream(&w->rec);
+}
+
+// Fill the spectator's socket with junk so that nothing more can be sent to
+// them. The watcher skips it.
+static void block_watcher(struct spectator *spec, struct test_watcher *w)
+{
+	static const char junk[512];
+	ssize_t sent;
+	while ((sent = write(spec->fd, junk, sizeof(junk))) > 0) {
+		w->skip += sent;
+	}
+	assert(errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// Read and decode everything sent to the watcher so far.
+static void watch(struct test_watcher *w)
+{
+	for (;;) {
+		char *to = growc(&w->buf, &w->len, &w->cap, 4096);
+		ssize_t got = read(w->fd, to, 4096);
+		w->len -= 4096 - (got > 0 ? got : 0);
+		if (got > 0) continue;
+		assert(got == 0 || errno == EAGAIN || errno == EWOULDBLOCK);
+		w->closed = got == 0;
+		break;
+	}
+	size_t used = 0;
+	if (!w->started) {
+		size_t magic_len = sizeof(RECORDING_MAGIC) - 1;
+		assert(w->len >= magic_len + w->skip);
+		assert(!memcmp(w->buf, RECORDING_MAGIC, magic_len));
+		used = magic_len + w->skip;
+		w->started = true;
+	}
+	long got;
+	while ((got = recording_feed(&w->rec, w->buf + used, w->len - used))
+		> 0) {
+		used += got;
+	}
+	assert(got == 0);
+	memmove(w->buf, w->buf + used, w->len - used);
+	w->len -= used;
+}
+
+static void close_watcher(struct test_watcher *w)
+{
+	close(w->fd);
+	free(w->buf);
+	recording_close(&w->rec);
+}
+
+static bool watcher_sees(const struct test_watcher *w, d3d_camera *cam)
+{
+	return w->rec.width == TEST_WIDTH && w->rec.height == TEST_HEIGHT
+		&& !memcmp(w->rec.pixels, d3d_camera_pixels(cam),
+			TEST_WIDTH * TEST_HEIGHT * sizeof(*w->rec.pixels));
+}
+
+CTF_TEST(spectate_record_sizes_wrap_around_ring,
+	struct spectate_server srv;
+	init_ring(&srv);
+	srv.head = 3 * SPECTATE_RING_SIZE - 3;
+	unsigned long long at = srv.head;
+	char record[RECORDING_HEADER_SIZE + 300] = { 'D', 0x2C, 0x01 };
+	put_record(&srv, record, sizeof(record));
+	assert(srv.head == at + sizeof(record));
+	assert(record_size(&srv, at) == sizeof(record));
+	destroy_ring(&srv);
+)
+
+CTF_TEST(spectate_sends_same_frames_to_all,
+	struct spectate_server srv;
+	init_ring(&srv);
+	d3d_camera *cam = d3d_new_camera(1, 1, TEST_WIDTH, TEST_HEIGHT, 0);
+	assert(cam);
+	// Nothing is encoded without anyone watching:
+	draw_test_frame(cam, 0);
+	spectate_publish(&srv, cam);
+	assert(srv.head == 0);
+	struct test_watcher early, late;
+	connect_watcher(&srv, &early);
+	for (int f = 1; f <= 5; ++f) {
+		if (f == 3) connect_watcher(&srv, &late);
+		draw_test_frame(cam, f);
+		spectate_publish(&srv, cam);
+		watch(&early);
+		assert(early.rec.frame == f - 1);
+		assert(watcher_sees(&early, cam));
+		if (f >= 3) {
+			// Later spectators start at a keyframe of their own:
+			watch(&late);
+			assert(late.rec.frame == f - 3);
+			assert(watcher_sees(&late, cam));
+		}
+	}
+	destroy_ring(&srv);
+	watch(&early);
+	assert(early.closed);
+	close_watcher(&early);
+	close_watcher(&late);
+	d3d_free_camera(cam);
+)
+
+CTF_TEST(spectate_lagging_spectator_skips_ahead,
+	struct spectate_server srv;
+	init_ring(&srv);
+	d3d_camera *cam = d3d_new_camera(1, 1, TEST_WIDTH, TEST_HEIGHT, 0);
+	assert(cam);
+	struct test_watcher w;
+	connect_watcher(&srv, &w);
+	block_watcher(&srv.spectators[0], &w);
+	int f = 0;
+	do {
+		assert(f < 1000);
+		draw_test_frame(cam, f++);
+		spectate_publish(&srv, cam);
+	} while (!srv.spectators[0].waiting);
+	assert(srv.n_spectators == 1);
+	// Once they catch up, they start again at a fresh keyframe:
+	watch(&w);
+	assert(w.rec.frame == -1);
+	draw_test_frame(cam, f);
+	spectate_publish(&srv, cam);
+	watch(&w);
+	assert(w.rec.frame == 0);
+	assert(watcher_sees(&w, cam));
+	destroy_ring(&srv);
+	close_watcher(&w);
+	d3d_free_camera(cam);
+)
+
+CTF_TEST(spectate_lagging_spectator_in_record_is_dropped,
+	struct spectate_server srv;
+	init_ring(&srv);
+	d3d_camera *cam = d3d_new_camera(1, 1, TEST_WIDTH, TEST_HEIGHT, 0);
+	assert(cam);
+	struct test_watcher w;
+	connect_watcher(&srv, &w);
+	block_watcher(&srv.spectators[0], &w);
+	draw_test_frame(cam, 0);
+	spectate_publish(&srv, cam);
+	// Pretend part of the first record was sent:
+	++srv.spectators[0].record_end;
+	for (int f = 1; srv.n_spectators > 0; ++f) {
+		assert(f < 1000);
+		draw_test_frame(cam, f);
+		spectate_publish(&srv, cam);
+	}
+	watch(&w);
+	assert(w.closed);
+	assert(w.rec.frame == -1);
+	destroy_ring(&srv);
+	close_watcher(&w);
+	d3d_free_camera(cam);
+)
+
+#endif /* CTF_TESTS_ENABLED && !defined(_WIN32) */
@@ -0,0 +1,66 @@
+#ifndef SPECTATE_H_
+#define SPECTATE_H_
+
+// Spectators can watch a game over a Unix domain socket. The game publishes
+// each frame of the 3D scene it shows, and every spectator connected gets the
+// frames as a recording stream (see recording.h): the magic bytes, then a
+// keyframe, then deltas and more keyframes. Publishing never blocks. The frame
+// records go into a ring buffer, and each spectator is sent as much of it as
+// their socket takes. A spectator who falls behind by more than the ring skips
+// ahead to the next keyframe, which is then made right away, or is disconnected
+// if they were in the middle of a record.
+
+#include "d3d.h"
+#include "recording.h"
+#include <stdbool.h>
+
+// The size in bytes of the ring buffer of frame records.
+#define SPECTATE_RING_SIZE (4L << 20)
+
+// The most spectators that can watch at once.
+#define SPECTATE_MAX_SPECTATORS 16
+
+// A place spectators connect to. The fields are private.
+struct spectate_server {
+	// The listening socket and its path.
+	int fd;
+	char *path;
+	// Encodes the frames for everyone.
+	struct recorder enc;
+	// The ring buffer and the number of bytes ever put in it. The byte
+	// number i of the stream is at ring[i % SPECTATE_RING_SIZE].
+	char *ring;
+	unsigned long long head;
+	// Whether the next frame must be a keyframe for a spectator to start.
+	bool need_key;
+	struct spectator {
+		int fd;
+		// The number of the next byte of the stream to send, and of the
+		// byte after the record it is in.
+		unsigned long long pos, record_end;
+		// Whether the spectator is waiting for a keyframe.
+		bool waiting;
+	} spectators[SPECTATE_MAX_SPECTATORS];
+	int n_spectators;
+};
+
+// Listen for spectators on a new socket at the path. If a socket is already
+// there but nothing is listening on it, it is replaced. Anything else already
+// there is left alone, and EADDRINUSE is the error. -1 is returned on
+// failure with errno set. SIGPIPE is ignored from then on, so that spectators
+// leaving are noticed as errors.
+int spectate_open(struct spectate_server *srv, const char *path);
+
+// Let in any new spectators and send them all the camera's current scene, as
+// far as they can take it without blocking. Nothing is encoded if no one is
+// watching.
+void spectate_publish(struct spectate_server *srv, const d3d_camera *cam);
+
+// Disconnect everyone and remove the socket.
+void spectate_close(struct spectate_server *srv);
+
+// Connect to the game shared at the socket path as a spectator. The socket
+// returned does not block. -1 is returned on failure with errno set.
+int spectate_connect(const char *path);
+
+#endif /* SPECTATE_H_ */
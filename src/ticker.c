@@ -26,6 +26,13 @@ void tick(struct ticker *tkr)
 	gettimeofday(&tkr->last_tick, NULL);
 }
 
+long long ticker_usec(void)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (long long)now.tv_sec * 1000000 + now.tv_usec;
+}
+
 #else
 
 #	include <windows.h>
@@ -48,6 +55,11 @@ void tick(struct ticker *tkr)
 	}
 }
 
+long long ticker_usec(void)
+{
+	return (long long)GetTickCount() * 1000;
+}
+
 #endif /* defined(_WIN32) */
 
 #if CTF_TESTS_ENABLED
@@ -27,4 +27,8 @@ void ticker_init(struct ticker *tkr, int interval);
 // Go forward a tick, trying to account for time spent computing inbetween.
 void tick(struct ticker *tkr);
 
+// Get the current time in microseconds, for timing things. Only the differences
+// between times mean anything.
+long long ticker_usec(void);
+
 #endif /* TICKER_H_ */
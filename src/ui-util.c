@@ -9,6 +9,9 @@ void color_map_init(struct color_map *map)
 {
 	map->pair_num = 0;
 	memset(map->pixel2pair, 0, sizeof(map->pixel2pair));
+	for (size_t p = 0; p < ARRSIZE(map->pixel2cell); ++p) {
+		map->pixel2cell[p] = COLOR_PAIR(0) | SCENE_FG_CHAR;
+	}
 }
 
 int color_map_add_pair(struct color_map *map, d3d_pixel pix)
@@ -40,6 +43,10 @@ int color_map_apply(struct color_map *map)
 			}
 		}
 	}
+	for (size_t p = 0; p < ARRSIZE(map->pixel2cell); ++p) {
+		int pair = color_map_get_pair(map, (d3d_pixel)p);
+		map->pixel2cell[p] = COLOR_PAIR(pair) | SCENE_FG_CHAR;
+	}
 	return ret;
 }
 
@@ -53,36 +60,33 @@ int color_map_get_pair(struct color_map *map, d3d_pixel pix)
 	return pix < sizeof(map->pixel2pair) ? map->pixel2pair[pix] : 0;
 }
 
+const chtype *color_map_cells(const struct color_map *map)
+{
+	return map->pixel2cell;
+}
+
 void color_map_destroy(struct color_map *UNUSED_VAR(map))
 {
 }
 
-void meter_draw(const struct meter *meter)
+chtype meter_cell(const struct meter *meter, int i)
 {
 	int full = meter->width * meter->fraction;
-	int i;
-	for (i = 0; meter->label[i] && i < full; ++i) {
-		mvwaddch(meter->win, meter->y, meter->x + i,
-			meter->full_style | meter->label[i]);
-	}
-	if (i < full) {
-		do {
-			mvwaddch(meter->win,meter->y, meter->x + i,
-				meter->full_style | ' ');
-		} while (++i < full);
-	} else {
-		for (; meter->label[i]; ++i) {
-			mvwaddch(meter->win, meter->y, meter->x + i,
-				meter->empty_style | meter->label[i]);
-		}
-	}
-	for (; i < meter->width; ++i) {
+	chtype style = i < full ? meter->full_style : meter->empty_style;
+	// The label is only drawn where it fits:
+	int len = strlen(meter->label);
+	return style | (i < len ? meter->label[i] : ' ');
+}
+
+void meter_draw(const struct meter *meter)
+{
+	for (int i = 0; i < meter->width; ++i) {
 		mvwaddch(meter->win, meter->y, meter->x + i,
-			meter->empty_style | ' ');
+			meter_cell(meter, i));
 	}
 }
 
-WINDOW *popup_window(const char *text)
+bool popup_area(const char *text, struct screen_area *area)
 {
 	int width = 0, height = 0;
 	int line_width = 0;
@@ -101,39 +105,248 @@ WINDOW *popup_window(const char *text)
 	width += 2;
 	height += 2;
 	// No popups larger than the screen are allowed:
-	if (height > LINES || width > COLS) return NULL;
-	WINDOW *win = newwin(height, width,
-		(LINES - height) / 2, (COLS - width) / 2);
-	if (!win) return NULL;
+	if (height > LINES || width > COLS) return false;
+	area->x = (COLS - width) / 2;
+	area->y = (LINES - height) / 2;
+	area->width = width;
+	area->height = height;
+	return true;
+}
+
+const char *popup_line(const char *text, int y, int *len)
+{
 	const char *line = text;
-	for (int y = 1; y < height - 1; ++y) {
-		const char *nl = strchr(line, '\n');
-		// Line length is remaining text length if there's no newline:
-		int len = nl ? nl - line : (int)strlen(line);
+	for (; y > 1; --y) {
+		line = strchr(line, '\n');
+		if (!line) break;
+		++line;
+	}
+	if (y != 1 || !line) {
+		*len = 0;
+		return text;
+	}
+	const char *nl = strchr(line, '\n');
+	// Line length is remaining text length if there's no newline:
+	*len = nl ? nl - line : (int)strlen(line);
+	return line;
+}
+
+WINDOW *popup_window(const char *text)
+{
+	struct screen_area area;
+	if (!popup_area(text, &area)) return NULL;
+	WINDOW *win = newwin(area.height, area.width, area.y, area.x);
+	if (!win) return NULL;
+	for (int y = 1; y < area.height - 1; ++y) {
+		int len;
+		const char *line = popup_line(text, y, &len);
 		// Draw centered line of text:
-		mvwaddnstr(win, y, (width - len) / 2, line, len);
-		line += len + 1;
+		mvwaddnstr(win, y, (area.width - len) / 2, line, len);
 	}
 	return win;
 }
 
+// Find where the pixels of the camera column shown in each of the width cells
+// of a row start in the camera's pixels, stretching the camera to the width.
+static void find_columns(const d3d_camera *cam, size_t width, size_t *columns)
+{
+	size_t cam_width = d3d_camera_width(cam);
+	size_t cam_height = d3d_camera_height(cam);
+	for (size_t x = 0; x < width; ++x) {
+		columns[x] = x * cam_width / width * cam_height;
+	}
+}
+
 void display_frame(d3d_camera *cam, struct screen_area *area,
 	struct color_map *colors)
 {
-	size_t width = d3d_camera_width(cam);
-	if (width > (size_t)area->width) width = (size_t)area->width;
-	size_t height = d3d_camera_height(cam);
-	if (height > (size_t)area->height) height = (size_t)area->height;
-	for (size_t x = 0; x < width; ++x) {
-		for (size_t y = 0; y < height; ++y) {
-			d3d_pixel pix = *d3d_camera_get(cam, x, y);
-			int pair = color_map_get_pair(colors, pix);
-			mvaddch((int)y + area->y, (int)x + area->x,
-				COLOR_PAIR(pair) | SCENE_FG_CHAR);
+	if (area->width <= 0 || area->height <= 0) return;
+	size_t width = (size_t)area->width, height = (size_t)area->height;
+	size_t cam_height = d3d_camera_height(cam);
+	const d3d_pixel *pixels = d3d_camera_pixels(cam);
+	const chtype *pixel2cell = color_map_cells(colors);
+	size_t *columns = xmalloc(width * sizeof(*columns));
+	chtype *cells = xmalloc(width * sizeof(*cells));
+	find_columns(cam, width, columns);
+	// Each cell shows the nearest pixel when the sizes differ:
+	for (size_t y = 0; y < height; ++y) {
+		const d3d_pixel *row = pixels + y * cam_height / height;
+		for (size_t x = 0; x < width; ++x) {
+			cells[x] = pixel2cell[row[columns[x]]];
+		}
+		mvaddchnstr((int)y + area->y, area->x, cells, (int)width);
+	}
+	free(columns);
+	free(cells);
+}
+
+// Runs of changed cells separated by fewer unchanged cells than this are sent as
+// one run, since moving the cursor costs about as much as a few cells.
+#define PRESENT_MERGE_GAP 4
+
+void presenter_init(struct presenter *pr)
+{
+	pr->shown = pr->next = NULL;
+	pr->area = (struct screen_area){ 0, 0, 0, 0 };
+	pr->forced = NULL;
+	pr->columns = NULL;
+	pr->cells = NULL;
+}
+
+// Find the first pixel at or after x at which the rows a and b differ, or width
+// if there are none. As many pixels as fit in a word are compared at once.
+static size_t first_change(const d3d_pixel *a, const d3d_pixel *b, size_t x,
+	size_t width)
+{
+	const size_t per_word = sizeof(size_t) / sizeof(d3d_pixel);
+	if (per_word > 1) {
+		while (x + per_word <= width) {
+			size_t word_a, word_b;
+			memcpy(&word_a, a + x, sizeof(word_a));
+			memcpy(&word_b, b + x, sizeof(word_b));
+			if (word_a != word_b) break;
+			x += per_word;
+		}
+	}
+	while (x < width && a[x] == b[x]) {
+		++x;
+	}
+	return x;
+}
+
+// Make the presenter's buffers fit the area, forgetting what was shown if the
+// size changed.
+static void fit_presenter(struct presenter *pr, const struct screen_area *area)
+{
+	if (pr->area.x == area->x && pr->area.y == area->y
+	 && pr->area.width == area->width && pr->area.height == area->height)
+		return;
+	size_t n_cells = (size_t)area->width * (size_t)area->height;
+	pr->shown = xrealloc(pr->shown, n_cells * sizeof(*pr->shown));
+	pr->next = xrealloc(pr->next, n_cells * sizeof(*pr->next));
+	pr->forced = xrealloc(pr->forced,
+		(size_t)area->height * 2 * sizeof(*pr->forced));
+	pr->columns = xrealloc(pr->columns,
+		(size_t)area->width * sizeof(*pr->columns));
+	pr->cells = xrealloc(pr->cells,
+		(size_t)area->width * sizeof(*pr->cells));
+	pr->area = *area;
+	presenter_invalidate(pr);
+}
+
+void presenter_update(struct presenter *pr, d3d_camera *cam,
+	const struct screen_area *area, present_run emit, void *arg)
+{
+	if (area->width <= 0 || area->height <= 0) return;
+	fit_presenter(pr, area);
+	size_t cam_height = d3d_camera_height(cam);
+	size_t width = (size_t)area->width, height = (size_t)area->height;
+	const d3d_pixel *pixels = d3d_camera_pixels(cam);
+	// Lay the frame out in rows like the screen, stretching it to fit:
+	find_columns(cam, width, pr->columns);
+	for (size_t y = 0; y < height; ++y) {
+		const d3d_pixel *from = pixels + y * cam_height / height;
+		d3d_pixel *row = pr->next + y * width;
+		for (size_t x = 0; x < width; ++x) {
+			row[x] = from[pr->columns[x]];
+		}
+	}
+	for (size_t y = 0; y < height; ++y) {
+		d3d_pixel *row = pr->next + y * width;
+		d3d_pixel *old = pr->shown + y * width;
+		// Cells that must be sent are made to look changed:
+		for (int x = pr->forced[2 * y]; x < pr->forced[2 * y + 1]; ++x) {
+			old[x] = ~row[x];
 		}
+		pr->forced[2 * y] = pr->forced[2 * y + 1] = 0;
+		size_t x = first_change(row, old, 0, width);
+		while (x < width) {
+			size_t end = x;
+			do {
+				while (end < width && row[end] != old[end]) {
+					++end;
+				}
+				size_t next = first_change(row, old, end, width);
+				if (next >= width || next - end >= PRESENT_MERGE_GAP)
+				{
+					emit(arg, (int)x + area->x,
+						(int)y + area->y, row + x,
+						end - x);
+					x = next;
+					break;
+				}
+				end = next;
+			} while (end < width);
+		}
+	}
+	d3d_pixel *swap = pr->shown;
+	pr->shown = pr->next;
+	pr->next = swap;
+}
+
+// What present_frame sends its runs of cells to curses with.
+struct curses_runs {
+	// The row of cells to fill in.
+	chtype *cells;
+	const chtype *pixel2cell;
+};
+
+static void draw_curses_run(void *arg, int x, int y, const d3d_pixel *pixels,
+	size_t n)
+{
+	struct curses_runs *runs = arg;
+	for (size_t i = 0; i < n; ++i) {
+		runs->cells[i] = runs->pixel2cell[pixels[i]];
+	}
+	mvaddchnstr(y, x, runs->cells, (int)n);
+}
+
+void present_frame(struct presenter *pr, d3d_camera *cam,
+	const struct screen_area *area, struct color_map *colors)
+{
+	if (area->width <= 0 || area->height <= 0) return;
+	// The cells are only allocated once the area is known:
+	fit_presenter(pr, area);
+	struct curses_runs runs = { pr->cells, color_map_cells(colors) };
+	presenter_update(pr, cam, area, draw_curses_run, &runs);
+}
+
+void presenter_damage(struct presenter *pr, int x, int y, int width)
+{
+	x -= pr->area.x;
+	y -= pr->area.y;
+	if (y < 0 || y >= pr->area.height) return;
+	int end = x + width;
+	if (x < 0) x = 0;
+	if (end > pr->area.width) end = pr->area.width;
+	if (x >= end) return;
+	int *range = &pr->forced[2 * y];
+	if (range[0] >= range[1]) {
+		range[0] = x;
+		range[1] = end;
+	} else {
+		if (x < range[0]) range[0] = x;
+		if (end > range[1]) range[1] = end;
+	}
+}
+
+void presenter_invalidate(struct presenter *pr)
+{
+	for (int y = 0; y < pr->area.height; ++y) {
+		pr->forced[2 * y] = 0;
+		pr->forced[2 * y + 1] = pr->area.width;
 	}
 }
 
+void presenter_destroy(struct presenter *pr)
+{
+	free(pr->shown);
+	free(pr->next);
+	free(pr->forced);
+	free(pr->columns);
+	free(pr->cells);
+}
+
 d3d_camera *camera_with_dims(int width, int height)
 {
 	d3d_camera *cam;
@@ -148,6 +361,15 @@ d3d_camera *camera_with_dims(int width, int height)
 			CAM_FOV_X / PIXEL_ASPECT, width, height,
 			pixel(PC_BLACK, PC_BLACK)));
 	}
+	size_t n_threads = count_processors();
+	if (n_threads > MAX_RENDER_THREADS) n_threads = MAX_RENDER_THREADS;
+	// If the threads can't be started, just draw on this one:
+	d3d_camera_set_threads(cam, n_threads);
+	// Turning in place can then reuse the last frame's rays, standing
+	// still only redraws sprites, and flat walls are filled in without
+	// casting every ray, if there is memory for it:
+	d3d_camera_set_options(cam,
+		D3D_REUSE_RAYS | D3D_CACHE_WORLD | D3D_COHERENT_RAYS);
 	return cam;
 }
 
@@ -164,3 +386,39 @@ void update_term_size(void)
 	if (is_termresized()) resize_term(0, 0);
 #endif
 }
+
+#if CTF_TESTS_ENABLED
+
+#	include "libctf.h"
+#	include <assert.h>
+
+CTF_TEST(first_change_finds_changes_across_words,
+	d3d_pixel a[50], b[50];
+	for (size_t i = 0; i < 50; ++i) {
+		a[i] = b[i] = (d3d_pixel)i;
+	}
+	assert(first_change(a, b, 0, 50) == 50);
+	b[37] = 0;
+	b[3] = 0;
+	assert(first_change(a, b, 0, 50) == 3);
+	assert(first_change(a, b, 4, 50) == 37);
+	assert(first_change(a, b, 38, 50) == 50);
+	b[49] = 0;
+	assert(first_change(a, b, 38, 50) == 49);
+	assert(first_change(a, b, 38, 49) == 49);
+)
+
+CTF_TEST(popup_line_skips_padding,
+	static const char text[] = "one\ntwo lines";
+	int len;
+	popup_line(text, 0, &len);
+	assert(len == 0);
+	assert(popup_line(text, 1, &len) == text);
+	assert(len == 3);
+	assert(popup_line(text, 2, &len) == text + 4);
+	assert(len == 9);
+	popup_line(text, 3, &len);
+	assert(len == 0);
+)
+
+#endif /* CTF_TESTS_ENABLED */
@@ -24,6 +24,9 @@ struct color_map {
 	int pair_num;
 	// The mapping from color pixels to color pairs, all items initialized.
 	char pixel2pair[64];
+	// The character cell showing each possible pixel in the 3D scene, as of
+	// the last color_map_apply.
+	chtype pixel2cell[256];
 };
 
 // Initialize an empty color map.
@@ -42,6 +45,10 @@ size_t color_map_count_pairs(struct color_map *map);
 // Get the color pair number corresponding to a pixel.
 int color_map_get_pair(struct color_map *map, d3d_pixel pix);
 
+// Get the table of 256 character cells showing the pixels in the 3D scene,
+// indexed by pixel. This is up to date as of the last color_map_apply.
+const chtype *color_map_cells(const struct color_map *map);
+
 // Free resources associated with the map.
 void color_map_destroy(struct color_map *map);
 
@@ -67,19 +74,86 @@ struct meter {
 	WINDOW *win;
 };
 
+// Get what is shown in the cell i cells from the meter's left, as a curses
+// style and character.
+chtype meter_cell(const struct meter *meter, int i);
+
 // Draw the meter.
 void meter_draw(const struct meter *meter);
 
+// Find where popup_window would put a window holding the text, one cell of
+// padding around the text in the middle of the screen. false is returned if the
+// popup would not fit on the screen.
+bool popup_area(const char *text, struct screen_area *area);
+
+// Get the line of the popup text shown on row y of its popup, counting the
+// padding as row 0. The line's length is put in len; it is 0 for rows with no
+// text.
+const char *popup_line(const char *text, int y, int *len);
+
 // Create a small window in the middle of the screen. The window will contain
 // the given text with each line centered.
 WINDOW *popup_window(const char *text);
 
-// Copy the current scene from the camera to given area. The color map is used
-// to translate pixels for Curses.
+// Copy the current scene from the camera to given area, stretching or shrinking
+// it to fit if the sizes differ. The color map is used to translate pixels for
+// Curses.
 void display_frame(d3d_camera *cam, struct screen_area *area,
 	struct color_map *colors);
 
-// Create a camera with the given positive dimensions.
+// Something that shows camera frames in an area of the screen like
+// display_frame, but only sends the cells that changed since the last frame it
+// showed. The fields are private.
+struct presenter {
+	// The pixels of the cells of the area last shown and of the cells being
+	// shown, in row-major order.
+	d3d_pixel *shown, *next;
+	// The area last shown in, which is the size of the buffers. Nothing has
+	// been shown if the width is 0.
+	struct screen_area area;
+	// For each row of the area, the cells from forced[2 * y] up to but not
+	// including forced[2 * y + 1] are sent next time even if unchanged.
+	int *forced;
+	// Scratch space for a row of the area: where each cell's column starts
+	// in the camera's pixels, and the cells being sent.
+	size_t *columns;
+	chtype *cells;
+};
+
+// Initialize a presenter that has shown nothing.
+void presenter_init(struct presenter *pr);
+
+// Show the camera's current scene in the area like display_frame would. The
+// first frame, and any frame shown in a different area than the last, is sent
+// in full. Otherwise, each row is compared with the last frame's and only the
+// runs of cells that changed are drawn.
+void present_frame(struct presenter *pr, d3d_camera *cam,
+	const struct screen_area *area, struct color_map *colors);
+
+// Something given each run of cells that changed by presenter_update. The run
+// is the n pixels starting at (x, y) on the screen, from left to right.
+typedef void (*present_run)(void *arg, int x, int y, const d3d_pixel *pixels,
+	size_t n);
+
+// Bring the presenter up to date with the camera's scene like present_frame,
+// but give each run of cells that changed to emit along with arg instead of
+// drawing it with curses.
+void presenter_update(struct presenter *pr, d3d_camera *cam,
+	const struct screen_area *area, present_run emit, void *arg);
+
+// Note that something else was drawn over width cells of the screen starting at
+// (x, y), so the presenter must draw those cells again next time. Cells outside
+// the presenter's area are ignored.
+void presenter_damage(struct presenter *pr, int x, int y, int width);
+
+// Forget what has been shown, so that the next frame is sent in full.
+void presenter_invalidate(struct presenter *pr);
+
+// Free resources associated with the presenter.
+void presenter_destroy(struct presenter *pr);
+
+// Create a camera with the given positive dimensions. It draws with several
+// threads if it can.
 d3d_camera *camera_with_dims(int width, int height);
 
 // Sets the user-visible application title if possible.
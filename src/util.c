@@ -144,6 +144,20 @@ void move_direction(d3d_direction dir, size_t *x, size_t *y)
 	}
 }
 
+size_t count_processors(void)
+{
+#if defined(_WIN32)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors > 0 ? info.dwNumberOfProcessors : 1;
+#elif defined(_SC_NPROCESSORS_ONLN)
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (size_t)n : 1;
+#else
+	return 1;
+#endif
+}
+
 void vec_norm_mul(d3d_vec_s *vec, d3d_scalar mag)
 {
 	d3d_scalar hyp = hypot(vec->x, vec->y);
@@ -44,6 +44,9 @@ void subst_native_dir_sep(char *path);
 // Move x OR y in the direction dir. Underflow in x or y is NOT accounted for.
 void move_direction(d3d_direction dir, size_t *x, size_t *y);
 
+// Get the number of processors available, or 1 if that can't be determined.
+size_t count_processors(void);
+
 // Normalizes the vector to the given magnitude, which may be positive or
 // negative. If the vector is zero, it is unaffected.
 void vec_norm_mul(d3d_vec_s *vec, d3d_scalar mag);
@@ -61,11 +64,12 @@ void vec_norm_mul(d3d_vec_s *vec, d3d_scalar mag);
 #define CLAMP(num, min, max) \
 	((num) < (min) ? (min) : ((num) > (max) ? (max) : (num)))
 
-// The constant pi.
-#define PI 3.14159265358979323846
+// The constant pi, as a d3d_scalar so that it doesn't bring double arithmetic
+// into builds with other scalar types.
+#define PI ((d3d_scalar)3.14159265358979323846)
 
 // Convert the expression to a string after substitution. For example,
-// STRINGIFY(PI) would become "3.1415...".
+// STRINGIFY(FRAME_DELAY) would become "30".
 #define STRINGIFY(x) STRINGIFY_(x)
 #define STRINGIFY_(x) #x
 